@@ -6,100 +6,47 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <pthread.h>
 
-#define BASE_PORT 15700
+#include "dsm.h"
+
+#define BASE_PORT DSM_PORTA_BASE
 #define MAX_BUFFER_SIZE 8192
 #define COORDENADOR_RANK 0
+#define TESTE_PIPELINE_PEDIDOS 64
+#define TESTE_TRAVA_THREADS 4
+#define TESTE_TRAVA_INCREMENTOS 50
+#define TESTE_TRAVA_ID 7
+#define TESTE_BARREIRA_ID 3
+#define TESTE_ATOMICO_POSICAO 40
 
 typedef unsigned char byte;
 
-#define SUCESSO 0
-#define ERRO_MEMORIA_INEXISTENTE -2
-#define ERRO_COMANDO_DESCONHECIDO -3
-#define ERRO_FALHA_OBTER_BLOCO -4
-#define ERRO_CONEXAO -10
-
-#define CMD_OBTER_DADOS 1
-#define CMD_SALVAR_DADOS 2
-
 int recv_all(int sock, char *buffer, int len);
 
-int le(int posicao, byte *buffer, int tamanho)
-{
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0)
-        return ERRO_CONEXAO;
-    struct sockaddr_in server;
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server.sin_family = AF_INET;
-    server.sin_port = htons(BASE_PORT + COORDENADOR_RANK);
-    if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0)
-    {
-        close(s);
-        return ERRO_CONEXAO;
-    }
-
-    uint32_t comando_net = htonl(CMD_OBTER_DADOS);
-    uint32_t pos_net = htonl(posicao);
-    uint32_t tam_net = htonl(tamanho);
-    send(s, &comando_net, sizeof(uint32_t), 0);
-    send(s, &pos_net, sizeof(uint32_t), 0);
-    send(s, &tam_net, sizeof(uint32_t), 0);
+DsmCliente *coordenador = NULL;
+const char *host_coordenador = "127.0.0.1";
+int porta_coordenador = BASE_PORT + COORDENADOR_RANK;
 
-    uint32_t status_net;
-    if (recv_all(s, (char *)&status_net, sizeof(uint32_t)) < 0)
-    {
-        close(s);
-        return ERRO_CONEXAO;
-    }
-    int status = ntohl(status_net);
-
-    if (status == SUCESSO)
+/* Conexao persistente com o coordenador, refeita se tiver caido. */
+DsmCliente *conexao_coordenador()
+{
+    if (!dsm_conectado(coordenador))
     {
-        if (recv_all(s, (char *)buffer, tamanho) < 0)
-        {
-            close(s);
-            return ERRO_CONEXAO;
-        }
+        dsm_desconectar(coordenador);
+        coordenador = dsm_conectar(host_coordenador, porta_coordenador);
     }
+    return coordenador;
+}
 
-    close(s);
-    return status;
+int le(int posicao, byte *buffer, int tamanho)
+{
+    return dsm_le(conexao_coordenador(), posicao, buffer, tamanho);
 }
 
 int escreve(int posicao, byte *buffer, int tamanho)
 {
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0)
-        return ERRO_CONEXAO;
-    struct sockaddr_in server;
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server.sin_family = AF_INET;
-    server.sin_port = htons(BASE_PORT + COORDENADOR_RANK);
-    if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0)
-    {
-        close(s);
-        return ERRO_CONEXAO;
-    }
-
-    uint32_t comando_net = htonl(CMD_SALVAR_DADOS);
-    uint32_t pos_net = htonl(posicao);
-    uint32_t tam_net = htonl(tamanho);
-    send(s, &comando_net, sizeof(uint32_t), 0);
-    send(s, &pos_net, sizeof(uint32_t), 0);
-    send(s, &tam_net, sizeof(uint32_t), 0);
-    send(s, buffer, tamanho, 0);
-
-    uint32_t status_net;
-    if (recv_all(s, (char *)&status_net, sizeof(uint32_t)) < 0)
-    {
-        close(s);
-        return ERRO_CONEXAO;
-    }
-    int status = ntohl(status_net);
-
-    close(s);
-    return status;
+    return dsm_escreve(conexao_coordenador(), posicao, buffer, tamanho);
 }
 
 void traduzir_erro(int codigo_erro)
@@ -119,6 +66,21 @@ void traduzir_erro(int codigo_erro)
     case ERRO_FALHA_OBTER_BLOCO:
         printf("Falha ao obter um bloco remoto necessario para a operacao.\n");
         break;
+    case ERRO_FALHA_ATUALIZAR_BLOCO:
+        printf("Um dos donos dos blocos nao confirmou a escrita.\n");
+        break;
+    case ERRO_OCUPADO:
+        printf("A trava ou barreira ainda nao esta disponivel.\n");
+        break;
+    case ERRO_PROTOCOLO:
+        printf("Resposta do servidor fora do protocolo esperado.\n");
+        break;
+    case ERRO_SINCRONIZACAO:
+        printf("Operacao de sincronizacao invalida (trava de outra conexao ou barreira inconsistente).\n");
+        break;
+    case ERRO_OPERACAO_INVALIDA:
+        printf("Operacao atomica invalida (largura, operacao ou alinhamento).\n");
+        break;
     default:
         printf("Ocorreu um erro desconhecido (codigo %d).\n", codigo_erro);
         break;
@@ -150,7 +112,6 @@ void teste_escrita_leitura_simples_local()
     printf("1.1. Escrevendo o texto '%s' na posicao %d...\n", dados_escrita, pos);
     int status = escreve(pos, (byte *)dados_escrita, tam);
     run_test("Escrita em Bloco Unico", status, SUCESSO);
-    sleep(1);
 
     printf("1.2. Lendo de volta %d bytes da posicao %d para verificar...\n", tam, pos);
     status = le(pos, buffer_leitura, tam);
@@ -173,7 +134,6 @@ void teste_escrita_leitura_multibloco_remoto()
     printf("2.1. Escrevendo o texto '%s' na posicao %d...\n", dados_escrita, pos);
     int status = escreve(pos, (byte *)dados_escrita, tam);
     run_test("Escrita Multi-Bloco", status, SUCESSO);
-    sleep(2);
 
     printf("2.2. Lendo de volta %d bytes da posicao %d para verificar...\n", tam, pos);
     status = le(pos, buffer_leitura, tam);
@@ -194,23 +154,18 @@ void teste_invalidacao_cache()
 
     printf("3.1. Escrevendo '%s' no Bloco 4 (do P2) para o estado inicial.\n", dados_antigos);
     escreve(33, (byte *)dados_antigos, strlen(dados_antigos));
-    sleep(1);
 
     printf("3.2. Lendo Bloco 2 (do P1) e Bloco 6 (do P3) para preencher a cache do P0 e deixar o Bloco 4 de fora.\n");
     le(17, buffer, 1);
-    sleep(1);
     le(49, buffer, 1);
-    sleep(1);
 
     printf("3.3. Lendo Bloco 4 (do P2) pela primeira vez. Isso causará um cache miss e o bloco será adicionado à cache do P0.\n");
     le(33, buffer, strlen(dados_antigos));
     printf("   -> Dados Lidos: '%.*s'\n", (int)strlen(dados_antigos), buffer);
     run_test("Leitura para popular cache", SUCESSO, SUCESSO);
-    sleep(1);
 
     printf("3.4. Escrevendo '%s' no Bloco 4. Isso deve gerar uma mensagem de invalidação para o P0.\n", dados_novos);
     escreve(33, (byte *)dados_novos, strlen(dados_novos));
-    sleep(1);
 
     printf("3.5. Lendo Bloco 4 novamente. O P0 deve ter um cache miss (pois sua cópia foi invalidada) e buscar o novo valor na rede.\n");
     int status = le(33, buffer, strlen(dados_novos));
@@ -243,9 +198,9 @@ void teste_comando_invalido()
         return;
     }
     struct sockaddr_in server;
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server.sin_addr.s_addr = inet_addr(host_coordenador);
     server.sin_family = AF_INET;
-    server.sin_port = htons(BASE_PORT + COORDENADOR_RANK);
+    server.sin_port = htons(porta_coordenador);
     if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0)
     {
         printf("Falha ao conectar para o teste.\n");
@@ -264,8 +219,296 @@ void teste_comando_invalido()
     run_test("Comando Invalido", status, ERRO_COMANDO_DESCONHECIDO);
 }
 
+void mostrar_estatisticas()
+{
+    printf("\n--- Estatisticas dos Servidores ---\n");
+    DsmLayout layout;
+    int status = conexao_coordenador() ? dsm_obter_layout(coordenador, &layout) : ERRO_CONEXAO;
+    if (status != SUCESSO)
+    {
+        traduzir_erro(status);
+        return;
+    }
+    for (int rank = 0; rank < layout.num_processos; rank++)
+    {
+        DsmCliente *cliente = dsm_conectar(layout.enderecos[rank].host, layout.enderecos[rank].porta);
+        if (!cliente)
+        {
+            printf("P%d (%s:%d) nao respondeu.\n", rank, layout.enderecos[rank].host, layout.enderecos[rank].porta);
+            continue;
+        }
+        char *texto = NULL;
+        status = dsm_estatisticas(cliente, &texto);
+        dsm_desconectar(cliente);
+        if (status != SUCESSO)
+        {
+            traduzir_erro(status);
+            continue;
+        }
+        printf("%s\n", texto);
+        free(texto);
+    }
+    dsm_liberar_layout(&layout);
+}
+
+typedef struct
+{
+    int concluidos;
+    int falhas;
+} ResultadoPipeline;
+
+void contar_leitura(void *contexto, uint32_t id, int status)
+{
+    ResultadoPipeline *resultado = contexto;
+    resultado->concluidos++;
+    if (status != SUCESSO)
+        resultado->falhas++;
+}
+
+void teste_pipeline()
+{
+    printf("\n--- INICIANDO Teste 7: Leituras em Pipeline na Mesma Conexao ---\n");
+    char *dados_escrita = "PIPELINE";
+    int tam = strlen(dados_escrita);
+    int memoria_total = 10 * 8;
+    byte buffers[TESTE_PIPELINE_PEDIDOS][8];
+    ResultadoPipeline resultado = {0, 0};
+
+    printf("7.1. Escrevendo '%s' em todos os blocos sem esperar as respostas...\n", dados_escrita);
+    DsmCliente *cliente = conexao_coordenador();
+    for (int pos = 0; pos + tam <= memoria_total; pos += tam)
+        dsm_escrever_async(cliente, pos, dados_escrita, tam, contar_leitura, &resultado, NULL);
+    dsm_aguardar_todos(cliente);
+    run_test("Escritas em pipeline", resultado.falhas == 0 ? SUCESSO : ERRO_FALHA_ATUALIZAR_BLOCO, SUCESSO);
+
+    printf("7.2. Enviando %d leituras de 1 byte antes de receber qualquer resposta...\n", TESTE_PIPELINE_PEDIDOS);
+    resultado.concluidos = resultado.falhas = 0;
+    for (int i = 0; i < TESTE_PIPELINE_PEDIDOS; i++)
+        dsm_ler_async(cliente, i % memoria_total, buffers[i], 1, contar_leitura, &resultado, NULL);
+    dsm_aguardar_todos(cliente);
+    int corretos = 0;
+    for (int i = 0; i < TESTE_PIPELINE_PEDIDOS; i++)
+        if (buffers[i][0] == (byte)dados_escrita[(i % memoria_total) % tam])
+            corretos++;
+    printf("   -> Respostas: %d, corretas: %d\n", resultado.concluidos, corretos);
+    run_test("Leituras em pipeline", resultado.falhas == 0 ? SUCESSO : ERRO_FALHA_OBTER_BLOCO, SUCESSO);
+    printf("   -> Verificacao: %s\n", corretos == TESTE_PIPELINE_PEDIDOS ? "OK" : "FALHOU");
+}
+
+void teste_roteamento_direto()
+{
+    printf("\n--- INICIANDO Teste 8: Roteamento Direto ao Dono ---\n");
+    char *dados_escrita = "ROTEAMENTO DIRETO AO DONO";
+    int pos = 12;
+    int tam = strlen(dados_escrita);
+    byte buffer_leitura[50] = {0};
+
+    printf("8.1. Conectando pelo P1 e obtendo o layout do cluster...\n");
+    DsmLayout layout_coordenador;
+    DsmCluster *cluster = NULL;
+    if (conexao_coordenador() && dsm_obter_layout(coordenador, &layout_coordenador) == SUCESSO)
+    {
+        DsmEndereco *entrada = &layout_coordenador.enderecos[layout_coordenador.num_processos > 1 ? 1 : 0];
+        cluster = dsm_cluster_conectar(entrada->host, entrada->porta);
+        dsm_liberar_layout(&layout_coordenador);
+    }
+    if (!cluster)
+    {
+        run_test("Obter layout", ERRO_CONEXAO, SUCESSO);
+        return;
+    }
+    const DsmLayout *layout = dsm_cluster_layout(cluster);
+    printf("   -> %d processos, %d blocos de %d bytes.\n", layout->num_processos, layout->num_blocos, layout->tam_bloco);
+    for (int id = (pos / layout->tam_bloco); id <= (pos + tam - 1) / layout->tam_bloco; id++)
+        printf("   -> Bloco %d pertence ao P%d.\n", id, dsm_dono_do_bloco(layout, id));
+
+    printf("8.2. Escrevendo '%s' na posicao %d, um trecho por dono...\n", dados_escrita, pos);
+    int status = dsm_cluster_escreve(cluster, pos, dados_escrita, tam);
+    run_test("Escrita direta aos donos", status, SUCESSO);
+
+    printf("8.3. Lendo de volta pelos donos...\n");
+    status = dsm_cluster_le(cluster, pos, buffer_leitura, tam);
+    run_test("Leitura direta dos donos", status, SUCESSO);
+    if (status == SUCESSO)
+    {
+        printf("   -> Dados Lidos: '%.*s'\n", tam, buffer_leitura);
+        printf("   -> Verificacao: %s\n", strncmp((char *)buffer_leitura, dados_escrita, tam) == 0 ? "OK" : "FALHOU");
+    }
+
+    printf("8.4. Lendo o mesmo trecho pelo coordenador...\n");
+    memset(buffer_leitura, 0, sizeof(buffer_leitura));
+    status = le(pos, buffer_leitura, tam);
+    run_test("Leitura pelo coordenador", status, SUCESSO);
+    if (status == SUCESSO)
+        printf("   -> Verificacao: %s\n", strncmp((char *)buffer_leitura, dados_escrita, tam) == 0 ? "OK" : "FALHOU");
+    dsm_cluster_desconectar(cluster);
+}
+
+/* Cada thread fala com um processo diferente e soma 1 ao contador (4 bytes na
+   posicao 0) dentro da trava, varias vezes; depois todas passam pela barreira e
+   leem o total. */
+typedef struct
+{
+    DsmEndereco endereco;
+    int falhas;
+    uint32_t total_lido;
+} ThreadTrava;
+
+void *incrementar_com_trava(void *arg)
+{
+    ThreadTrava *t = arg;
+    DsmCliente *cliente = dsm_conectar(t->endereco.host, t->endereco.porta);
+    if (!cliente)
+    {
+        t->falhas++;
+        return NULL;
+    }
+    for (int i = 0; i < TESTE_TRAVA_INCREMENTOS; i++)
+    {
+        uint32_t contador;
+        if (dsm_adquirir(cliente, TESTE_TRAVA_ID) != SUCESSO)
+        {
+            t->falhas++;
+            continue;
+        }
+        if (dsm_le(cliente, 0, &contador, sizeof(contador)) != SUCESSO)
+            t->falhas++;
+        contador++;
+        if (dsm_escreve(cliente, 0, &contador, sizeof(contador)) != SUCESSO)
+            t->falhas++;
+        if (dsm_liberar(cliente, TESTE_TRAVA_ID) != SUCESSO)
+            t->falhas++;
+    }
+    if (dsm_barreira(cliente, TESTE_BARREIRA_ID, TESTE_TRAVA_THREADS) != SUCESSO ||
+        dsm_le(cliente, 0, &t->total_lido, sizeof(t->total_lido)) != SUCESSO)
+        t->falhas++;
+    dsm_desconectar(cliente);
+    return NULL;
+}
+
+void teste_travas_barreira()
+{
+    printf("\n--- INICIANDO Teste 9: Contador com Trava e Barreira ---\n");
+    DsmLayout layout;
+    if (!conexao_coordenador() || dsm_obter_layout(coordenador, &layout) != SUCESSO)
+    {
+        run_test("Obter layout", ERRO_CONEXAO, SUCESSO);
+        return;
+    }
+    printf("9.1. Liberando uma trava que esta conexao nao adquiriu...\n");
+    run_test("Liberar sem adquirir", dsm_liberar(coordenador, TESTE_TRAVA_ID), ERRO_SINCRONIZACAO);
+
+    printf("9.2. Zerando o contador na posicao 0...\n");
+    uint32_t zero = 0;
+    run_test("Zerar contador", escreve(0, (byte *)&zero, sizeof(zero)), SUCESSO);
+
+    printf("9.3. %d threads, uma por processo, somando %d vezes cada dentro da trava %d...\n", TESTE_TRAVA_THREADS,
+           TESTE_TRAVA_INCREMENTOS, TESTE_TRAVA_ID);
+    ThreadTrava threads[TESTE_TRAVA_THREADS];
+    pthread_t ids[TESTE_TRAVA_THREADS];
+    for (int i = 0; i < TESTE_TRAVA_THREADS; i++)
+    {
+        threads[i].endereco = layout.enderecos[i % layout.num_processos];
+        threads[i].falhas = 0;
+        threads[i].total_lido = 0;
+        pthread_create(&ids[i], NULL, incrementar_com_trava, &threads[i]);
+    }
+    int falhas = 0, corretos = 0;
+    uint32_t esperado = TESTE_TRAVA_THREADS * TESTE_TRAVA_INCREMENTOS;
+    for (int i = 0; i < TESTE_TRAVA_THREADS; i++)
+    {
+        pthread_join(ids[i], NULL);
+        falhas += threads[i].falhas;
+        if (threads[i].total_lido == esperado)
+            corretos++;
+    }
+    dsm_liberar_layout(&layout);
+    run_test("Operacoes com trava e barreira", falhas == 0 ? SUCESSO : ERRO_SINCRONIZACAO, SUCESSO);
+    printf("9.4. Depois da barreira, %d de %d threads leram o total %u.\n", corretos, TESTE_TRAVA_THREADS, esperado);
+    printf("   -> Verificacao: %s\n", corretos == TESTE_TRAVA_THREADS ? "OK" : "FALHOU");
+}
+
+/* Como no teste 9, mas sem trava: cada thread soma 1 ao contador de 8 bytes com
+   DSM_SOMAR, que o dono do bloco executa. */
+void *incrementar_atomico(void *arg)
+{
+    ThreadTrava *t = arg;
+    DsmCliente *cliente = dsm_conectar(t->endereco.host, t->endereco.porta);
+    if (!cliente)
+    {
+        t->falhas++;
+        return NULL;
+    }
+    for (int i = 0; i < TESTE_TRAVA_INCREMENTOS; i++)
+        if (dsm_atomico(cliente, DSM_SOMAR, TESTE_ATOMICO_POSICAO, 8, 1, 0, NULL) != SUCESSO)
+            t->falhas++;
+    dsm_desconectar(cliente);
+    return NULL;
+}
+
+void teste_atomicos()
+{
+    printf("\n--- INICIANDO Teste 10: Operacoes Atomicas ---\n");
+    DsmLayout layout;
+    if (!conexao_coordenador() || dsm_obter_layout(coordenador, &layout) != SUCESSO)
+    {
+        run_test("Obter layout", ERRO_CONEXAO, SUCESSO);
+        return;
+    }
+    printf("10.1. Zerando o contador de 8 bytes na posicao %d...\n", TESTE_ATOMICO_POSICAO);
+    uint64_t anterior = 0, contador = 0;
+    run_test("Zerar contador", escreve(TESTE_ATOMICO_POSICAO, (byte *)&contador, sizeof(contador)), SUCESSO);
+
+    printf("10.2. %d threads, uma por processo, somando %d vezes cada sem trava...\n", TESTE_TRAVA_THREADS,
+           TESTE_TRAVA_INCREMENTOS);
+    ThreadTrava threads[TESTE_TRAVA_THREADS];
+    pthread_t ids[TESTE_TRAVA_THREADS];
+    for (int i = 0; i < TESTE_TRAVA_THREADS; i++)
+    {
+        threads[i].endereco = layout.enderecos[i % layout.num_processos];
+        threads[i].falhas = 0;
+        pthread_create(&ids[i], NULL, incrementar_atomico, &threads[i]);
+    }
+    int falhas = 0;
+    for (int i = 0; i < TESTE_TRAVA_THREADS; i++)
+    {
+        pthread_join(ids[i], NULL);
+        falhas += threads[i].falhas;
+    }
+    dsm_liberar_layout(&layout);
+    run_test("Somas atomicas", falhas == 0 ? SUCESSO : ERRO_FALHA_ATUALIZAR_BLOCO, SUCESSO);
+    uint64_t esperado = TESTE_TRAVA_THREADS * TESTE_TRAVA_INCREMENTOS;
+    int status = le(TESTE_ATOMICO_POSICAO, (byte *)&contador, sizeof(contador));
+    run_test("Leitura do contador", status, SUCESSO);
+    printf("   -> Total lido: %llu (esperado %llu)\n", (unsigned long long)contador, (unsigned long long)esperado);
+    printf("   -> Verificacao: %s\n", status == SUCESSO && contador == esperado ? "OK" : "FALHOU");
+
+    printf("10.3. COMPARAR_TROCAR de %llu para 1: deve ter efeito so na primeira vez...\n",
+           (unsigned long long)esperado);
+    int efeitos = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        status = dsm_atomico(coordenador, DSM_COMPARAR_TROCAR, TESTE_ATOMICO_POSICAO, 8, 1, esperado, &anterior);
+        run_test("Comparar e trocar", status, SUCESSO);
+        if (status == SUCESSO && anterior == esperado)
+            efeitos++;
+    }
+    printf("   -> Verificacao: %s\n", efeitos == 1 ? "OK" : "FALHOU");
+
+    printf("10.4. Pedindo uma palavra de 3 bytes e uma palavra de 8 bytes desalinhada...\n");
+    run_test("Largura invalida", dsm_atomico(coordenador, DSM_TROCAR, TESTE_ATOMICO_POSICAO, 3, 0, 0, NULL),
+             ERRO_OPERACAO_INVALIDA);
+    run_test("Palavra desalinhada", dsm_atomico(coordenador, DSM_TROCAR, TESTE_ATOMICO_POSICAO + 1, 8, 0, 0, NULL),
+             ERRO_OPERACAO_INVALIDA);
+}
+
 int main(int argc, char *argv[])
 {
+    /* ./cliente [host] [porta]: endereco do coordenador; os outros ranks vem do layout. */
+    if (argc > 1)
+        host_coordenador = argv[1];
+    if (argc > 2)
+        porta_coordenador = atoi(argv[2]);
     int escolha = -1;
     char buffer_entrada[20];
     while (1)
@@ -277,6 +520,11 @@ int main(int argc, char *argv[])
         printf("3. Teste de Coerência de Cache (Invalidação e FIFO)\n");
         printf("4. Teste de Erro: Acesso Fora dos Limites\n");
         printf("5. Teste de Erro: Comando Inválido\n");
+        printf("6. Estatisticas dos Servidores\n");
+        printf("7. Teste de Leituras em Pipeline\n");
+        printf("8. Teste de Roteamento Direto ao Dono\n");
+        printf("9. Teste de Trava e Barreira\n");
+        printf("10. Teste de Operacoes Atomicas\n");
         printf("0. Sair\n");
         printf("Escolha uma opcao: ");
         if (fgets(buffer_entrada, sizeof(buffer_entrada), stdin) != NULL)
@@ -303,11 +551,27 @@ int main(int argc, char *argv[])
         case 5:
             teste_comando_invalido();
             break;
+        case 6:
+            mostrar_estatisticas();
+            break;
+        case 7:
+            teste_pipeline();
+            break;
+        case 8:
+            teste_roteamento_direto();
+            break;
+        case 9:
+            teste_travas_barreira();
+            break;
+        case 10:
+            teste_atomicos();
+            break;
         case 0:
             printf("Encerrando cliente.\n");
+            dsm_desconectar(coordenador);
             return 0;
         default:
-            printf("\nOpcao invalida! Por favor, escolha um numero de 0 a 5.\n");
+            printf("\nOpcao invalida! Por favor, escolha um numero de 0 a 10.\n");
             break;
         }
     }
@@ -0,0 +1,875 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "dsm.h"
+#include "protocolo.h"
+
+#define CMD_OBTER_DADOS 1
+#define CMD_SALVAR_DADOS 2
+#define CMD_ESTATISTICAS 10
+#define CMD_OBTER_LAYOUT 11
+#define CMD_ADQUIRIR 14
+#define CMD_LIBERAR 15
+#define CMD_BARREIRA 16
+#define CMD_ATOMICO 20
+
+/* Espera entre tentativas de ADQUIRIR e BARREIRA, dobrando a cada tentativa. */
+#define DSM_ESPERA_MINIMA_US 50
+#define DSM_ESPERA_MAXIMA_US 20000
+
+#ifdef MSG_NOSIGNAL
+#define FLAGS_ENVIO MSG_NOSIGNAL
+#else
+#define FLAGS_ENVIO 0
+#endif
+
+typedef struct PedidoDsm
+{
+    uint32_t id;
+    int comando;
+    char *destino;
+    int tamanho;
+    char **texto;
+    DsmCallback callback;
+    void *contexto;
+    struct PedidoDsm *proximo;
+} PedidoDsm;
+
+/* O servidor responde aos comandos de uma conexao em ordem, entao os pedidos
+   pendentes ficam numa fila e cada resposta pertence ao primeiro da fila. */
+struct DsmCliente
+{
+    char host[DSM_TAM_HOST];
+    int sock;
+    int ativo;
+    uint32_t proximo_id;
+    uint32_t concluidos;
+    int pendentes;
+    PedidoDsm *primeiro;
+    PedidoDsm *ultimo;
+    char *buffer_envio;
+    int capacidade_envio;
+    pthread_mutex_t lock_envio;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t receptora;
+    struct DsmCliente *anterior;
+};
+
+struct DsmCluster
+{
+    int rank_entrada;
+    DsmLayout layout;
+    DsmCliente **conexoes;
+    uint32_t proximo_id;
+    pthread_mutex_t lock;
+};
+
+typedef struct
+{
+    int status;
+} EsperaDsm;
+
+/* Operacao de cluster dividida em trechos; restantes comeca com um a mais para que
+   a operacao nao termine enquanto os trechos ainda estao sendo enviados. */
+typedef struct
+{
+    uint32_t id;
+    int restantes;
+    int status;
+    DsmCallback callback;
+    void *contexto;
+} OperacaoCluster;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int concluido;
+    int status;
+} EsperaCluster;
+
+static int enviar_tudo(int sock, const char *buffer, int len)
+{
+    int total_enviado = 0;
+    while (total_enviado < len)
+    {
+        int enviados = send(sock, buffer + total_enviado, len - total_enviado, FLAGS_ENVIO);
+        if (enviados <= 0)
+            return -1;
+        total_enviado += enviados;
+    }
+    return total_enviado;
+}
+
+static int receber_tudo(int sock, char *buffer, int len)
+{
+    int total_recebido = 0;
+    while (total_recebido < len)
+    {
+        int recebidos = recv(sock, buffer + total_recebido, len - total_recebido, 0);
+        if (recebidos <= 0)
+            return -1;
+        total_recebido += recebidos;
+    }
+    return total_recebido;
+}
+
+static int descartar(int sock, uint32_t tam)
+{
+    char descarte[256];
+    while (tam > 0)
+    {
+        int n = tam < sizeof(descarte) ? tam : sizeof(descarte);
+        if (receber_tudo(sock, descarte, n) < 0)
+            return -1;
+        tam -= n;
+    }
+    return 0;
+}
+
+/* Le o quadro de resposta do primeiro pedido da fila. Um quadro de outra versao ou
+   que nao responde a esse pedido indica fluxo corrompido e derruba a conexao; um
+   payload de tamanho inesperado e descartado e o pedido falha com ERRO_PROTOCOLO,
+   sem afetar os seguintes. */
+static int receber_resposta(DsmCliente *cliente, PedidoDsm *pedido)
+{
+    char bruto[TAM_CABECALHO_QUADRO];
+    CabecalhoQuadro resposta;
+    if (receber_tudo(cliente->sock, bruto, sizeof(bruto)) < 0)
+        return ERRO_CONEXAO;
+    quadro_decodificar(bruto, &resposta);
+    if (resposta.magico != PROTOCOLO_MAGICO || resposta.versao != PROTOCOLO_VERSAO ||
+        !(resposta.flags & QUADRO_RESPOSTA) || resposta.id_pedido != pedido->id || resposta.opcode != pedido->comando)
+        return ERRO_CONEXAO;
+    int status = resposta.status;
+    uint32_t tam = resposta.tam_payload;
+    int esperado = -1;
+    if (pedido->comando == CMD_BARREIRA)
+        esperado = sizeof(uint32_t); /* a geracao vem com qualquer status */
+    else if (status == SUCESSO && (pedido->comando == CMD_OBTER_DADOS || pedido->comando == CMD_ATOMICO))
+        esperado = pedido->tamanho;
+    else if (status == SUCESSO && pedido->comando == CMD_OBTER_LAYOUT)
+    {
+        /* Campos fixos em destino; a tabela de pares, com dois campos por processo,
+           vai para um buffer alocado aqui. */
+        if (tam < (uint32_t)pedido->tamanho)
+            return descartar(cliente->sock, tam) < 0 ? ERRO_CONEXAO : ERRO_PROTOCOLO;
+        if (receber_tudo(cliente->sock, pedido->destino, pedido->tamanho) < 0)
+            return ERRO_CONEXAO;
+        int num_processos = ntohl(((uint32_t *)pedido->destino)[0]);
+        uint32_t tam_tabela = tam - pedido->tamanho;
+        if (num_processos <= 0 || tam_tabela != num_processos * 2 * sizeof(uint32_t))
+            return descartar(cliente->sock, tam_tabela) < 0 ? ERRO_CONEXAO : ERRO_PROTOCOLO;
+        char *tabela = malloc(tam_tabela);
+        if (!tabela || receber_tudo(cliente->sock, tabela, tam_tabela) < 0)
+        {
+            free(tabela);
+            return ERRO_CONEXAO;
+        }
+        *pedido->texto = tabela;
+        return status;
+    }
+    else if (status == SUCESSO && pedido->comando == CMD_ESTATISTICAS)
+    {
+        /* [tamanho][texto] */
+        uint32_t tam_net;
+        if (tam < sizeof(uint32_t))
+            return descartar(cliente->sock, tam) < 0 ? ERRO_CONEXAO : ERRO_PROTOCOLO;
+        if (receber_tudo(cliente->sock, (char *)&tam_net, sizeof(uint32_t)) < 0)
+            return ERRO_CONEXAO;
+        tam -= sizeof(uint32_t);
+        if (ntohl(tam_net) != tam)
+            return descartar(cliente->sock, tam) < 0 ? ERRO_CONEXAO : ERRO_PROTOCOLO;
+        char *texto = malloc(tam + 1);
+        if (!texto || receber_tudo(cliente->sock, texto, tam) < 0)
+        {
+            free(texto);
+            return ERRO_CONEXAO;
+        }
+        texto[tam] = '\0';
+        *pedido->texto = texto;
+        return status;
+    }
+    if (esperado < 0 || tam != (uint32_t)esperado)
+    {
+        if (descartar(cliente->sock, tam) < 0)
+            return ERRO_CONEXAO;
+        return esperado < 0 ? status : ERRO_PROTOCOLO;
+    }
+    if (tam > 0 && receber_tudo(cliente->sock, pedido->destino, tam) < 0)
+        return ERRO_CONEXAO;
+    return status;
+}
+
+static void concluir(DsmCliente *cliente, PedidoDsm *pedido, int status)
+{
+    if (pedido->callback)
+        pedido->callback(pedido->contexto, pedido->id, status);
+    free(pedido);
+    pthread_mutex_lock(&cliente->lock);
+    cliente->concluidos++;
+    cliente->pendentes--;
+    pthread_cond_broadcast(&cliente->cond);
+    pthread_mutex_unlock(&cliente->lock);
+}
+
+/* Com a conexao perdida, todos os pedidos ainda na fila falham com ERRO_CONEXAO. */
+static void falhar_pendentes(DsmCliente *cliente)
+{
+    pthread_mutex_lock(&cliente->lock);
+    cliente->ativo = 0;
+    PedidoDsm *pedido = cliente->primeiro;
+    cliente->primeiro = cliente->ultimo = NULL;
+    pthread_cond_broadcast(&cliente->cond);
+    pthread_mutex_unlock(&cliente->lock);
+    shutdown(cliente->sock, SHUT_RDWR);
+    while (pedido)
+    {
+        PedidoDsm *proximo = pedido->proximo;
+        concluir(cliente, pedido, ERRO_CONEXAO);
+        pedido = proximo;
+    }
+}
+
+static void *executar_receptora(void *arg)
+{
+    DsmCliente *cliente = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&cliente->lock);
+        while (!cliente->primeiro && cliente->ativo)
+            pthread_cond_wait(&cliente->cond, &cliente->lock);
+        PedidoDsm *pedido = cliente->primeiro;
+        pthread_mutex_unlock(&cliente->lock);
+        if (!pedido)
+            return NULL;
+        int status = receber_resposta(cliente, pedido);
+        if (status == ERRO_CONEXAO)
+        {
+            falhar_pendentes(cliente);
+            return NULL;
+        }
+        pthread_mutex_lock(&cliente->lock);
+        cliente->primeiro = pedido->proximo;
+        if (!cliente->primeiro)
+            cliente->ultimo = NULL;
+        pthread_mutex_unlock(&cliente->lock);
+        concluir(cliente, pedido, status);
+    }
+}
+
+DsmCliente *dsm_conectar(const char *host, int porta)
+{
+    if (strlen(host) >= DSM_TAM_HOST)
+        return NULL;
+    struct addrinfo dicas, *resultado;
+    memset(&dicas, 0, sizeof(dicas));
+    dicas.ai_family = AF_INET;
+    dicas.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &dicas, &resultado) != 0)
+        return NULL;
+    struct sockaddr_in server;
+    memcpy(&server, resultado->ai_addr, sizeof(server));
+    server.sin_port = htons(porta);
+    freeaddrinfo(resultado);
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+        return NULL;
+    if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0)
+    {
+        close(s);
+        return NULL;
+    }
+    int opt = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+
+    DsmCliente *cliente = calloc(1, sizeof(DsmCliente));
+    if (!cliente)
+    {
+        close(s);
+        return NULL;
+    }
+    strcpy(cliente->host, host);
+    cliente->sock = s;
+    cliente->ativo = 1;
+    pthread_mutex_init(&cliente->lock_envio, NULL);
+    pthread_mutex_init(&cliente->lock, NULL);
+    pthread_cond_init(&cliente->cond, NULL);
+    if (pthread_create(&cliente->receptora, NULL, executar_receptora, cliente) != 0)
+    {
+        close(s);
+        free(cliente);
+        return NULL;
+    }
+    return cliente;
+}
+
+int dsm_conectado(DsmCliente *cliente)
+{
+    if (!cliente)
+        return 0;
+    pthread_mutex_lock(&cliente->lock);
+    int ativo = cliente->ativo;
+    pthread_mutex_unlock(&cliente->lock);
+    return ativo;
+}
+
+void dsm_desconectar(DsmCliente *cliente)
+{
+    if (!cliente)
+        return;
+    dsm_aguardar_todos(cliente);
+    pthread_mutex_lock(&cliente->lock);
+    cliente->ativo = 0;
+    pthread_cond_broadcast(&cliente->cond);
+    pthread_mutex_unlock(&cliente->lock);
+    shutdown(cliente->sock, SHUT_RDWR);
+    pthread_join(cliente->receptora, NULL);
+    close(cliente->sock);
+    pthread_mutex_destroy(&cliente->lock_envio);
+    pthread_mutex_destroy(&cliente->lock);
+    pthread_cond_destroy(&cliente->cond);
+    free(cliente->buffer_envio);
+    free(cliente);
+}
+
+/* Monta o quadro inteiro (cabecalho, campos do comando e dados) e o envia com uma
+   unica chamada. cabecalho[0] e o codigo do comando, que vai no opcode. O pedido
+   entra na fila antes do envio e sob lock_envio, entao a ordem da fila e a ordem dos
+   bytes no socket. */
+static int enviar_pedido(DsmCliente *cliente, const uint32_t *cabecalho, int campos,
+                         const void *dados, int tam_dados, PedidoDsm *modelo, uint32_t *id)
+{
+    if (!cliente)
+        return ERRO_CONEXAO;
+    int tam_cabecalho = TAM_CABECALHO_QUADRO + (campos - 1) * sizeof(uint32_t);
+    PedidoDsm *pedido = malloc(sizeof(PedidoDsm));
+    if (!pedido)
+        return ERRO_CONEXAO;
+    *pedido = *modelo;
+    pedido->proximo = NULL;
+
+    pthread_mutex_lock(&cliente->lock_envio);
+    if (cliente->capacidade_envio < tam_cabecalho + tam_dados)
+    {
+        char *novo = realloc(cliente->buffer_envio, tam_cabecalho + tam_dados);
+        if (!novo)
+        {
+            pthread_mutex_unlock(&cliente->lock_envio);
+            free(pedido);
+            return ERRO_CONEXAO;
+        }
+        cliente->buffer_envio = novo;
+        cliente->capacidade_envio = tam_cabecalho + tam_dados;
+    }
+    for (int i = 1; i < campos; i++)
+    {
+        uint32_t campo_net = htonl(cabecalho[i]);
+        memcpy(cliente->buffer_envio + TAM_CABECALHO_QUADRO + (i - 1) * sizeof(uint32_t), &campo_net,
+               sizeof(uint32_t));
+    }
+    if (tam_dados > 0)
+        memcpy(cliente->buffer_envio + tam_cabecalho, dados, tam_dados);
+
+    pthread_mutex_lock(&cliente->lock);
+    while (cliente->ativo && cliente->pendentes >= DSM_MAX_PENDENTES)
+        pthread_cond_wait(&cliente->cond, &cliente->lock);
+    if (!cliente->ativo)
+    {
+        pthread_mutex_unlock(&cliente->lock);
+        pthread_mutex_unlock(&cliente->lock_envio);
+        free(pedido);
+        return ERRO_CONEXAO;
+    }
+    pedido->id = cliente->proximo_id++;
+    if (id)
+        *id = pedido->id;
+    CabecalhoQuadro quadro = {PROTOCOLO_MAGICO, PROTOCOLO_VERSAO, (uint16_t)cabecalho[0], pedido->id, 0,
+                              tam_cabecalho - TAM_CABECALHO_QUADRO + tam_dados, SUCESSO};
+    quadro_codificar(&quadro, cliente->buffer_envio);
+    if (cliente->ultimo)
+        cliente->ultimo->proximo = pedido;
+    else
+        cliente->primeiro = pedido;
+    cliente->ultimo = pedido;
+    cliente->pendentes++;
+    pthread_cond_broadcast(&cliente->cond);
+    pthread_mutex_unlock(&cliente->lock);
+
+    /* Se o envio falhar, a receptora percebe a conexao fechada e conclui este pedido
+       (e os seguintes) com ERRO_CONEXAO pelo callback. */
+    if (enviar_tudo(cliente->sock, cliente->buffer_envio, tam_cabecalho + tam_dados) < 0)
+        shutdown(cliente->sock, SHUT_RDWR);
+    pthread_mutex_unlock(&cliente->lock_envio);
+    return SUCESSO;
+}
+
+int dsm_ler_async(DsmCliente *cliente, int posicao, void *buffer, int tamanho,
+                  DsmCallback callback, void *contexto, uint32_t *id)
+{
+    uint32_t cabecalho[3] = {CMD_OBTER_DADOS, (uint32_t)posicao, (uint32_t)tamanho};
+    PedidoDsm modelo = {0};
+    modelo.comando = CMD_OBTER_DADOS;
+    modelo.destino = buffer;
+    modelo.tamanho = tamanho;
+    modelo.callback = callback;
+    modelo.contexto = contexto;
+    return enviar_pedido(cliente, cabecalho, 3, NULL, 0, &modelo, id);
+}
+
+int dsm_escrever_async(DsmCliente *cliente, int posicao, const void *buffer, int tamanho,
+                       DsmCallback callback, void *contexto, uint32_t *id)
+{
+    uint32_t cabecalho[3] = {CMD_SALVAR_DADOS, (uint32_t)posicao, (uint32_t)tamanho};
+    PedidoDsm modelo = {0};
+    modelo.comando = CMD_SALVAR_DADOS;
+    modelo.callback = callback;
+    modelo.contexto = contexto;
+    return enviar_pedido(cliente, cabecalho, 3, buffer, tamanho > 0 ? tamanho : 0, &modelo, id);
+}
+
+void dsm_aguardar(DsmCliente *cliente, uint32_t id)
+{
+    if (!cliente)
+        return;
+    pthread_mutex_lock(&cliente->lock);
+    while ((int32_t)(id - cliente->concluidos) >= 0)
+        pthread_cond_wait(&cliente->cond, &cliente->lock);
+    pthread_mutex_unlock(&cliente->lock);
+}
+
+void dsm_aguardar_todos(DsmCliente *cliente)
+{
+    if (!cliente)
+        return;
+    pthread_mutex_lock(&cliente->lock);
+    while (cliente->pendentes > 0)
+        pthread_cond_wait(&cliente->cond, &cliente->lock);
+    pthread_mutex_unlock(&cliente->lock);
+}
+
+static void registrar_status(void *contexto, uint32_t id, int status)
+{
+    ((EsperaDsm *)contexto)->status = status;
+}
+
+int dsm_le(DsmCliente *cliente, int posicao, void *buffer, int tamanho)
+{
+    EsperaDsm espera;
+    uint32_t id;
+    int status = dsm_ler_async(cliente, posicao, buffer, tamanho, registrar_status, &espera, &id);
+    if (status != SUCESSO)
+        return status;
+    dsm_aguardar(cliente, id);
+    return espera.status;
+}
+
+int dsm_escreve(DsmCliente *cliente, int posicao, const void *buffer, int tamanho)
+{
+    EsperaDsm espera;
+    uint32_t id;
+    int status = dsm_escrever_async(cliente, posicao, buffer, tamanho, registrar_status, &espera, &id);
+    if (status != SUCESSO)
+        return status;
+    dsm_aguardar(cliente, id);
+    return espera.status;
+}
+
+int dsm_estatisticas(DsmCliente *cliente, char **texto)
+{
+    uint32_t cabecalho[1] = {CMD_ESTATISTICAS};
+    EsperaDsm espera;
+    uint32_t id;
+    PedidoDsm modelo = {0};
+    modelo.comando = CMD_ESTATISTICAS;
+    modelo.texto = texto;
+    modelo.callback = registrar_status;
+    modelo.contexto = &espera;
+    int status = enviar_pedido(cliente, cabecalho, 1, NULL, 0, &modelo, &id);
+    if (status != SUCESSO)
+        return status;
+    dsm_aguardar(cliente, id);
+    return espera.status;
+}
+
+int dsm_obter_layout(DsmCliente *cliente, DsmLayout *layout)
+{
+    uint32_t cabecalho[1] = {CMD_OBTER_LAYOUT};
+    uint32_t campos[4];
+    uint32_t *tabela = NULL;
+    EsperaDsm espera;
+    uint32_t id;
+    PedidoDsm modelo = {0};
+    modelo.comando = CMD_OBTER_LAYOUT;
+    modelo.destino = (char *)campos;
+    modelo.tamanho = sizeof(campos);
+    modelo.texto = (char **)&tabela;
+    modelo.callback = registrar_status;
+    modelo.contexto = &espera;
+    int status = enviar_pedido(cliente, cabecalho, 1, NULL, 0, &modelo, &id);
+    if (status != SUCESSO)
+        return status;
+    dsm_aguardar(cliente, id);
+    if (espera.status != SUCESSO)
+        return espera.status;
+    layout->num_processos = ntohl(campos[0]);
+    layout->num_blocos = ntohl(campos[1]);
+    layout->tam_bloco = ntohl(campos[2]);
+    layout->rank = ntohl(campos[3]);
+    layout->enderecos = calloc(layout->num_processos, sizeof(DsmEndereco));
+    if (!layout->enderecos)
+    {
+        free(tabela);
+        return ERRO_CONEXAO;
+    }
+    for (int r = 0; r < layout->num_processos; r++)
+    {
+        struct in_addr endereco;
+        endereco.s_addr = tabela[2 * r];
+        uint32_t ip = ntohl(endereco.s_addr);
+        if (ip == INADDR_ANY || (ip >> 24) == 127)
+            strcpy(layout->enderecos[r].host, cliente->host);
+        else
+            inet_ntop(AF_INET, &endereco, layout->enderecos[r].host, DSM_TAM_HOST);
+        layout->enderecos[r].porta = ntohl(tabela[2 * r + 1]);
+    }
+    free(tabela);
+    return SUCESSO;
+}
+
+static int pedido_sincronizacao(DsmCliente *cliente, int comando, const uint32_t *cabecalho, int campos,
+                                uint32_t *geracao)
+{
+    EsperaDsm espera;
+    uint32_t id;
+    PedidoDsm modelo = {0};
+    modelo.comando = comando;
+    modelo.destino = (char *)geracao;
+    modelo.callback = registrar_status;
+    modelo.contexto = &espera;
+    int status = enviar_pedido(cliente, cabecalho, campos, NULL, 0, &modelo, &id);
+    if (status != SUCESSO)
+        return status;
+    dsm_aguardar(cliente, id);
+    return espera.status;
+}
+
+static int proxima_espera(int espera_us)
+{
+    usleep(espera_us);
+    return espera_us * 2 < DSM_ESPERA_MAXIMA_US ? espera_us * 2 : DSM_ESPERA_MAXIMA_US;
+}
+
+int dsm_adquirir(DsmCliente *cliente, int trava)
+{
+    uint32_t cabecalho[2] = {CMD_ADQUIRIR, (uint32_t)trava};
+    int espera_us = DSM_ESPERA_MINIMA_US;
+    int status;
+    while ((status = pedido_sincronizacao(cliente, CMD_ADQUIRIR, cabecalho, 2, NULL)) == ERRO_OCUPADO)
+        espera_us = proxima_espera(espera_us);
+    return status;
+}
+
+int dsm_liberar(DsmCliente *cliente, int trava)
+{
+    uint32_t cabecalho[2] = {CMD_LIBERAR, (uint32_t)trava};
+    return pedido_sincronizacao(cliente, CMD_LIBERAR, cabecalho, 2, NULL);
+}
+
+int dsm_barreira(DsmCliente *cliente, int barreira, int participantes)
+{
+    uint32_t cabecalho[4] = {CMD_BARREIRA, (uint32_t)barreira, (uint32_t)participantes, 0};
+    uint32_t geracao_net;
+    int espera_us = DSM_ESPERA_MINIMA_US;
+    int status = pedido_sincronizacao(cliente, CMD_BARREIRA, cabecalho, 4, &geracao_net);
+    while (status == ERRO_OCUPADO)
+    {
+        espera_us = proxima_espera(espera_us);
+        cabecalho[3] = ntohl(geracao_net);
+        status = pedido_sincronizacao(cliente, CMD_BARREIRA, cabecalho, 4, &geracao_net);
+    }
+    return status;
+}
+
+int dsm_atomico(DsmCliente *cliente, int operacao, int posicao, int largura, uint64_t operando, uint64_t esperado,
+                uint64_t *anterior)
+{
+    uint32_t cabecalho[8] = {CMD_ATOMICO,          (uint32_t)posicao,          (uint32_t)operacao,
+                             (uint32_t)largura,    (uint32_t)(operando >> 32), (uint32_t)operando,
+                             (uint32_t)(esperado >> 32), (uint32_t)esperado};
+    uint32_t valor_net[2];
+    EsperaDsm espera;
+    uint32_t id;
+    PedidoDsm modelo = {0};
+    modelo.comando = CMD_ATOMICO;
+    modelo.destino = (char *)valor_net;
+    modelo.tamanho = sizeof(valor_net);
+    modelo.callback = registrar_status;
+    modelo.contexto = &espera;
+    int status = enviar_pedido(cliente, cabecalho, 8, NULL, 0, &modelo, &id);
+    if (status != SUCESSO)
+        return status;
+    dsm_aguardar(cliente, id);
+    if (espera.status == SUCESSO && anterior)
+        *anterior = ((uint64_t)ntohl(valor_net[0]) << 32) | ntohl(valor_net[1]);
+    return espera.status;
+}
+
+void dsm_liberar_layout(DsmLayout *layout)
+{
+    free(layout->enderecos);
+    layout->enderecos = NULL;
+}
+
+int dsm_dono_do_bloco(const DsmLayout *layout, int id_bloco)
+{
+    if (id_bloco < 0 || id_bloco >= layout->num_blocos || layout->num_processos <= 0)
+        return -1;
+    int blocos_por_processo = layout->num_blocos / layout->num_processos;
+    if (blocos_por_processo == 0)
+        return id_bloco % layout->num_processos;
+    int dono = id_bloco / blocos_por_processo;
+    return (dono >= layout->num_processos) ? layout->num_processos - 1 : dono;
+}
+
+DsmCluster *dsm_cluster_conectar(const char *host, int porta_entrada)
+{
+    DsmCliente *entrada = dsm_conectar(host, porta_entrada);
+    if (!entrada)
+        return NULL;
+    DsmLayout layout;
+    if (dsm_obter_layout(entrada, &layout) != SUCESSO)
+    {
+        dsm_desconectar(entrada);
+        return NULL;
+    }
+    if (layout.num_processos <= 0 || layout.rank < 0 || layout.rank >= layout.num_processos)
+    {
+        dsm_liberar_layout(&layout);
+        dsm_desconectar(entrada);
+        return NULL;
+    }
+    DsmCluster *cluster = calloc(1, sizeof(DsmCluster));
+    if (cluster)
+        cluster->conexoes = calloc(layout.num_processos, sizeof(DsmCliente *));
+    if (!cluster || !cluster->conexoes)
+    {
+        free(cluster);
+        dsm_liberar_layout(&layout);
+        dsm_desconectar(entrada);
+        return NULL;
+    }
+    cluster->layout = layout;
+    cluster->rank_entrada = layout.rank;
+    cluster->conexoes[layout.rank] = entrada;
+    pthread_mutex_init(&cluster->lock, NULL);
+    return cluster;
+}
+
+void dsm_cluster_desconectar(DsmCluster *cluster)
+{
+    if (!cluster)
+        return;
+    for (int r = 0; r < cluster->layout.num_processos; r++)
+    {
+        DsmCliente *cliente = cluster->conexoes[r];
+        while (cliente)
+        {
+            DsmCliente *anterior = cliente->anterior;
+            dsm_desconectar(cliente);
+            cliente = anterior;
+        }
+    }
+    pthread_mutex_destroy(&cluster->lock);
+    dsm_liberar_layout(&cluster->layout);
+    free(cluster->conexoes);
+    free(cluster);
+}
+
+const DsmLayout *dsm_cluster_layout(DsmCluster *cluster)
+{
+    return &cluster->layout;
+}
+
+/* Conexao com o dono, aberta (ou reaberta) sob demanda; cai para o processo de
+   entrada se o dono nao responder. */
+static DsmCliente *conexao_do_rank(DsmCluster *cluster, int rank)
+{
+    pthread_mutex_lock(&cluster->lock);
+    DsmCliente *cliente = cluster->conexoes[rank];
+    if (!dsm_conectado(cliente))
+    {
+        DsmEndereco *endereco = &cluster->layout.enderecos[rank];
+        DsmCliente *novo = dsm_conectar(endereco->host, endereco->porta);
+        if (novo)
+        {
+            /* A conexao caida pode ainda estar em uso por outra thread; so e liberada
+               junto com o cluster. */
+            novo->anterior = cliente;
+            cluster->conexoes[rank] = cliente = novo;
+        }
+        else if (rank != cluster->rank_entrada)
+        {
+            pthread_mutex_unlock(&cluster->lock);
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&cluster->lock);
+    return cliente;
+}
+
+static void concluir_trecho(void *contexto, uint32_t id, int status)
+{
+    OperacaoCluster *operacao = contexto;
+    if (status != SUCESSO)
+    {
+        int esperado = SUCESSO;
+        __atomic_compare_exchange_n(&operacao->status, &esperado, status, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (__atomic_sub_fetch(&operacao->restantes, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if (operacao->callback)
+            operacao->callback(operacao->contexto, operacao->id, __atomic_load_n(&operacao->status, __ATOMIC_RELAXED));
+        free(operacao);
+    }
+}
+
+static int enviar_cluster(DsmCluster *cluster, int escrita, int posicao, char *buffer, int tamanho,
+                          DsmCallback callback, void *contexto)
+{
+    if (!cluster)
+        return ERRO_CONEXAO;
+    OperacaoCluster *operacao = malloc(sizeof(OperacaoCluster));
+    if (!operacao)
+        return ERRO_CONEXAO;
+    operacao->id = __atomic_fetch_add(&cluster->proximo_id, 1, __ATOMIC_RELAXED);
+    operacao->restantes = 1;
+    operacao->status = SUCESSO;
+    operacao->callback = callback;
+    operacao->contexto = contexto;
+
+    const DsmLayout *layout = &cluster->layout;
+    int fim = posicao + tamanho;
+    int memoria_total = layout->num_blocos * layout->tam_bloco;
+    /* Fora dos limites o processo de entrada devolve o erro de sempre. */
+    int dividir = posicao >= 0 && tamanho > 0 && fim <= memoria_total;
+    int inicio = posicao;
+    while (inicio < fim || !dividir)
+    {
+        int rank = cluster->rank_entrada, fim_trecho = fim;
+        if (dividir)
+        {
+            int id_bloco = inicio / layout->tam_bloco;
+            rank = dsm_dono_do_bloco(layout, id_bloco);
+            while ((id_bloco + 1) * layout->tam_bloco < fim && dsm_dono_do_bloco(layout, id_bloco + 1) == rank)
+                id_bloco++;
+            fim_trecho = (id_bloco + 1) * layout->tam_bloco < fim ? (id_bloco + 1) * layout->tam_bloco : fim;
+        }
+        DsmCliente *cliente = conexao_do_rank(cluster, rank);
+        if (!cliente)
+            cliente = conexao_do_rank(cluster, cluster->rank_entrada);
+        __atomic_add_fetch(&operacao->restantes, 1, __ATOMIC_RELAXED);
+        int status;
+        if (escrita)
+            status = dsm_escrever_async(cliente, inicio, buffer + (inicio - posicao), fim_trecho - inicio,
+                                        concluir_trecho, operacao, NULL);
+        else
+            status = dsm_ler_async(cliente, inicio, buffer + (inicio - posicao), fim_trecho - inicio,
+                                   concluir_trecho, operacao, NULL);
+        if (status != SUCESSO)
+            concluir_trecho(operacao, 0, status);
+        if (!dividir)
+            break;
+        inicio = fim_trecho;
+    }
+    concluir_trecho(operacao, 0, SUCESSO);
+    return SUCESSO;
+}
+
+int dsm_cluster_ler_async(DsmCluster *cluster, int posicao, void *buffer, int tamanho,
+                          DsmCallback callback, void *contexto)
+{
+    return enviar_cluster(cluster, 0, posicao, buffer, tamanho, callback, contexto);
+}
+
+int dsm_cluster_escrever_async(DsmCluster *cluster, int posicao, const void *buffer, int tamanho,
+                               DsmCallback callback, void *contexto)
+{
+    return enviar_cluster(cluster, 1, posicao, (char *)buffer, tamanho, callback, contexto);
+}
+
+void dsm_cluster_aguardar_todos(DsmCluster *cluster)
+{
+    if (!cluster)
+        return;
+    pthread_mutex_lock(&cluster->lock);
+    for (int r = 0; r < cluster->layout.num_processos; r++)
+        dsm_aguardar_todos(cluster->conexoes[r]);
+    pthread_mutex_unlock(&cluster->lock);
+}
+
+static void sinalizar_espera(void *contexto, uint32_t id, int status)
+{
+    EsperaCluster *espera = contexto;
+    pthread_mutex_lock(&espera->lock);
+    espera->status = status;
+    espera->concluido = 1;
+    pthread_cond_signal(&espera->cond);
+    pthread_mutex_unlock(&espera->lock);
+}
+
+static int esperar_cluster(DsmCluster *cluster, int escrita, int posicao, char *buffer, int tamanho)
+{
+    EsperaCluster espera;
+    pthread_mutex_init(&espera.lock, NULL);
+    pthread_cond_init(&espera.cond, NULL);
+    espera.concluido = 0;
+    int status = enviar_cluster(cluster, escrita, posicao, buffer, tamanho, sinalizar_espera, &espera);
+    if (status == SUCESSO)
+    {
+        pthread_mutex_lock(&espera.lock);
+        while (!espera.concluido)
+            pthread_cond_wait(&espera.cond, &espera.lock);
+        status = espera.status;
+        pthread_mutex_unlock(&espera.lock);
+    }
+    pthread_mutex_destroy(&espera.lock);
+    pthread_cond_destroy(&espera.cond);
+    return status;
+}
+
+int dsm_cluster_le(DsmCluster *cluster, int posicao, void *buffer, int tamanho)
+{
+    return esperar_cluster(cluster, 0, posicao, buffer, tamanho);
+}
+
+int dsm_cluster_escreve(DsmCluster *cluster, int posicao, const void *buffer, int tamanho)
+{
+    return esperar_cluster(cluster, 1, posicao, (char *)buffer, tamanho);
+}
+
+int dsm_cluster_atomico(DsmCluster *cluster, int operacao, int posicao, int largura, uint64_t operando,
+                        uint64_t esperado, uint64_t *anterior)
+{
+    if (!cluster)
+        return ERRO_CONEXAO;
+    const DsmLayout *layout = &cluster->layout;
+    int rank = posicao >= 0 ? dsm_dono_do_bloco(layout, posicao / layout->tam_bloco) : -1;
+    DsmCliente *cliente = rank >= 0 ? conexao_do_rank(cluster, rank) : NULL;
+    if (!cliente)
+        cliente = conexao_do_rank(cluster, cluster->rank_entrada);
+    return dsm_atomico(cliente, operacao, posicao, largura, operando, esperado, anterior);
+}
@@ -0,0 +1,119 @@
+#ifndef DSM_H
+#define DSM_H
+
+#include <stdint.h>
+
+#define DSM_PORTA_BASE 15700
+#define DSM_MAX_PENDENTES 4096
+#define DSM_TAM_HOST 256
+
+#define SUCESSO 0
+#define ERRO_MEMORIA_INEXISTENTE -2
+#define ERRO_COMANDO_DESCONHECIDO -3
+#define ERRO_FALHA_OBTER_BLOCO -4
+#define ERRO_FALHA_ATUALIZAR_BLOCO -5
+#define ERRO_OCUPADO -6
+#define ERRO_SINCRONIZACAO -7
+#define ERRO_PROTOCOLO -8
+#define ERRO_OPERACAO_INVALIDA -9
+#define ERRO_CONEXAO -10
+
+#define DSM_COMPARAR_TROCAR 1
+#define DSM_SOMAR 2
+#define DSM_TROCAR 3
+
+typedef struct DsmCliente DsmCliente;
+typedef struct DsmCluster DsmCluster;
+
+typedef struct
+{
+    char host[DSM_TAM_HOST];
+    int porta;
+} DsmEndereco;
+
+/* Particao da memoria e tabela de pares informadas pelo servidor (comando
+   OBTER_LAYOUT). enderecos tem num_processos entradas. */
+typedef struct
+{
+    int num_processos;
+    int num_blocos;
+    int tam_bloco;
+    int rank;
+    DsmEndereco *enderecos;
+} DsmLayout;
+
+/* Chamada pela thread receptora da biblioteca quando a resposta do pedido chega
+   (ou com ERRO_CONEXAO se a conexao cair antes disso). Deve retornar rapido. */
+typedef void (*DsmCallback)(void *contexto, uint32_t id, int status);
+
+/* Abre a conexao persistente com um processo do DSM. Retorna NULL em caso de falha. */
+DsmCliente *dsm_conectar(const char *host, int porta);
+/* Espera os pedidos pendentes, fecha a conexao e libera o cliente. */
+void dsm_desconectar(DsmCliente *cliente);
+int dsm_conectado(DsmCliente *cliente);
+
+/* Pedidos assincronos: varios podem ficar pendentes na mesma conexao e as respostas
+   chegam na ordem de envio. O buffer de leitura deve continuar valido ate o callback;
+   o de escrita pode ser reaproveitado assim que a funcao retorna. Se id nao for NULL,
+   recebe o identificador do pedido, que pode ser usado com dsm_aguardar. */
+int dsm_ler_async(DsmCliente *cliente, int posicao, void *buffer, int tamanho,
+                  DsmCallback callback, void *contexto, uint32_t *id);
+int dsm_escrever_async(DsmCliente *cliente, int posicao, const void *buffer, int tamanho,
+                       DsmCallback callback, void *contexto, uint32_t *id);
+/* Bloqueia ate o pedido id (e todos os anteriores) terminar. */
+void dsm_aguardar(DsmCliente *cliente, uint32_t id);
+void dsm_aguardar_todos(DsmCliente *cliente);
+
+/* Versoes sincronas: retornam o status do servidor. */
+int dsm_le(DsmCliente *cliente, int posicao, void *buffer, int tamanho);
+int dsm_escreve(DsmCliente *cliente, int posicao, const void *buffer, int tamanho);
+/* Relatorio de estatisticas do processo; *texto deve ser liberado com free. */
+int dsm_estatisticas(DsmCliente *cliente, char **texto);
+/* Pares que o servidor conhece pelo endereco de loopback (ou por 0.0.0.0) ficam com o
+   host usado nesta conexao. A tabela deve ser liberada com dsm_liberar_layout. */
+int dsm_obter_layout(DsmCliente *cliente, DsmLayout *layout);
+void dsm_liberar_layout(DsmLayout *layout);
+/* Sincronizacao. Travas e barreiras sao identificadas por inteiros livres e
+   pertencem a conexao: uma trava so pode ser liberada pela conexao que a adquiriu e
+   e liberada pelo servidor se a conexao cair. Com o servidor em consistencia de
+   liberacao, as escritas feitas antes de dsm_liberar (ou dsm_barreira) so ficam
+   visiveis para quem adquire a mesma trava depois (ou passa pela mesma barreira).
+   dsm_adquirir e dsm_barreira bloqueiam, repetindo o pedido enquanto o servidor
+   responder ERRO_OCUPADO. Todos os participantes de uma barreira devem informar o
+   mesmo numero de participantes. */
+int dsm_adquirir(DsmCliente *cliente, int trava);
+int dsm_liberar(DsmCliente *cliente, int trava);
+int dsm_barreira(DsmCliente *cliente, int barreira, int participantes);
+/* Operacoes atomicas sobre uma palavra de largura 4 ou 8 bytes, alinhada a largura,
+   executadas no processo dono do bloco: DSM_COMPARAR_TROCAR grava operando se a
+   palavra vale esperado, DSM_SOMAR soma operando (com a volta de 2^32 ou 2^64) e
+   DSM_TROCAR grava operando. *anterior (se nao for NULL) recebe o valor da palavra
+   antes da operacao; o COMPARAR_TROCAR teve efeito se ele for igual a esperado. A
+   palavra fica na memoria em little-endian, entao dsm_le de um inteiro do mesmo
+   tamanho a le direto em maquinas little-endian. Largura, operacao ou alinhamento
+   invalidos retornam ERRO_OPERACAO_INVALIDA. */
+int dsm_atomico(DsmCliente *cliente, int operacao, int posicao, int largura, uint64_t operando, uint64_t esperado,
+                uint64_t *anterior);
+/* Mesmo mapeamento de calcular_dono no servidor. */
+int dsm_dono_do_bloco(const DsmLayout *layout, int id_bloco);
+
+/* Cliente de cluster: aprende o layout pelo processo de entrada e manda cada trecho
+   do pedido direto ao processo dono, com uma conexao persistente por processo. Se a
+   conexao com um dono nao puder ser aberta, o trecho vai pelo processo de entrada,
+   que atende qualquer posicao. O callback e chamado uma vez, quando todos os trechos
+   terminam, com o primeiro status de erro (ou SUCESSO). */
+DsmCluster *dsm_cluster_conectar(const char *host, int porta_entrada);
+void dsm_cluster_desconectar(DsmCluster *cluster);
+const DsmLayout *dsm_cluster_layout(DsmCluster *cluster);
+int dsm_cluster_ler_async(DsmCluster *cluster, int posicao, void *buffer, int tamanho,
+                          DsmCallback callback, void *contexto);
+int dsm_cluster_escrever_async(DsmCluster *cluster, int posicao, const void *buffer, int tamanho,
+                               DsmCallback callback, void *contexto);
+void dsm_cluster_aguardar_todos(DsmCluster *cluster);
+int dsm_cluster_le(DsmCluster *cluster, int posicao, void *buffer, int tamanho);
+int dsm_cluster_escreve(DsmCluster *cluster, int posicao, const void *buffer, int tamanho);
+/* dsm_atomico pela conexao com o dono da palavra, em uma unica ida e volta. */
+int dsm_cluster_atomico(DsmCluster *cluster, int operacao, int posicao, int largura, uint64_t operando,
+                        uint64_t esperado, uint64_t *anterior);
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "dsm.h"
+
+/* Histograma log-linear: valores ate 15us tem faixa propria e cada potencia de 2
+   acima disso e dividida em SUBFAIXAS faixas, entao o percentil reportado erra no
+   maximo 1/SUBFAIXAS (cerca de 6%) para cima. */
+#define SUBFAIXAS 16
+#define OITAVAS 32
+#define NUM_FAIXAS ((OITAVAS + 1) * SUBFAIXAS)
+
+#define DIST_SEQUENCIAL 0
+#define DIST_UNIFORME 1
+#define DIST_ZIPF 2
+
+typedef struct
+{
+    unsigned long quantidade;
+    unsigned long erros;
+    unsigned long soma_us;
+    unsigned long maximo_us;
+    unsigned long faixas[NUM_FAIXAS];
+} Histograma;
+
+typedef struct
+{
+    int indice;
+    DsmEndereco entrada;
+    uint64_t semente;
+    long proximo_bloco;
+    int falhou;
+    Histograma leituras;
+    Histograma escritas;
+} ThreadBench;
+
+const char *host_entrada = "127.0.0.1";
+int porta_entrada = DSM_PORTA_BASE;
+int num_threads = 4;
+double duracao = 10.0;
+double aquecimento = 1.0;
+int percentual_leituras = 90;
+int tamanho_pedido = 64;
+int cruzar_blocos = 0;
+int distribuicao = DIST_UNIFORME;
+double theta_zipf = 0.99;
+double taxa_alvo = 0.0;
+int entrada_unica = 0;
+int roteamento_direto = 0;
+
+DsmLayout layout;
+long tamanho_memoria;
+double *cdf_zipf = NULL;
+double inicio_execucao;
+
+double agora()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void esperar_ate(double instante)
+{
+    double falta = instante - agora();
+    if (falta <= 0)
+        return;
+    struct timespec ts;
+    ts.tv_sec = (time_t)falta;
+    ts.tv_nsec = (long)((falta - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/* xorshift64*: cada thread tem o seu, sem travas. Devolve um valor em [0, 1). */
+double aleatorio(uint64_t *estado)
+{
+    *estado ^= *estado >> 12;
+    *estado ^= *estado << 25;
+    *estado ^= *estado >> 27;
+    return ((*estado * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int faixa_latencia(unsigned long us)
+{
+    if (us < SUBFAIXAS)
+        return (int)us;
+    int expoente = 63 - __builtin_clzl(us);
+    if (expoente - 3 > OITAVAS)
+        return NUM_FAIXAS - 1;
+    return (expoente - 3) * SUBFAIXAS + (int)((us >> (expoente - 4)) & (SUBFAIXAS - 1));
+}
+
+/* Maior valor que cai na faixa. */
+unsigned long limite_faixa(int faixa)
+{
+    if (faixa < SUBFAIXAS)
+        return faixa;
+    int expoente = faixa / SUBFAIXAS + 3;
+    unsigned long base = SUBFAIXAS + faixa % SUBFAIXAS;
+    return ((base + 1) << (expoente - 4)) - 1;
+}
+
+void registrar(Histograma *h, unsigned long us, int status)
+{
+    if (status != SUCESSO)
+    {
+        h->erros++;
+        return;
+    }
+    h->quantidade++;
+    h->soma_us += us;
+    if (us > h->maximo_us)
+        h->maximo_us = us;
+    h->faixas[faixa_latencia(us)]++;
+}
+
+void juntar(Histograma *destino, const Histograma *origem)
+{
+    destino->quantidade += origem->quantidade;
+    destino->erros += origem->erros;
+    destino->soma_us += origem->soma_us;
+    if (origem->maximo_us > destino->maximo_us)
+        destino->maximo_us = origem->maximo_us;
+    for (int i = 0; i < NUM_FAIXAS; i++)
+        destino->faixas[i] += origem->faixas[i];
+}
+
+unsigned long percentil(const Histograma *h, double fracao)
+{
+    if (h->quantidade == 0)
+        return 0;
+    unsigned long alvo = (unsigned long)ceil(fracao * h->quantidade), acumulado = 0;
+    for (int i = 0; i < NUM_FAIXAS; i++)
+    {
+        acumulado += h->faixas[i];
+        if (acumulado >= alvo)
+            return limite_faixa(i) < h->maximo_us ? limite_faixa(i) : h->maximo_us;
+    }
+    return h->maximo_us;
+}
+
+/* Os blocos mais populares sao os de id mais baixo. */
+void preparar_zipf(int num_blocos)
+{
+    cdf_zipf = malloc(sizeof(double) * num_blocos);
+    double soma = 0.0;
+    for (int i = 0; i < num_blocos; i++)
+    {
+        soma += 1.0 / pow(i + 1, theta_zipf);
+        cdf_zipf[i] = soma;
+    }
+    for (int i = 0; i < num_blocos; i++)
+        cdf_zipf[i] /= soma;
+}
+
+long sortear_bloco(ThreadBench *t)
+{
+    int num_blocos = layout.num_blocos;
+    if (distribuicao == DIST_SEQUENCIAL)
+    {
+        long bloco = t->proximo_bloco;
+        int passo = tamanho_pedido / layout.tam_bloco;
+        t->proximo_bloco = (t->proximo_bloco + (passo > 0 ? passo : 1)) % num_blocos;
+        return bloco;
+    }
+    double u = aleatorio(&t->semente);
+    if (distribuicao == DIST_UNIFORME)
+        return (long)(u * num_blocos);
+    int baixo = 0, alto = num_blocos - 1;
+    while (baixo < alto)
+    {
+        int meio = (baixo + alto) / 2;
+        if (cdf_zipf[meio] < u)
+            baixo = meio + 1;
+        else
+            alto = meio;
+    }
+    return baixo;
+}
+
+/* Alinhado: o pedido comeca no inicio do bloco. Cruzado: metade do pedido fica no
+   fim do bloco sorteado e metade no inicio do seguinte. */
+long posicao_do_pedido(ThreadBench *t)
+{
+    long bloco = sortear_bloco(t);
+    long posicao = bloco * layout.tam_bloco;
+    if (cruzar_blocos)
+    {
+        if (bloco == layout.num_blocos - 1)
+            posicao -= layout.tam_bloco;
+        posicao += layout.tam_bloco - tamanho_pedido / 2;
+    }
+    if (posicao + tamanho_pedido > tamanho_memoria)
+        posicao = tamanho_memoria - tamanho_pedido;
+    return posicao < 0 ? 0 : posicao;
+}
+
+/* Em laco fechado cada thread envia o proximo pedido assim que o anterior termina.
+   Com --taxa (laco aberto) os pedidos seguem uma agenda fixa e a latencia e medida
+   a partir do horario agendado, entao o atraso de um pedido lento tambem aparece
+   nos que esperaram por ele. */
+void *executar_thread(void *arg)
+{
+    ThreadBench *t = arg;
+    DsmCliente *cliente = NULL;
+    DsmCluster *cluster = NULL;
+    if (roteamento_direto)
+        cluster = dsm_cluster_conectar(t->entrada.host, t->entrada.porta);
+    else
+        cliente = dsm_conectar(t->entrada.host, t->entrada.porta);
+    if (!cliente && !cluster)
+    {
+        fprintf(stderr, "thread %d: nao foi possivel conectar em %s:%d\n", t->indice, t->entrada.host,
+                t->entrada.porta);
+        t->falhou = 1;
+        return NULL;
+    }
+    char *buffer = malloc(tamanho_pedido);
+    memset(buffer, 'a' + t->indice % 26, tamanho_pedido);
+    double intervalo = taxa_alvo > 0 ? num_threads / taxa_alvo : 0.0;
+    double fim_aquecimento = inicio_execucao + aquecimento;
+    double fim = fim_aquecimento + duracao;
+    double agendado = inicio_execucao + intervalo * aleatorio(&t->semente);
+    while (1)
+    {
+        double inicio;
+        if (intervalo > 0)
+        {
+            esperar_ate(agendado);
+            inicio = agendado;
+            agendado += intervalo;
+        }
+        else
+            inicio = agora();
+        if (inicio >= fim)
+            break;
+        long posicao = posicao_do_pedido(t);
+        int leitura = aleatorio(&t->semente) * 100 < percentual_leituras;
+        int status;
+        if (leitura)
+            status = cluster ? dsm_cluster_le(cluster, posicao, buffer, tamanho_pedido)
+                             : dsm_le(cliente, posicao, buffer, tamanho_pedido);
+        else
+            status = cluster ? dsm_cluster_escreve(cluster, posicao, buffer, tamanho_pedido)
+                             : dsm_escreve(cliente, posicao, buffer, tamanho_pedido);
+        if (inicio < fim_aquecimento)
+            continue;
+        unsigned long us = (unsigned long)((agora() - inicio) * 1e6);
+        registrar(leitura ? &t->leituras : &t->escritas, us, status);
+    }
+    free(buffer);
+    if (cluster)
+        dsm_cluster_desconectar(cluster);
+    else
+        dsm_desconectar(cliente);
+    return NULL;
+}
+
+void imprimir_linha(const char *nome, const Histograma *h)
+{
+    double ops = h->quantidade / duracao;
+    printf("%-8s %10lu %7lu %11.1f %9.2f %8lu %8lu %8lu %8lu %8lu\n", nome, h->quantidade, h->erros, ops,
+           ops * tamanho_pedido / (1024.0 * 1024.0), h->quantidade ? h->soma_us / h->quantidade : 0,
+           percentil(h, 0.50), percentil(h, 0.99), percentil(h, 0.999), h->maximo_us);
+}
+
+void uso(const char *programa)
+{
+    fprintf(stderr, "Uso: %s [opcoes]\n", programa);
+    fprintf(stderr, "  --host <h>               processo de entrada (padrao 127.0.0.1)\n");
+    fprintf(stderr, "  --porta <p>              porta do processo de entrada (padrao %d)\n", DSM_PORTA_BASE);
+    fprintf(stderr, "  --threads <n>            threads de cliente, cada uma com sua conexao (padrao 4)\n");
+    fprintf(stderr, "  --duracao <s>            tempo medido, em segundos (padrao 10)\n");
+    fprintf(stderr, "  --aquecimento <s>        tempo inicial descartado, em segundos (padrao 1)\n");
+    fprintf(stderr, "  --leituras <pct>         porcentagem de leituras; o resto sao escritas (padrao 90)\n");
+    fprintf(stderr, "  --tamanho <bytes>        tamanho de cada pedido (padrao 64)\n");
+    fprintf(stderr, "  --alinhamento <modo>     bloco (padrao): pedidos comecam no inicio de um bloco;\n");
+    fprintf(stderr, "                           cruzado: cada pedido atravessa a fronteira entre dois blocos\n");
+    fprintf(stderr, "  --distribuicao <d>       sequencial, uniforme (padrao) ou zipf[:theta] (theta padrao 0.99)\n");
+    fprintf(stderr, "  --taxa <ops/s>           laco aberto com esta taxa total (padrao 0: laco fechado)\n");
+    fprintf(stderr, "  --entrada-unica          todas as threads usam o processo de entrada; sem ela as\n");
+    fprintf(stderr, "                           threads sao distribuidas entre os processos do layout\n");
+    fprintf(stderr, "  --direto                 cada thread manda cada trecho direto ao dono (dsm_cluster)\n");
+    exit(1);
+}
+
+const char *valor_opcao(int argc, char *argv[], int *i)
+{
+    if (*i + 1 >= argc)
+        uso(argv[0]);
+    return argv[++*i];
+}
+
+void ler_argumentos(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--host") == 0)
+            host_entrada = valor_opcao(argc, argv, &i);
+        else if (strcmp(argv[i], "--porta") == 0)
+            porta_entrada = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--threads") == 0)
+            num_threads = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--duracao") == 0)
+            duracao = atof(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--aquecimento") == 0)
+            aquecimento = atof(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--leituras") == 0)
+            percentual_leituras = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--tamanho") == 0)
+            tamanho_pedido = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--alinhamento") == 0)
+        {
+            const char *modo = valor_opcao(argc, argv, &i);
+            if (strcmp(modo, "cruzado") == 0)
+                cruzar_blocos = 1;
+            else if (strcmp(modo, "bloco") != 0)
+                uso(argv[0]);
+        }
+        else if (strcmp(argv[i], "--distribuicao") == 0)
+        {
+            const char *nome = valor_opcao(argc, argv, &i);
+            if (strcmp(nome, "sequencial") == 0)
+                distribuicao = DIST_SEQUENCIAL;
+            else if (strcmp(nome, "uniforme") == 0)
+                distribuicao = DIST_UNIFORME;
+            else if (strncmp(nome, "zipf", 4) == 0 && (nome[4] == '\0' || nome[4] == ':'))
+            {
+                distribuicao = DIST_ZIPF;
+                if (nome[4] == ':')
+                    theta_zipf = atof(nome + 5);
+            }
+            else
+                uso(argv[0]);
+        }
+        else if (strcmp(argv[i], "--taxa") == 0)
+            taxa_alvo = atof(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--entrada-unica") == 0)
+            entrada_unica = 1;
+        else if (strcmp(argv[i], "--direto") == 0)
+            roteamento_direto = 1;
+        else
+            uso(argv[0]);
+    }
+    if (num_threads <= 0 || duracao <= 0 || aquecimento < 0 || percentual_leituras < 0 || percentual_leituras > 100 ||
+        tamanho_pedido <= 0 || theta_zipf < 0 || taxa_alvo < 0)
+        uso(argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    ler_argumentos(argc, argv);
+    DsmCliente *entrada = dsm_conectar(host_entrada, porta_entrada);
+    if (!entrada || dsm_obter_layout(entrada, &layout) != SUCESSO)
+    {
+        fprintf(stderr, "Nao foi possivel obter o layout de %s:%d.\n", host_entrada, porta_entrada);
+        return 1;
+    }
+    dsm_desconectar(entrada);
+    tamanho_memoria = (long)layout.num_blocos * layout.tam_bloco;
+    if (tamanho_pedido > tamanho_memoria || (cruzar_blocos && (tamanho_pedido < 2 || layout.num_blocos < 2)))
+    {
+        fprintf(stderr, "Tamanho de pedido invalido para %d blocos de %d bytes.\n", layout.num_blocos,
+                layout.tam_bloco);
+        return 1;
+    }
+    if (distribuicao == DIST_ZIPF)
+        preparar_zipf(layout.num_blocos);
+
+    char nome_distribuicao[32];
+    if (distribuicao == DIST_ZIPF)
+        snprintf(nome_distribuicao, sizeof(nome_distribuicao), "zipf(%.2f)", theta_zipf);
+    else
+        snprintf(nome_distribuicao, sizeof(nome_distribuicao), "%s",
+                 distribuicao == DIST_SEQUENCIAL ? "sequencial" : "uniforme");
+    printf("dsm_bench: %d processos, %d blocos de %d bytes\n", layout.num_processos, layout.num_blocos,
+           layout.tam_bloco);
+    printf("threads=%d duracao=%.1fs aquecimento=%.1fs leituras=%d%% tamanho=%d alinhamento=%s distribuicao=%s "
+           "laco=%s entrada=%s\n",
+           num_threads, duracao, aquecimento, percentual_leituras, tamanho_pedido, cruzar_blocos ? "cruzado" : "bloco",
+           nome_distribuicao, taxa_alvo > 0 ? "aberto" : "fechado",
+           roteamento_direto ? "direto" : (entrada_unica ? "unica" : "distribuida"));
+    if (taxa_alvo > 0)
+        printf("taxa alvo: %.1f ops/s\n", taxa_alvo);
+
+    ThreadBench *threads = calloc(num_threads, sizeof(ThreadBench));
+    pthread_t *ids = malloc(sizeof(pthread_t) * num_threads);
+    inicio_execucao = agora();
+    for (int i = 0; i < num_threads; i++)
+    {
+        ThreadBench *t = &threads[i];
+        t->indice = i;
+        if (entrada_unica)
+        {
+            snprintf(t->entrada.host, DSM_TAM_HOST, "%s", host_entrada);
+            t->entrada.porta = porta_entrada;
+        }
+        else
+            t->entrada = layout.enderecos[i % layout.num_processos];
+        t->semente = 0x9E3779B97F4A7C15ULL * (i + 1);
+        t->proximo_bloco = (long)layout.num_blocos * i / num_threads;
+        if (pthread_create(&ids[i], NULL, executar_thread, t) != 0)
+        {
+            fprintf(stderr, "Nao foi possivel criar a thread %d.\n", i);
+            return 1;
+        }
+    }
+    Histograma leituras, escritas, total;
+    memset(&leituras, 0, sizeof(leituras));
+    memset(&escritas, 0, sizeof(escritas));
+    memset(&total, 0, sizeof(total));
+    int falhas = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        falhas += threads[i].falhou;
+        juntar(&leituras, &threads[i].leituras);
+        juntar(&escritas, &threads[i].escritas);
+    }
+    juntar(&total, &leituras);
+    juntar(&total, &escritas);
+
+    printf("\n%-8s %10s %7s %11s %9s %8s %8s %8s %8s %8s\n", "operacao", "n", "erros", "ops/s", "MB/s", "media",
+           "p50", "p99", "p999", "max");
+    imprimir_linha("leitura", &leituras);
+    imprimir_linha("escrita", &escritas);
+    imprimir_linha("total", &total);
+    printf("(latencias em microssegundos)\n");
+    if (falhas > 0)
+        printf("%d thread(s) nao conseguiram conectar.\n", falhas);
+
+    free(threads);
+    free(ids);
+    free(cdf_zipf);
+    dsm_liberar_layout(&layout);
+    return falhas > 0 || total.erros > 0 ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef PROTOCOLO_H
+#define PROTOCOLO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Protocolo v2 entre cliente e servidor. Cada mensagem e um quadro: cabecalho fixo
+   seguido de tam_payload bytes, todos os campos em ordem de rede. O payload do
+   pedido sao os campos do comando (sem o codigo, que vai em opcode) e os dados; o da
+   resposta e a resposta v1 sem o status, que vai no cabecalho. A resposta repete o
+   opcode e o id_pedido do pedido.
+
+   O servidor reconhece o quadro pelo magico no lugar do codigo do comando, entao
+   pedidos v1 (so o codigo e os campos) continuam aceitos na mesma porta. */
+#define PROTOCOLO_MAGICO 0x44534d32 /* "DSM2" */
+#define PROTOCOLO_VERSAO 2
+
+/* flags */
+#define QUADRO_RESPOSTA 0x1
+#define QUADRO_ERRO 0x2 /* status negativo; se o quadro era invalido, a conexao e fechada em seguida */
+
+#define TAM_CABECALHO_QUADRO 24
+
+typedef struct
+{
+    uint32_t magico;
+    uint16_t versao;
+    uint16_t opcode;
+    uint32_t id_pedido;
+    uint32_t flags;
+    uint32_t tam_payload;
+    int32_t status;
+} CabecalhoQuadro;
+
+static inline void quadro_codificar(const CabecalhoQuadro *cabecalho, char *destino)
+{
+    uint32_t campos[6];
+    campos[0] = htonl(cabecalho->magico);
+    campos[1] = htonl(((uint32_t)cabecalho->versao << 16) | cabecalho->opcode);
+    campos[2] = htonl(cabecalho->id_pedido);
+    campos[3] = htonl(cabecalho->flags);
+    campos[4] = htonl(cabecalho->tam_payload);
+    campos[5] = htonl((uint32_t)cabecalho->status);
+    memcpy(destino, campos, TAM_CABECALHO_QUADRO);
+}
+
+static inline void quadro_decodificar(const char *origem, CabecalhoQuadro *cabecalho)
+{
+    uint32_t campos[6];
+    memcpy(campos, origem, TAM_CABECALHO_QUADRO);
+    cabecalho->magico = ntohl(campos[0]);
+    cabecalho->versao = ntohl(campos[1]) >> 16;
+    cabecalho->opcode = ntohl(campos[1]) & 0xffff;
+    cabecalho->id_pedido = ntohl(campos[2]);
+    cabecalho->flags = ntohl(campos[3]);
+    cabecalho->tam_payload = ntohl(campos[4]);
+    cabecalho->status = (int32_t)ntohl(campos[5]);
+}
+
+#endif
@@ -5,28 +5,156 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include "protocolo.h"
 
 #define BASE_PORT 15700
 #define MAX_BUFFER_SIZE 8192
-#define MAX_CONEXOES 20
+#define MAX_CONEXOES 128
+#define MAX_EVENTOS 64
+#define MAX_COMANDOS_POR_VEZ 16
+#define MIN_TRABALHADORES 2
+#define LINHA_CACHE 64
+#define PAGINA_GRANDE (2 * 1024 * 1024)
+
+#define BUFFER_RESULTADO 0
+#define BUFFER_BLOCO 1
+#define BUFFER_MENSAGEM 2
+#define BUFFER_PEDIDOS 3
+#define BUFFER_IDS 4
+#define BUFFER_COPYSETS 5
+#define BUFFER_INVALIDACOES 6
+#define BUFFER_DIFFS 7
+#define BUFFER_MENSAGEM_DIFFS 8
+#define BUFFER_TRECHOS 9
+#define BUFFER_MIGRACAO 10
+#define BUFFER_QUADRO 11
+#define BUFFER_RESPOSTA_QUADRO 12
+#define BUFFER_REPLICACAO 13
+#define BUFFER_EPOCAS 14
+#define BUFFER_CONFIRMACOES 15
+#define NUM_BUFFERS_THREAD 16
+#define NUM_LISTRAS_ESCRITA 64
+#define MAX_FRAGMENTOS_CACHE 16
+#define FAIXAS_LATENCIA 32
+#define ENTRADAS_ANEL_LOG 512
+#define TAM_ENTRADA_LOG 256
+#define TAM_HOST 256
+#define FILA_PREFETCH 256
+#define THREADS_PREFETCH 2
+#define JANELA_PREFETCH_INICIAL 4
+#define LEITURAS_PARA_PREFETCH 2
+#define ESCRITAS_PARA_MIGRAR 8
+#define MAX_REDIRECIONAMENTOS 10
+#define MAX_AVISOS 256
+#define AVISOS_POR_TRAVA 1024
+#define MAX_TRAVAS 1024
+#define MAX_BARREIRAS 64
+#define MAX_TRAVAS_CONEXAO 16
+#define MAX_REGIOES_ATUALIZACAO 16
+#define MAGICO_DADOS 0x44534d44 /* "DSMD" */
+#define TAM_CABECALHO_DADOS 4096
+#define LIMITE_BYTES_WAL (64L * 1024 * 1024)
+#define TAM_CAMINHO 1024
+#define MAX_BLOCOS_RESSINCRONIZACAO 64
+#define TEMPO_SUSPEITA_US 1000000
+#define TEMPO_LIMITE_PEDIDO_S 5
+
+#define LOG_ERRO 0
+#define LOG_AVISO 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+/* Compilar com -DLOG_NIVEL_MAXIMO=LOG_INFO (ou outro nivel) remove do binario as
+   chamadas mais detalhadas. */
+#ifndef LOG_NIVEL_MAXIMO
+#define LOG_NIVEL_MAXIMO LOG_TRACE
+#endif
+#define LOG_ATIVO(nivel) ((nivel) <= LOG_NIVEL_MAXIMO && (nivel) <= nivel_log)
+#define LOG(nivel, ...)                       \
+    do                                        \
+    {                                         \
+        if (LOG_ATIVO(nivel))                 \
+            registrar_log(__VA_ARGS__);       \
+    } while (0)
+
+#define LISTA_RECENTES 0
+#define LISTA_FREQUENTES 1
 
 #define SUCESSO 0
 #define ERRO_MEMORIA_INEXISTENTE -2
 #define ERRO_COMANDO_DESCONHECIDO -3
 #define ERRO_FALHA_OBTER_BLOCO -4
+#define ERRO_FALHA_ATUALIZAR_BLOCO -5
+#define ERRO_OCUPADO -6
+#define ERRO_SINCRONIZACAO -7
+#define ERRO_PROTOCOLO -8
+#define ERRO_OPERACAO_INVALIDA -9
 
 #define CMD_OBTER_DADOS 1
 #define CMD_SALVAR_DADOS 2
 #define CMD_OBTER_BLOCO_INTERNO 3
-#define CMD_ATUALIZAR_BLOCO 4
-#define CMD_INVALIDAR_BLOCO 5
+/* 4 e 5 eram ATUALIZAR_BLOCO e INVALIDAR_BLOCO, trocados por ATUALIZAR_BLOCOS e
+   INVALIDAR_BLOCOS; os codigos nao sao reutilizados. */
+#define CMD_APRESENTACAO 6
+#define CMD_OBTER_BLOCOS_INTERNO 7
+#define CMD_ATUALIZAR_BLOCOS 8
+#define CMD_INVALIDAR_BLOCOS 9
+#define CMD_ESTATISTICAS 10
+#define CMD_OBTER_LAYOUT 11
+#define CMD_ATUALIZAR_COPIAS 12
+#define CMD_MIGRAR_BLOCO 13
+#define CMD_ADQUIRIR 14
+#define CMD_LIBERAR 15
+#define CMD_BARREIRA 16
+#define CMD_SINCRONIZAR 17
+#define CMD_ATUALIZAR_REPLICA 18
+#define CMD_OBTER_REPLICAS 19
+#define CMD_ATOMICO 20
+#define CMD_ATOMICO_INTERNO 21
+#define NUM_COMANDOS 22
+
+#define SINC_ADQUIRIR 1
+#define SINC_LIBERAR 2
+#define SINC_CHEGAR 3
+#define SINC_AGUARDAR 4
 
+#define ATOMICO_COMPARAR_TROCAR 1
+#define ATOMICO_SOMAR 2
+#define ATOMICO_TROCAR 3
+
+/* local e o rank que tem o bloco agora: o de origem ou, depois de uma migracao, o
+   que o hospeda. So a copia do rank de origem e consultada, como diretorio.
+   replicado e a ultima versao ja enviada as replicas, protegido pela listra. */
 typedef struct
 {
     int id;
     char *dados;
+    uint32_t seq;
+    int local;
+    int ultimo_escritor;
+    int escritas_seguidas;
+    uint32_t replicado;
 } BlocoMemoria;
 
 typedef struct
@@ -34,21 +162,565 @@ typedef struct
     int id;
     char *dados;
     int valido;
+    int referenciado;
+    int antecipado;
+    uint32_t versao;
 } BlocoCache;
 
+typedef struct
+{
+    int *chaves;
+    int *valores;
+    int mascara;
+    int bits;
+} IndiceHash;
+
+typedef struct
+{
+    int cabeca;
+    int cauda;
+    int tamanho;
+} ListaCache;
+
+typedef struct Cache Cache;
+
+typedef struct
+{
+    const char *nome;
+    int acesso_concorrente;
+    void (*acessar)(Cache *c, int slot);
+    int (*alocar)(Cache *c, int id_novo);
+    void (*liberar)(Cache *c, int slot);
+} PoliticaCache;
+
+struct Cache
+{
+    BlocoCache *slots;
+    int capacidade;
+    IndiceHash indice;
+    const PoliticaCache *politica;
+    int *anterior;
+    int *proximo;
+    int *lista_do_slot;
+    int *livres;
+    int num_livres;
+    int ponteiro_relogio;
+    ListaCache recentes;
+    ListaCache frequentes;
+    ListaCache fantasmas_recentes;
+    ListaCache fantasmas_frequentes;
+    int *fantasma_id;
+    int *fantasma_anterior;
+    int *fantasma_proximo;
+    int *fantasma_lista;
+    int *fantasmas_livres;
+    int num_fantasmas_livres;
+    IndiceHash indice_fantasmas;
+    int alvo_recentes;
+    long acertos, faltas, remocoes;
+    pthread_rwlock_t lock;
+    pthread_mutex_t lock_politica;
+};
+
+typedef struct
+{
+    int rank;
+    int sock;
+    unsigned long geracao;
+    unsigned long tickets_emitidos;
+    unsigned long tickets_atendidos;
+    unsigned long falha_us;
+    unsigned long expirou_us;
+    pthread_mutex_t lock_envio;
+    pthread_mutex_t lock_recepcao;
+    pthread_cond_t cond_recepcao;
+} ConexaoPar;
+
+/* Entrada da tabela de pares: onde cada rank escuta. */
+typedef struct
+{
+    char host[TAM_HOST];
+    int porta;
+    struct sockaddr_in endereco;
+} EnderecoPar;
+
+/* Escrita pequena enviada as copias em vez de invalida-las. versao e o seq do bloco
+   depois da escrita; a copia so aplica o diff se estiver na versao anterior. */
+typedef struct
+{
+    uint32_t versao;
+    int offset;
+    int tam;
+    const char *dados;
+} DiffBloco;
+
+/* Invalidacao ou diff ja enviado a um par, cuja confirmacao ainda nao foi lida. */
+typedef struct
+{
+    int rank;
+    unsigned long ticket;
+    unsigned long geracao;
+} ConfirmacaoPendente;
+
+/* Intervalo de bytes [inicio, fim) com protocolo de atualizacao: toda escrita nos
+   blocos que o tocam vai para as copias, qualquer que seja o tamanho. */
+typedef struct
+{
+    int inicio;
+    int fim;
+} RegiaoAtualizacao;
+
+/* Inicio do arquivo de dados de um rank; os blocos vem depois, a cada stride_bloco
+   bytes. geracao_wal e o primeiro log que ainda precisa ser reaplicado. */
+typedef struct
+{
+    uint32_t magico;
+    int num_processos;
+    int num_blocos;
+    int tam_bloco;
+    int rank;
+    uint64_t geracao_wal;
+} CabecalhoDados;
+
+/* Cada escrita num bloco local vira um registro [id, offset, tam, soma] seguido dos
+   dados, em ordem de maquina. soma cobre o cabecalho e os dados, para achar o fim de
+   um log cortado no meio de um registro. */
+typedef struct
+{
+    uint32_t id_bloco;
+    uint32_t offset;
+    uint32_t tam;
+    uint32_t soma;
+} RegistroWal;
+
+/* Commit em grupo: escritores anexam registros a pendente e esperam lsn_duravel
+   alcancar o seu lsn. Quem encontra o log sem lider grava e sincroniza tudo o que
+   estiver pendente de uma vez, entao escritas concorrentes dividem o mesmo fsync. */
+typedef struct
+{
+    int fd;
+    uint64_t geracao;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *pendente;
+    int usado;
+    int capacidade;
+    char *gravando;
+    int capacidade_gravando;
+    int lider;
+    unsigned long lsn_anexado;
+    unsigned long lsn_duravel;
+    long bytes_geracao;
+} Wal;
+
+/* Copia de um bloco de outro rank mantida por replicacao. seq e um seqlock como o de
+   BlocoMemoria; versao e a versao do dono que a copia tem e vista, a maior versao
+   anunciada pelo dono enquanto a copia estava invalida. */
+typedef struct
+{
+    char *dados;
+    uint32_t seq;
+    uint32_t versao;
+    uint32_t vista;
+    int valida;
+    int pendente;
+} CopiaReplica;
+
+/* Particao de rank mantida por este processo. encarnacao identifica a execucao do
+   dono que produziu as versoes das copias (0 enquanto nenhuma chegou). */
+typedef struct
+{
+    int rank;
+    int inicio;
+    int fim;
+    uint32_t encarnacao;
+    CopiaReplica *copias;
+    uint64_t *copysets;
+    pthread_mutex_t lock;
+} Replica;
+
+/* atomico: o lote e de uma operacao atomica, que avisa as copias mesmo com
+   consistencia de liberacao. */
+typedef struct
+{
+    int quantidade;
+    int atomico;
+    int *ids;
+    uint64_t *copysets;
+    DiffBloco *diffs;
+} LoteInvalidacao;
+
+/* Operacao atomica sobre uma palavra de largura 4 ou 8 bytes, guardada na memoria em
+   little-endian. anterior recebe o valor antes da operacao e novo, os bytes gravados;
+   alterou e 0 se a palavra nao mudou (um COMPARAR_TROCAR que falhou, por exemplo), e
+   entao nada foi escrito. */
+typedef struct
+{
+    int operacao;
+    int largura;
+    uint64_t operando;
+    uint64_t esperado;
+    uint64_t anterior;
+    int alterou;
+    char novo[8];
+} OperacaoAtomica;
+
+typedef struct
+{
+    int dono;
+    int primeiro;
+    int ultimo;
+    int trechos;
+    int tamanho_msg;
+    int deslocamento;
+    int enviado;
+    unsigned long ticket;
+    unsigned long geracao;
+} PedidoDono;
+
+/* Parte de uma escrita que cai em um bloco; origem e o deslocamento nos dados. */
+typedef struct
+{
+    int id_bloco;
+    int offset;
+    int tam;
+    int origem;
+    int dono;
+    int aplicado;
+    int remoto;
+} TrechoEscrita;
+
+/* Leituras de uma conexao de cliente, para detectar varreduras sequenciais. */
+typedef struct
+{
+    int proximo_bloco;
+    int sequenciais;
+    int janela;
+    int buscado_ate;
+    unsigned long desperdicados_vistos;
+} FluxoLeitura;
+
+typedef struct
+{
+    int primeiro;
+    int ultimo;
+} PedidoPrefetch;
+
+/* Avisos de escrita: ids dos blocos escritos. tudo indica que eram mais do que
+   cabem, e quem os recebe descarta a cache inteira. */
+typedef struct
+{
+    int quantidade;
+    int tudo;
+    int ids[MAX_AVISOS];
+} AvisosEscrita;
+
+/* Trava no seu gerente. O aviso n publicado por uma liberacao fica em
+   avisos[n % AVISOS_POR_TRAVA]; vistos[r] e quantos avisos o rank r ja recebeu. */
+typedef struct
+{
+    int id;
+    int ocupada;
+    int dono_rank;
+    uint32_t dono_token;
+    unsigned long num_avisos;
+    int avisos[AVISOS_POR_TRAVA];
+    unsigned long *vistos;
+} Trava;
+
+typedef struct
+{
+    int id;
+    int participantes;
+    int chegados;
+    int geracao;
+    AvisosEscrita avisos;
+    AvisosEscrita concluida;
+} Barreira;
+
+typedef struct Conexao
+{
+    int sock;
+    int interna;
+    int classificada;
+    int comando_pendente;
+    int rank_par;
+    uint32_t token;
+    FluxoLeitura fluxo;
+    AvisosEscrita avisos;
+    int travas[MAX_TRAVAS_CONEXAO];
+    int num_travas;
+    /* Com um quadro v2 em execucao, os campos do comando saem de quadro e a resposta
+       se acumula no buffer da thread. */
+    int em_quadro;
+    const char *quadro;
+    int tam_quadro;
+    int lido_quadro;
+    struct Conexao *proxima;
+} Conexao;
+
+typedef struct
+{
+    const char *nome;
+    Conexao *primeira;
+    Conexao *ultima;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} PoolTrabalho;
+
+/* faixas[i] conta as latencias entre 2^(i-1) e 2^i - 1 microssegundos. */
+typedef struct
+{
+    unsigned long quantidade;
+    unsigned long soma_us;
+    unsigned long maximo_us;
+    unsigned long faixas[FAIXAS_LATENCIA];
+} EstatisticaComando;
+
+/* Anel de um produtor (a thread dona) e um consumidor (a thread de log). */
+typedef struct AnelLog
+{
+    unsigned long inicio;
+    char espaco_inicio[LINHA_CACHE - sizeof(unsigned long)];
+    unsigned long fim;
+    char espaco_fim[LINHA_CACHE - sizeof(unsigned long)];
+    char entradas[ENTRADAS_ANEL_LOG][TAM_ENTRADA_LOG];
+    struct AnelLog *proximo;
+} AnelLog;
+
+typedef struct
+{
+    unsigned long bytes_enviados;
+    unsigned long bytes_recebidos;
+    unsigned long pedidos;
+} TrafegoPar;
+
 int N_PROCESSOS = 0, K_BLOCOS = 0, T_BLOCO = 0, my_rank = 0;
 BlocoMemoria *blocos_locais = NULL;
-int num_blocos_locais = 0;
-BlocoCache *cache = NULL;
-int tamanho_cache = 0, proximo_slot_cache = 0;
-pthread_mutex_t cache_mutex;
+int num_blocos_locais = 0, blocos_inicio = 0;
+uint64_t *copysets = NULL;
+pthread_mutex_t *listras_escrita = NULL;
+pthread_cond_t conds_replicado[NUM_LISTRAS_ESCRITA];
+int palavras_copyset = 0;
+Cache *caches = NULL;
+int num_fragmentos_cache = 0;
+int cache_blocos = -1;
+long cache_bytes = -1;
+const PoliticaCache *politica_cache = NULL;
+int stride_bloco = 0, usar_paginas_grandes = 0, usar_memoria_compartilhada = 0;
+char *arena_local = NULL;
+const char *dados_dir = NULL;
+int intervalo_checkpoint = 30;
+CabecalhoDados *cabecalho_dados = NULL;
+size_t tam_arquivo_dados = 0;
+Wal wal = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+unsigned long wal_registros = 0, wal_bytes = 0, wal_fsyncs = 0, checkpoints = 0, registros_reaplicados = 0;
+int num_replicas = 0;
+Replica *replicas = NULL;
+uint32_t encarnacao = 0;
+uint32_t *versoes_minimas = NULL;
+char *ler_do_dono = NULL;
+int replicas_pendentes = 0;
+pthread_mutex_t lock_replicacao = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_replicacao = PTHREAD_COND_INITIALIZER;
+unsigned long replicacoes_enviadas = 0, replicacoes_aplicadas = 0, replicacoes_perdidas = 0;
+unsigned long copias_ressincronizadas = 0, leituras_replica = 0;
+unsigned long atomicos_executados = 0, atomicos_sem_efeito = 0;
+__thread char *buffers_thread[NUM_BUFFERS_THREAD];
+__thread int capacidades_thread[NUM_BUFFERS_THREAD];
+__thread int tam_resposta_quadro;
+ConexaoPar *conexoes_pares = NULL;
+ConexaoPar *conexoes_invalidacao = NULL;
+EnderecoPar *enderecos_pares = NULL;
+const char *arquivo_pares = NULL;
+int rank_primeiro = -1, rank_ultimo = -1;
+int janela_prefetch_maxima = 16;
+int limite_diff = 0;
+RegiaoAtualizacao regioes_atualizacao[MAX_REGIOES_ATUALIZACAO];
+int num_regioes_atualizacao = 0;
+char *blocos_atualizacao = NULL;
+unsigned long diffs_enviados = 0, bytes_diffs = 0, diffs_aplicados = 0, diffs_descartados = 0;
+unsigned long epoca_invalidacoes = 0;
+uint32_t *epocas_blocos = NULL;
+int limite_migracao = 0;
+BlocoMemoria *blocos_hospedados = NULL;
+uint64_t *copysets_hospedados = NULL;
+IndiceHash indice_hospedados;
+int *hospedados_livres = NULL;
+int num_hospedados_livres = 0, num_hospedados = 0;
+pthread_rwlock_t lock_hospedados = PTHREAD_RWLOCK_INITIALIZER;
+int *dicas_dono = NULL;
+unsigned long migracoes_enviadas = 0, migracoes_devolvidas = 0, migracoes_recebidas = 0, redirecionamentos = 0;
+int consistencia_liberacao = 0;
+Trava *travas[MAX_TRAVAS];
+Barreira *barreiras[MAX_BARREIRAS];
+int num_travas = 0, num_barreiras = 0;
+IndiceHash indice_travas, indice_barreiras;
+pthread_mutex_t lock_sincronizacao = PTHREAD_MUTEX_INITIALIZER;
+unsigned long travas_concedidas = 0, travas_ocupadas = 0, barreiras_concluidas = 0, avisos_recebidos = 0;
+unsigned long prefetch_pedidos = 0, prefetch_blocos = 0, prefetch_uteis = 0, prefetch_desperdicados = 0;
+PedidoPrefetch fila_prefetch[FILA_PREFETCH];
+int fila_prefetch_inicio = 0, fila_prefetch_tamanho = 0;
+pthread_mutex_t lock_prefetch = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_prefetch = PTHREAD_COND_INITIALIZER;
+int reator_fd = -1;
+Conexao conexao_escuta;
+PoolTrabalho pool_clientes, pool_interno;
+EstatisticaComando estatisticas_comandos[NUM_COMANDOS];
+TrafegoPar *trafego_pares = NULL;
+long conexoes_abertas = 0, conexoes_aceitas = 0, comandos_em_andamento = 0;
+int intervalo_estatisticas = 0;
+int nivel_log = LOG_INFO;
+AnelLog *aneis_log = NULL;
+pthread_mutex_t lock_aneis_log = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lock_escoamento_log = PTHREAD_MUTEX_INITIALIZER;
+__thread AnelLog *anel_thread = NULL;
+unsigned long logs_descartados = 0;
+
+AnelLog *anel_log_da_thread()
+{
+    if (!anel_thread)
+    {
+        void *anel = NULL;
+        if (posix_memalign(&anel, LINHA_CACHE, sizeof(AnelLog)) != 0)
+            return NULL;
+        anel_thread = anel;
+        anel_thread->inicio = 0;
+        anel_thread->fim = 0;
+        pthread_mutex_lock(&lock_aneis_log);
+        anel_thread->proximo = aneis_log;
+        __atomic_store_n(&aneis_log, anel_thread, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lock_aneis_log);
+    }
+    return anel_thread;
+}
+
+/* So formata a mensagem no anel da propria thread; nunca espera pela escrita em
+   stdout. Com o anel cheio a mensagem e descartada e contada. O nivel ja foi
+   filtrado por LOG_ATIVO em quem chama. */
+void registrar_log(const char *formato, ...)
+{
+    AnelLog *anel = anel_log_da_thread();
+    if (!anel)
+        return;
+    unsigned long fim = anel->fim;
+    if (fim - __atomic_load_n(&anel->inicio, __ATOMIC_ACQUIRE) >= ENTRADAS_ANEL_LOG)
+    {
+        __atomic_fetch_add(&logs_descartados, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    char *entrada = anel->entradas[fim % ENTRADAS_ANEL_LOG];
+    va_list args;
+    va_start(args, formato);
+    vsnprintf(entrada, TAM_ENTRADA_LOG, formato, args);
+    va_end(args);
+    __atomic_store_n(&anel->fim, fim + 1, __ATOMIC_RELEASE);
+}
+
+int escoar_log()
+{
+    int escritas = 0;
+    pthread_mutex_lock(&lock_escoamento_log);
+    for (AnelLog *anel = __atomic_load_n(&aneis_log, __ATOMIC_ACQUIRE); anel; anel = anel->proximo)
+    {
+        unsigned long fim = __atomic_load_n(&anel->fim, __ATOMIC_ACQUIRE);
+        for (unsigned long i = anel->inicio; i < fim; i++, escritas++)
+            fputs(anel->entradas[i % ENTRADAS_ANEL_LOG], stdout);
+        __atomic_store_n(&anel->inicio, fim, __ATOMIC_RELEASE);
+    }
+    unsigned long descartados = __atomic_exchange_n(&logs_descartados, 0, __ATOMIC_RELAXED);
+    if (descartados)
+        fprintf(stdout, "[P%d] [LOG] %lu mensagem(ns) descartada(s) com o anel cheio.\n", my_rank, descartados);
+    if (escritas || descartados)
+        fflush(stdout);
+    pthread_mutex_unlock(&lock_escoamento_log);
+    return escritas;
+}
+
+/* Depois do fork o filho herda os aneis do pai com mensagens que o pai ja vai
+   escrever; sem isso elas sairiam repetidas. */
+void descartar_log_herdado()
+{
+    for (AnelLog *anel = aneis_log; anel; anel = anel->proximo)
+        anel->inicio = anel->fim;
+    logs_descartados = 0;
+}
+
+void *executar_log(void *arg)
+{
+    struct timespec espera = {0, 1000000};
+    while (1)
+        if (escoar_log() == 0)
+            nanosleep(&espera, NULL);
+    return NULL;
+}
+
+const char *nomes_niveis_log[] = {"erro", "aviso", "info", "debug", "trace"};
+
+int buscar_nivel_log(const char *nome)
+{
+    for (int i = LOG_ERRO; i <= LOG_TRACE; i++)
+        if (strcmp(nomes_niveis_log[i], nome) == 0)
+            return i;
+    return -1;
+}
 
 void die(const char *msg)
 {
+    escoar_log();
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
+/* Buffers de rascunho por thread, reaproveitados entre comandos; so crescem. */
+/* Um tamanho negativo vem de uma conta que estourou: devolve NULL em vez de um
+   buffer menor que o pedido. */
+char *buffer_thread(int indice, int tamanho)
+{
+    if (tamanho < 0)
+        return NULL;
+    if (capacidades_thread[indice] < tamanho)
+    {
+        free(buffers_thread[indice]);
+        void *novo = NULL;
+        if (posix_memalign(&novo, LINHA_CACHE, tamanho) != 0)
+            die("alocacao de buffer falhou");
+        buffers_thread[indice] = novo;
+        capacidades_thread[indice] = tamanho;
+    }
+    return buffers_thread[indice];
+}
+
+/* Com compartilhada, a arena e MAP_SHARED e sobrevive ao fork com o mesmo endereco
+   em todos os processos. */
+char *alocar_arena(size_t tamanho, int compartilhada)
+{
+    int visibilidade = compartilhada ? MAP_SHARED : MAP_PRIVATE;
+    size_t pagina = (size_t)sysconf(_SC_PAGESIZE);
+    tamanho = (tamanho + pagina - 1) / pagina * pagina;
+    void *arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (usar_paginas_grandes)
+    {
+        size_t tamanho_grande = (tamanho + PAGINA_GRANDE - 1) / PAGINA_GRANDE * PAGINA_GRANDE;
+        arena = mmap(NULL, tamanho_grande, PROT_READ | PROT_WRITE, visibilidade | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena == MAP_FAILED)
+            LOG(LOG_AVISO, "[P%d] Paginas grandes indisponiveis; usando paginas normais.\n", my_rank);
+    }
+#endif
+    if (arena == MAP_FAILED)
+    {
+        arena = mmap(NULL, tamanho, PROT_READ | PROT_WRITE, visibilidade | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED)
+            die("mmap da arena falhou");
+#ifdef MADV_HUGEPAGE
+        if (usar_paginas_grandes)
+            madvise(arena, tamanho, MADV_HUGEPAGE);
+#endif
+    }
+    return arena;
+}
+
 int recv_all(int sock, char *buffer, int len)
 {
     int total_recebido = 0;
@@ -93,365 +765,4216 @@ const char *traduzir_comando(int comando)
         return "SALVAR_DADOS";
     case CMD_OBTER_BLOCO_INTERNO:
         return "OBTER_BLOCO_INTERNO";
-    case CMD_ATUALIZAR_BLOCO:
-        return "ATUALIZAR_BLOCO";
-    case CMD_INVALIDAR_BLOCO:
-        return "INVALIDAR_BLOCO";
+    case CMD_APRESENTACAO:
+        return "APRESENTACAO";
+    case CMD_OBTER_BLOCOS_INTERNO:
+        return "OBTER_BLOCOS_INTERNO";
+    case CMD_ATUALIZAR_BLOCOS:
+        return "ATUALIZAR_BLOCOS";
+    case CMD_INVALIDAR_BLOCOS:
+        return "INVALIDAR_BLOCOS";
+    case CMD_ESTATISTICAS:
+        return "ESTATISTICAS";
+    case CMD_OBTER_LAYOUT:
+        return "OBTER_LAYOUT";
+    case CMD_ATUALIZAR_COPIAS:
+        return "ATUALIZAR_COPIAS";
+    case CMD_MIGRAR_BLOCO:
+        return "MIGRAR_BLOCO";
+    case CMD_ADQUIRIR:
+        return "ADQUIRIR";
+    case CMD_LIBERAR:
+        return "LIBERAR";
+    case CMD_BARREIRA:
+        return "BARREIRA";
+    case CMD_SINCRONIZAR:
+        return "SINCRONIZAR";
+    case CMD_ATUALIZAR_REPLICA:
+        return "ATUALIZAR_REPLICA";
+    case CMD_OBTER_REPLICAS:
+        return "OBTER_REPLICAS";
+    case CMD_ATOMICO:
+        return "ATOMICO";
+    case CMD_ATOMICO_INTERNO:
+        return "ATOMICO_INTERNO";
     default:
         return "COMANDO_INVALIDO";
     }
 }
 
-void enviar_msg_assincrona(int rank_destino, int comando, int id_bloco, int offset, int tam, char *dados)
+unsigned long agora_us()
 {
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+void registrar_latencia(int comando, unsigned long us)
+{
+    if (comando <= 0 || comando >= NUM_COMANDOS)
         return;
-    struct sockaddr_in server;
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server.sin_family = AF_INET;
-    server.sin_port = htons(BASE_PORT + rank_destino);
-    if (connect(s, (struct sockaddr *)&server, sizeof(server)) >= 0)
+    EstatisticaComando *e = &estatisticas_comandos[comando];
+    int faixa = us ? 64 - __builtin_clzl(us) : 0;
+    if (faixa >= FAIXAS_LATENCIA)
+        faixa = FAIXAS_LATENCIA - 1;
+    __atomic_fetch_add(&e->quantidade, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&e->soma_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&e->faixas[faixa], 1, __ATOMIC_RELAXED);
+    unsigned long maximo = __atomic_load_n(&e->maximo_us, __ATOMIC_RELAXED);
+    while (us > maximo && !__atomic_compare_exchange_n(&e->maximo_us, &maximo, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void registrar_trafego(int rank, unsigned long enviados, unsigned long recebidos)
+{
+    TrafegoPar *t = &trafego_pares[rank];
+    if (enviados)
     {
-        uint32_t comando_net = htonl(comando);
-        send(s, &comando_net, sizeof(uint32_t), 0);
-        if (comando == CMD_ATUALIZAR_BLOCO)
-        {
-            uint32_t id_bloco_net = htonl(id_bloco);
-            uint32_t offset_net = htonl(offset);
-            uint32_t tam_net = htonl(tam);
-            send(s, &id_bloco_net, sizeof(uint32_t), 0);
-            send(s, &offset_net, sizeof(uint32_t), 0);
-            send(s, &tam_net, sizeof(uint32_t), 0);
-            send(s, dados, tam, 0);
-        }
-        else if (comando == CMD_INVALIDAR_BLOCO)
-        {
-            uint32_t id_bloco_net = htonl(id_bloco);
-            send(s, &id_bloco_net, sizeof(uint32_t), 0);
-        }
+        __atomic_fetch_add(&t->bytes_enviados, enviados, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&t->pedidos, 1, __ATOMIC_RELAXED);
     }
-    close(s);
+    if (recebidos)
+        __atomic_fetch_add(&t->bytes_recebidos, recebidos, __ATOMIC_RELAXED);
 }
 
-void adicionar_bloco_na_cache(int id_bloco, char *dados_bloco)
+/* Limite superior (em us) da faixa onde cai o percentil pedido. */
+unsigned long percentil_latencia(unsigned long *faixas, unsigned long quantidade, double percentil)
 {
-    pthread_mutex_lock(&cache_mutex);
-    int slot_vitima = proximo_slot_cache;
-    printf("[P%d] [CACHE] Adicionando bloco %d no slot %d (substituindo bloco %d).\n",
-           my_rank, id_bloco, slot_vitima, cache[slot_vitima].id);
-    cache[slot_vitima].id = id_bloco;
-    memcpy(cache[slot_vitima].dados, dados_bloco, T_BLOCO);
-    cache[slot_vitima].valido = 1;
-    proximo_slot_cache = (proximo_slot_cache + 1) % tamanho_cache;
-    pthread_mutex_unlock(&cache_mutex);
+    unsigned long alvo = (unsigned long)(quantidade * percentil);
+    unsigned long acumulado = 0;
+    for (int i = 0; i < FAIXAS_LATENCIA; i++)
+    {
+        acumulado += faixas[i];
+        if (acumulado > alvo)
+            return (1UL << i) - 1;
+    }
+    return (1UL << (FAIXAS_LATENCIA - 1)) - 1;
 }
 
-int obter_bloco_remoto(int id_bloco, char *buffer_retorno)
+int send_all(int sock, const char *buffer, int len)
+{
+    int total_enviado = 0;
+    while (total_enviado < len)
+    {
+        int bytes_enviados = send(sock, buffer + total_enviado, len - total_enviado, 0);
+        if (bytes_enviados <= 0)
+            return -1;
+        total_enviado += bytes_enviados;
+    }
+    return total_enviado;
+}
+
+ConexaoPar *criar_conexoes_pares()
+{
+    ConexaoPar *conexoes = malloc(sizeof(ConexaoPar) * N_PROCESSOS);
+    for (int p = 0; p < N_PROCESSOS; p++)
+    {
+        conexoes[p].rank = p;
+        conexoes[p].sock = -1;
+        conexoes[p].geracao = 0;
+        conexoes[p].tickets_emitidos = 0;
+        conexoes[p].tickets_atendidos = 0;
+        conexoes[p].falha_us = 0;
+        conexoes[p].expirou_us = 0;
+        pthread_mutex_init(&conexoes[p].lock_envio, NULL);
+        pthread_mutex_init(&conexoes[p].lock_recepcao, NULL);
+        pthread_cond_init(&conexoes[p].cond_recepcao, NULL);
+    }
+    return conexoes;
+}
+
+/* As invalidacoes tem uma conexao propria com cada par: o par as confirma sem
+   esperar por ninguem, entao a confirmacao nunca fica na fila atras de uma escrita
+   que, no par, espera as confirmacoes deste rank. */
+void inicializar_conexoes_pares()
+{
+    conexoes_pares = criar_conexoes_pares();
+    conexoes_invalidacao = criar_conexoes_pares();
+}
+
+int conectar_par(int rank_destino)
 {
-    int dono = calcular_dono(id_bloco);
-    if (dono < 0)
-        return -1;
     int s = socket(AF_INET, SOCK_STREAM, 0);
     if (s < 0)
         return -1;
-    struct sockaddr_in server;
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server.sin_family = AF_INET;
-    server.sin_port = htons(BASE_PORT + dono);
-
-    printf("[P%d] [REDE] Conectando ao P%d para obter o bloco %d...\n", my_rank, dono, id_bloco);
-    if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0)
+    /* Um par parado sem fechar o socket faria par_receber esperar para sempre com
+       lock_recepcao, prendendo todos os trabalhadores que falam com ele. Com o limite,
+       recv_all falha, a conexao e descartada e todos os tickets pendentes falham. O
+       limite de envio vale tambem para o connect. */
+    struct timeval limite = {.tv_sec = TEMPO_LIMITE_PEDIDO_S, .tv_usec = 0};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &limite, sizeof(limite));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &limite, sizeof(limite));
+    struct sockaddr_in *server = &enderecos_pares[rank_destino].endereco;
+    if (connect(s, (struct sockaddr *)server, sizeof(*server)) < 0)
+    {
+        close(s);
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    uint32_t apresentacao[2] = {htonl(CMD_APRESENTACAO), htonl(my_rank)};
+    if (send_all(s, (char *)apresentacao, sizeof(apresentacao)) < 0)
     {
         close(s);
         return -1;
     }
+    LOG(LOG_INFO, "[P%d] [REDE] Conexao persistente com o P%d estabelecida.\n", my_rank, rank_destino);
+    return s;
+}
 
-    uint32_t comando_net = htonl(CMD_OBTER_BLOCO_INTERNO);
-    uint32_t id_bloco_net = htonl(id_bloco);
-    send(s, &comando_net, sizeof(uint32_t), 0);
-    send(s, &id_bloco_net, sizeof(uint32_t), 0);
+/* Chamada com lock_envio e lock_recepcao adquiridos. Pedidos pendentes da geracao
+   descartada falham e o proximo uso reconecta. */
+void descartar_conexao_par(ConexaoPar *c)
+{
+    if (c->sock >= 0)
+    {
+        LOG(LOG_AVISO, "[P%d] [REDE] Conexao com o P%d perdida.\n", my_rank, c->rank);
+        close(c->sock);
+    }
+    c->sock = -1;
+    c->geracao++;
+    c->tickets_emitidos = 0;
+    c->tickets_atendidos = 0;
+    pthread_cond_broadcast(&c->cond_recepcao);
+}
 
-    int recv_size = recv_all(s, buffer_retorno, T_BLOCO);
-    close(s);
+/* Envia uma mensagem completa pela conexao persistente com o par. Se ticket nao for
+   NULL, a mensagem espera resposta e recebe a posicao na fila de respostas. */
+int conexao_par_enviar(ConexaoPar *c, const char *msg, int len, unsigned long *ticket, unsigned long *geracao)
+{
+    int rank_destino = c->rank;
+    pthread_mutex_lock(&c->lock_envio);
+    if (c->sock < 0)
+    {
+        /* Logo depois de o par deixar uma resposta expirar, o pedido falha sem esperar
+           de novo o limite inteiro. */
+        unsigned long expirou = __atomic_load_n(&c->expirou_us, __ATOMIC_RELAXED);
+        int s = expirou && agora_us() - expirou < TEMPO_SUSPEITA_US ? -1 : conectar_par(rank_destino);
+        if (s < 0)
+        {
+            __atomic_store_n(&c->falha_us, agora_us(), __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&c->lock_envio);
+            return -1;
+        }
+        pthread_mutex_lock(&c->lock_recepcao);
+        c->sock = s;
+        pthread_mutex_unlock(&c->lock_recepcao);
+    }
+    if (send_all(c->sock, msg, len) < 0)
+    {
+        __atomic_store_n(&c->falha_us, agora_us(), __ATOMIC_RELAXED);
+        pthread_mutex_lock(&c->lock_recepcao);
+        descartar_conexao_par(c);
+        pthread_mutex_unlock(&c->lock_recepcao);
+        pthread_mutex_unlock(&c->lock_envio);
+        return -1;
+    }
+    /* tickets_emitidos e geracao so mudam com lock_envio adquirido; nao tomar lock_recepcao
+       aqui evita esperar por quem esta bloqueado lendo uma resposta. */
+    if (ticket)
+    {
+        *ticket = c->tickets_emitidos++;
+        *geracao = c->geracao;
+    }
+    pthread_mutex_unlock(&c->lock_envio);
+    registrar_trafego(rank_destino, len, 0);
+    return 0;
+}
 
-    if (recv_size == T_BLOCO)
+/* As respostas chegam na ordem dos pedidos, entao cada thread espera a vez do seu
+   ticket para ler a resposta do socket. */
+int conexao_par_receber(ConexaoPar *c, unsigned long ticket, unsigned long geracao, char *buffer, int len)
+{
+    int rank_destino = c->rank;
+    pthread_mutex_lock(&c->lock_recepcao);
+    while (c->geracao == geracao && c->tickets_atendidos != ticket)
+        pthread_cond_wait(&c->cond_recepcao, &c->lock_recepcao);
+    if (c->geracao != geracao)
+    {
+        pthread_mutex_unlock(&c->lock_recepcao);
+        return -1;
+    }
+    int recebido = recv_all(c->sock, buffer, len);
+    if (recebido < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        LOG(LOG_AVISO, "[P%d] [REDE] O P%d nao respondeu em %d s.\n", my_rank, rank_destino, TEMPO_LIMITE_PEDIDO_S);
+        __atomic_store_n(&c->expirou_us, agora_us(), __ATOMIC_RELAXED);
+    }
+    if (recebido == len)
     {
-        adicionar_bloco_na_cache(id_bloco, buffer_retorno);
+        c->tickets_atendidos++;
+        pthread_cond_broadcast(&c->cond_recepcao);
+        pthread_mutex_unlock(&c->lock_recepcao);
+        registrar_trafego(rank_destino, 0, len);
         return 0;
     }
+    pthread_mutex_unlock(&c->lock_recepcao);
+    pthread_mutex_lock(&c->lock_envio);
+    pthread_mutex_lock(&c->lock_recepcao);
+    if (c->geracao == geracao)
+        descartar_conexao_par(c);
+    pthread_mutex_unlock(&c->lock_recepcao);
+    pthread_mutex_unlock(&c->lock_envio);
     return -1;
 }
 
-void *handle_connection(void *socket_desc)
+int par_enviar(int rank_destino, const char *msg, int len, unsigned long *ticket, unsigned long *geracao)
+{
+    return conexao_par_enviar(&conexoes_pares[rank_destino], msg, len, ticket, geracao);
+}
+
+int par_receber(int rank_destino, unsigned long ticket, unsigned long geracao, char *buffer, int len)
 {
-    int sock = *(int *)socket_desc;
-    free(socket_desc);
+    return conexao_par_receber(&conexoes_pares[rank_destino], ticket, geracao, buffer, len);
+}
 
-    uint32_t comando_net;
-    if (recv_all(sock, (char *)&comando_net, sizeof(uint32_t)) < 0)
+int par_requisitar(int rank_destino, const char *msg, int len, char *resposta, int tam_resposta)
+{
+    for (int tentativa = 0; tentativa < 2; tentativa++)
     {
-        close(sock);
+        unsigned long ticket, geracao;
+        if (par_enviar(rank_destino, msg, len, &ticket, &geracao) < 0)
+            continue;
+        if (par_receber(rank_destino, ticket, geracao, resposta, tam_resposta) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+/* Como par_requisitar, mas sem reenviar o pedido se a resposta nao chegar: para
+   pedidos que nao podem ser executados duas vezes. */
+int par_requisitar_uma_vez(int rank_destino, const char *msg, int len, char *resposta, int tam_resposta)
+{
+    unsigned long ticket, geracao;
+    if (par_enviar(rank_destino, msg, len, &ticket, &geracao) < 0)
+        return -1;
+    return par_receber(rank_destino, ticket, geracao, resposta, tam_resposta);
+}
+
+/* Blocos de ranks cujos dados estao neste espaco de enderecos sao lidos e escritos
+   diretamente. */
+BlocoMemoria *bloco_local(int id_bloco)
+{
+    int i = id_bloco - blocos_inicio;
+    if (i < 0 || i >= num_blocos_locais)
         return NULL;
+    return &blocos_locais[i];
+}
+
+/* Dica de onde esta um bloco que migrou, aprendida pelas respostas dos outros
+   ranks; sem dica, o bloco e procurado no rank de origem. */
+int localizar_dono(int id_bloco)
+{
+    int dica = id_bloco >= 0 && id_bloco < K_BLOCOS ? __atomic_load_n(&dicas_dono[id_bloco], __ATOMIC_RELAXED) : -1;
+    return dica >= 0 ? dica : calcular_dono(id_bloco);
+}
+
+void definir_dica(int id_bloco, int local)
+{
+    if (local < 0 || local >= N_PROCESSOS || id_bloco < 0 || id_bloco >= K_BLOCOS)
+        return;
+    __atomic_store_n(&dicas_dono[id_bloco], local == calcular_dono(id_bloco) ? -1 : local, __ATOMIC_RELAXED);
+}
+
+/* Melhor palpite para um bloco que nao esta neste processo. */
+int local_provavel(int id_bloco)
+{
+    int local = localizar_dono(id_bloco);
+    return local == my_rank ? calcular_dono(id_bloco) : local;
+}
+
+#ifdef __APPLE__
+#define sincronizar_arquivo(fd) fsync(fd)
+#else
+#define sincronizar_arquivo(fd) fdatasync(fd)
+#endif
+
+void caminho_wal(char *caminho, size_t tam, uint64_t geracao)
+{
+    snprintf(caminho, tam, "%s/p%d.wal.%llu", dados_dir, my_rank, (unsigned long long)geracao);
+}
+
+uint32_t soma_registro(const RegistroWal *registro, const char *dados)
+{
+    uint32_t soma = 2166136261u;
+    const unsigned char *campos = (const unsigned char *)registro;
+    for (size_t i = 0; i < 3 * sizeof(uint32_t); i++)
+        soma = (soma ^ campos[i]) * 16777619u;
+    for (uint32_t i = 0; i < registro->tam; i++)
+        soma = (soma ^ (unsigned char)dados[i]) * 16777619u;
+    return soma;
+}
+
+void gravar_tudo(int fd, const char *dados, size_t tam)
+{
+    while (tam > 0)
+    {
+        ssize_t gravados = write(fd, dados, tam);
+        if (gravados < 0 && errno == EINTR)
+            continue;
+        if (gravados <= 0)
+            die("gravacao do log falhou");
+        dados += gravados;
+        tam -= gravados;
     }
-    int command = ntohl(comando_net);
-    printf("\n[P%d] [REDE] Conexão recebida. Comando: %s (%d)\n", my_rank, traduzir_comando(command), command);
+}
 
-    switch (command)
+int bloco_persistente(BlocoMemoria *bloco)
+{
+    return wal.fd >= 0 && bloco >= blocos_locais && bloco < blocos_locais + num_blocos_locais;
+}
+
+/* Chamado com a listra do bloco travada, depois da copia: a ordem dos registros de
+   um bloco no log e a ordem em que as escritas foram aplicadas. */
+unsigned long wal_anexar(int id_bloco, int offset, int tam, const char *dados)
+{
+    RegistroWal registro = {id_bloco, offset, tam, 0};
+    registro.soma = soma_registro(&registro, dados);
+    int tam_registro = sizeof(registro) + tam;
+    pthread_mutex_lock(&wal.lock);
+    if (wal.usado + tam_registro > wal.capacidade)
     {
-    case CMD_OBTER_DADOS:
+        wal.capacidade = 2 * (wal.usado + tam_registro);
+        wal.pendente = realloc(wal.pendente, wal.capacidade);
+        if (!wal.pendente)
+            die("alocacao do log falhou");
+    }
+    memcpy(wal.pendente + wal.usado, &registro, sizeof(registro));
+    memcpy(wal.pendente + wal.usado + sizeof(registro), dados, tam);
+    wal.usado += tam_registro;
+    wal.lsn_anexado += tam_registro;
+    wal.bytes_geracao += tam_registro;
+    unsigned long lsn = wal.lsn_anexado;
+    pthread_mutex_unlock(&wal.lock);
+    __atomic_fetch_add(&wal_registros, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&wal_bytes, tam_registro, __ATOMIC_RELAXED);
+    return lsn;
+}
+
+/* Com wal.lock travado e sem lider. Grava o que estiver pendente, soltando a trava
+   durante a gravacao para que outros escritores continuem anexando. */
+void wal_gravar_pendente()
+{
+    wal.lider = 1;
+    char *lote = wal.pendente;
+    int tam = wal.usado;
+    unsigned long fim = wal.lsn_anexado;
+    int fd = wal.fd;
+    wal.pendente = wal.gravando;
+    wal.gravando = lote;
+    int capacidade = wal.capacidade;
+    wal.capacidade = wal.capacidade_gravando;
+    wal.capacidade_gravando = capacidade;
+    wal.usado = 0;
+    pthread_mutex_unlock(&wal.lock);
+    gravar_tudo(fd, lote, tam);
+    if (sincronizar_arquivo(fd) < 0)
+        die("sincronizacao do log falhou");
+    __atomic_fetch_add(&wal_fsyncs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&wal.lock);
+    wal.lsn_duravel = fim;
+    wal.lider = 0;
+    pthread_cond_broadcast(&wal.cond);
+}
+
+void wal_aguardar(unsigned long lsn)
+{
+    pthread_mutex_lock(&wal.lock);
+    while (wal.lsn_duravel < lsn)
     {
-        uint32_t pos_net, tam_net;
-        recv_all(sock, (char *)&pos_net, sizeof(uint32_t));
-        recv_all(sock, (char *)&tam_net, sizeof(uint32_t));
-        int pos = ntohl(pos_net);
-        int tam = ntohl(tam_net);
-        printf("[P%d] [OBTER_DADOS] Processando pedido para ler %d bytes da posição %d.\n", my_rank, tam, pos);
+        if (wal.lider)
+            pthread_cond_wait(&wal.cond, &wal.lock);
+        else
+            wal_gravar_pendente();
+    }
+    pthread_mutex_unlock(&wal.lock);
+}
 
-        if (pos < 0 || (pos + tam) > (K_BLOCOS * T_BLOCO) || tam <= 0)
+int abrir_wal(uint64_t geracao)
+{
+    char caminho[TAM_CAMINHO];
+    caminho_wal(caminho, sizeof(caminho), geracao);
+    int fd = open(caminho, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        die("abertura do log falhou");
+    return fd;
+}
+
+void sincronizar_dados()
+{
+    if (msync(cabecalho_dados, tam_arquivo_dados, MS_SYNC) < 0)
+        die("msync dos dados falhou");
+}
+
+/* Fecha a geracao atual do log e passa a escrever na seguinte. Os registros da
+   geracao fechada ja estao aplicados na memoria mapeada, entao depois do msync o
+   arquivo de dados os contem e o log antigo pode ser apagado. */
+void checkpoint()
+{
+    pthread_mutex_lock(&wal.lock);
+    while (wal.lider)
+        pthread_cond_wait(&wal.cond, &wal.lock);
+    if (wal.usado > 0)
+    {
+        wal_gravar_pendente();
+        while (wal.lider)
+            pthread_cond_wait(&wal.cond, &wal.lock);
+    }
+    int fd_antigo = wal.fd;
+    uint64_t geracao_antiga = wal.geracao;
+    wal.fd = abrir_wal(geracao_antiga + 1);
+    wal.geracao = geracao_antiga + 1;
+    wal.bytes_geracao = 0;
+    pthread_mutex_unlock(&wal.lock);
+    close(fd_antigo);
+    sincronizar_dados();
+    cabecalho_dados->geracao_wal = geracao_antiga + 1;
+    if (msync(cabecalho_dados, TAM_CABECALHO_DADOS, MS_SYNC) < 0)
+        die("msync do cabecalho falhou");
+    char caminho[TAM_CAMINHO];
+    caminho_wal(caminho, sizeof(caminho), geracao_antiga);
+    unlink(caminho);
+    __atomic_fetch_add(&checkpoints, 1, __ATOMIC_RELAXED);
+    LOG(LOG_DEBUG, "[P%d] [PERSISTENCIA] Checkpoint: log %llu descartado.\n", my_rank,
+        (unsigned long long)geracao_antiga);
+}
+
+/* Faz checkpoint a cada intervalo_checkpoint segundos ou quando o log passa de
+   LIMITE_BYTES_WAL, o que vier primeiro. */
+void *executar_checkpoints(void *arg)
+{
+    time_t ultimo = time(NULL);
+    while (1)
+    {
+        sleep(1);
+        pthread_mutex_lock(&wal.lock);
+        long bytes = wal.bytes_geracao;
+        pthread_mutex_unlock(&wal.lock);
+        if (bytes > 0 && (bytes >= LIMITE_BYTES_WAL || time(NULL) - ultimo >= intervalo_checkpoint))
+        {
+            checkpoint();
+            ultimo = time(NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Reaplica um log na memoria mapeada, ate o fim ou ate o primeiro registro cortado. */
+long reaplicar_wal(uint64_t geracao)
+{
+    char caminho[TAM_CAMINHO];
+    caminho_wal(caminho, sizeof(caminho), geracao);
+    FILE *arquivo = fopen(caminho, "rb");
+    if (!arquivo)
+        return -1;
+    long reaplicados = 0;
+    char *dados = malloc(T_BLOCO);
+    RegistroWal registro;
+    while (fread(&registro, sizeof(registro), 1, arquivo) == 1)
+    {
+        int i = (int)registro.id_bloco - blocos_inicio;
+        if (i < 0 || i >= num_blocos_locais || registro.offset > (uint32_t)T_BLOCO ||
+            registro.tam > (uint32_t)T_BLOCO - registro.offset)
+            break;
+        if (fread(dados, 1, registro.tam, arquivo) != registro.tam || soma_registro(&registro, dados) != registro.soma)
+            break;
+        memcpy(arena_local + (size_t)i * stride_bloco + registro.offset, dados, registro.tam);
+        reaplicados++;
+    }
+    free(dados);
+    fclose(arquivo);
+    return reaplicados;
+}
+
+/* Mapeia o arquivo de dados do rank (criando-o com os blocos iniciais se nao
+   existir) e reaplica os logs a partir do ultimo checkpoint. Depois disso os dados
+   sao sincronizados e a escrita continua num log novo. */
+char *abrir_dados()
+{
+    char caminho[TAM_CAMINHO];
+    snprintf(caminho, sizeof(caminho), "%s/p%d.dados", dados_dir, my_rank);
+    mkdir(dados_dir, 0755);
+    int fd = open(caminho, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        die("abertura do arquivo de dados falhou");
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+        die("fstat do arquivo de dados falhou");
+    tam_arquivo_dados = TAM_CABECALHO_DADOS + (size_t)num_blocos_locais * stride_bloco;
+    int novo = info.st_size == 0;
+    if (!novo && (size_t)info.st_size != tam_arquivo_dados)
+    {
+        fprintf(stderr, "%s tem %lld bytes, esperados %zu: o layout mudou?\n", caminho, (long long)info.st_size,
+                tam_arquivo_dados);
+        exit(1);
+    }
+    if (novo && ftruncate(fd, tam_arquivo_dados) < 0)
+        die("ftruncate do arquivo de dados falhou");
+    char *mapa = mmap(NULL, tam_arquivo_dados, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapa == MAP_FAILED)
+        die("mmap do arquivo de dados falhou");
+    close(fd);
+    cabecalho_dados = (CabecalhoDados *)mapa;
+    arena_local = mapa + TAM_CABECALHO_DADOS;
+    if (novo)
+    {
+        for (int i = 0; i < num_blocos_locais; i++)
+            memset(arena_local + (size_t)i * stride_bloco, '-', T_BLOCO);
+        CabecalhoDados cabecalho = {MAGICO_DADOS, N_PROCESSOS, K_BLOCOS, T_BLOCO, my_rank, 1};
+        *cabecalho_dados = cabecalho;
+        sincronizar_dados();
+    }
+    else if (cabecalho_dados->magico != MAGICO_DADOS || cabecalho_dados->num_processos != N_PROCESSOS ||
+             cabecalho_dados->num_blocos != K_BLOCOS || cabecalho_dados->tam_bloco != T_BLOCO ||
+             cabecalho_dados->rank != my_rank)
+    {
+        fprintf(stderr, "%s foi criado com outro layout ou para outro rank.\n", caminho);
+        exit(1);
+    }
+    unsigned long inicio = agora_us();
+    uint64_t geracao = cabecalho_dados->geracao_wal;
+    long reaplicados;
+    while ((reaplicados = reaplicar_wal(geracao)) >= 0)
+    {
+        registros_reaplicados += reaplicados;
+        geracao++;
+    }
+    /* Um log de geracao maior indica uma queda no meio de um checkpoint. */
+    wal.geracao = geracao > cabecalho_dados->geracao_wal ? geracao - 1 : geracao;
+    wal.fd = abrir_wal(wal.geracao + 1);
+    wal.geracao++;
+    sincronizar_dados();
+    uint64_t primeira = cabecalho_dados->geracao_wal;
+    cabecalho_dados->geracao_wal = wal.geracao;
+    if (msync(cabecalho_dados, TAM_CABECALHO_DADOS, MS_SYNC) < 0)
+        die("msync do cabecalho falhou");
+    for (uint64_t g = primeira; g < wal.geracao; g++)
+    {
+        caminho_wal(caminho, sizeof(caminho), g);
+        unlink(caminho);
+    }
+    LOG(LOG_INFO, "[P%d] Dados em %s/p%d.dados (%s); %lu registros do log reaplicados em %lums.\n", my_rank, dados_dir,
+        my_rank, novo ? "novo" : "existente", registros_reaplicados, (agora_us() - inicio) / 1000);
+    return arena_local;
+}
+
+/* Blocos locais usam seqlock: escritores (serializados por listra) deixam seq impar
+   durante a copia e leitores repetem a leitura se seq mudou, sem nunca bloquear.
+   O seq par lido (ou deixado) pela operacao tambem serve de versao do bloco. A
+   escrita e recusada (-1) se o bloco nao esta mais em local, isto e, se migrou. */
+uint32_t bloco_ler(BlocoMemoria *bloco, int offset, int tam, char *destino)
+{
+    while (1)
+    {
+        uint32_t inicio = __atomic_load_n(&bloco->seq, __ATOMIC_ACQUIRE);
+        if (inicio & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(destino, bloco->dados + offset, tam);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&bloco->seq, __ATOMIC_RELAXED) == inicio)
+            return inicio;
+    }
+}
+
+/* Com a listra do bloco. Retorna o lsn do registro no log (0 sem persistencia). */
+unsigned long bloco_gravar(BlocoMemoria *bloco, int offset, int tam, const char *dados, uint32_t *versao)
+{
+    __atomic_store_n(&bloco->seq, bloco->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(bloco->dados + offset, dados, tam);
+    *versao = bloco->seq + 1;
+    __atomic_store_n(&bloco->seq, *versao, __ATOMIC_RELEASE);
+    return bloco_persistente(bloco) ? wal_anexar(bloco->id, offset, tam, dados) : 0;
+}
+
+int bloco_escrever(BlocoMemoria *bloco, int offset, int tam, const char *dados, int local, uint32_t *versao)
+{
+    pthread_mutex_t *listra = &listras_escrita[bloco->id % NUM_LISTRAS_ESCRITA];
+    pthread_mutex_lock(listra);
+    if (__atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST) != local)
+    {
+        pthread_mutex_unlock(listra);
+        return -1;
+    }
+    unsigned long lsn = bloco_gravar(bloco, offset, tam, dados, versao);
+    pthread_mutex_unlock(listra);
+    /* A escrita so e confirmada depois de estar no log em disco. */
+    if (lsn)
+        wal_aguardar(lsn);
+    return 0;
+}
+
+uint64_t palavra_ler(const char *origem, int largura)
+{
+    uint64_t valor = 0;
+    for (int i = largura - 1; i >= 0; i--)
+        valor = (valor << 8) | (unsigned char)origem[i];
+    return valor;
+}
+
+void palavra_gravar(char *destino, int largura, uint64_t valor)
+{
+    for (int i = 0; i < largura; i++, valor >>= 8)
+        destino[i] = (char)(valor & 0xff);
+}
+
+/* Le a palavra, calcula o novo valor e o grava, tudo sob a listra: as escritas
+   comuns do bloco nao se intercalam com a operacao. Sem mudanca na palavra, o bloco
+   fica como estava e *versao e a versao atual. */
+int bloco_atomico(BlocoMemoria *bloco, int offset, OperacaoAtomica *operacao, int local, uint32_t *versao)
+{
+    uint64_t mascara = operacao->largura == 8 ? ~(uint64_t)0 : 0xffffffffu;
+    pthread_mutex_t *listra = &listras_escrita[bloco->id % NUM_LISTRAS_ESCRITA];
+    pthread_mutex_lock(listra);
+    if (__atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST) != local)
+    {
+        pthread_mutex_unlock(listra);
+        return -1;
+    }
+    uint64_t anterior = palavra_ler(bloco->dados + offset, operacao->largura);
+    uint64_t novo = anterior;
+    if (operacao->operacao == ATOMICO_COMPARAR_TROCAR)
+    {
+        if (anterior == (operacao->esperado & mascara))
+            novo = operacao->operando & mascara;
+    }
+    else if (operacao->operacao == ATOMICO_SOMAR)
+        novo = (anterior + operacao->operando) & mascara;
+    else
+        novo = operacao->operando & mascara;
+    operacao->anterior = anterior;
+    operacao->alterou = novo != anterior;
+    unsigned long lsn = 0;
+    if (operacao->alterou)
+    {
+        palavra_gravar(operacao->novo, operacao->largura, novo);
+        lsn = bloco_gravar(bloco, offset, operacao->largura, operacao->novo, versao);
+    }
+    else
+        *versao = bloco->seq;
+    pthread_mutex_unlock(listra);
+    __atomic_fetch_add(&atomicos_executados, 1, __ATOMIC_RELAXED);
+    if (!operacao->alterou)
+        __atomic_fetch_add(&atomicos_sem_efeito, 1, __ATOMIC_RELAXED);
+    if (lsn)
+        wal_aguardar(lsn);
+    return 0;
+}
+
+void indice_iniciar(IndiceHash *indice, int capacidade_minima)
+{
+    indice->bits = 1;
+    while ((1 << indice->bits) < 2 * capacidade_minima)
+        indice->bits++;
+    int capacidade = 1 << indice->bits;
+    indice->mascara = capacidade - 1;
+    indice->chaves = malloc(sizeof(int) * capacidade);
+    indice->valores = malloc(sizeof(int) * capacidade);
+    for (int i = 0; i < capacidade; i++)
+        indice->chaves[i] = -1;
+}
+
+int indice_posicao_ideal(IndiceHash *indice, int chave)
+{
+    return (int)(((uint32_t)chave * 2654435769u) >> (32 - indice->bits));
+}
+
+int indice_buscar(IndiceHash *indice, int chave)
+{
+    for (int i = indice_posicao_ideal(indice, chave);; i = (i + 1) & indice->mascara)
+    {
+        if (indice->chaves[i] == chave)
+            return indice->valores[i];
+        if (indice->chaves[i] == -1)
+            return -1;
+    }
+}
+
+void indice_inserir(IndiceHash *indice, int chave, int valor)
+{
+    int i = indice_posicao_ideal(indice, chave);
+    while (indice->chaves[i] != -1 && indice->chaves[i] != chave)
+        i = (i + 1) & indice->mascara;
+    indice->chaves[i] = chave;
+    indice->valores[i] = valor;
+}
+
+/* Remocao por deslocamento reverso: mantem as sequencias de sondagem linear sem
+   marcadores de remocao. */
+void indice_remover(IndiceHash *indice, int chave)
+{
+    int i = indice_posicao_ideal(indice, chave);
+    while (indice->chaves[i] != chave)
+    {
+        if (indice->chaves[i] == -1)
+            return;
+        i = (i + 1) & indice->mascara;
+    }
+    int vazio = i;
+    for (int j = (vazio + 1) & indice->mascara; indice->chaves[j] != -1; j = (j + 1) & indice->mascara)
+    {
+        int ideal = indice_posicao_ideal(indice, indice->chaves[j]);
+        if (((j - ideal) & indice->mascara) >= ((j - vazio) & indice->mascara))
+        {
+            indice->chaves[vazio] = indice->chaves[j];
+            indice->valores[vazio] = indice->valores[j];
+            vazio = j;
+        }
+    }
+    indice->chaves[vazio] = -1;
+}
+
+/* Copia para o resultado a parte do bloco que cai dentro de [pos, pos + tam). */
+int calcular_fatia(int pos, int tam, int id_bloco, int *offset_bloco, int *tam_fatia)
+{
+    int inicio_bloco = id_bloco * T_BLOCO;
+    int inicio = inicio_bloco > pos ? inicio_bloco : pos;
+    int fim = inicio_bloco + T_BLOCO < pos + tam ? inicio_bloco + T_BLOCO : pos + tam;
+    *offset_bloco = inicio - inicio_bloco;
+    *tam_fatia = fim > inicio ? fim - inicio : 0;
+    return inicio - pos;
+}
+
+void copiar_fatia(char *resultado, int pos, int tam, int id_bloco, const char *dados_bloco)
+{
+    int offset_bloco, tam_fatia;
+    int destino = calcular_fatia(pos, tam, id_bloco, &offset_bloco, &tam_fatia);
+    if (tam_fatia > 0)
+        memcpy(resultado + destino, dados_bloco + offset_bloco, tam_fatia);
+}
+
+void lista_remover(ListaCache *lista, int *anterior, int *proximo, int no)
+{
+    if (anterior[no] >= 0)
+        proximo[anterior[no]] = proximo[no];
+    else
+        lista->cabeca = proximo[no];
+    if (proximo[no] >= 0)
+        anterior[proximo[no]] = anterior[no];
+    else
+        lista->cauda = anterior[no];
+    lista->tamanho--;
+}
+
+void lista_inserir_cabeca(ListaCache *lista, int *anterior, int *proximo, int no)
+{
+    anterior[no] = -1;
+    proximo[no] = lista->cabeca;
+    if (lista->cabeca >= 0)
+        anterior[lista->cabeca] = no;
+    else
+        lista->cauda = no;
+    lista->cabeca = no;
+    lista->tamanho++;
+}
+
+void lista_iniciar(ListaCache *lista)
+{
+    lista->cabeca = -1;
+    lista->cauda = -1;
+    lista->tamanho = 0;
+}
+
+int cache_slot_livre(Cache *c)
+{
+    return c->num_livres > 0 ? c->livres[--c->num_livres] : -1;
+}
+
+void cache_despejar(Cache *c, int slot)
+{
+    LOG(LOG_DEBUG, "[P%d] [CACHE] Bloco %d removido do slot %d pela politica %s.\n",
+        my_rank, c->slots[slot].id, slot, c->politica->nome);
+    indice_remover(&c->indice, c->slots[slot].id);
+    c->slots[slot].valido = 0;
+    if (c->slots[slot].antecipado)
+    {
+        c->slots[slot].antecipado = 0;
+        __atomic_fetch_add(&prefetch_desperdicados, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&c->remocoes, 1, __ATOMIC_RELAXED);
+}
+
+void fifo_acessar(Cache *c, int slot)
+{
+    (void)c;
+    (void)slot;
+}
+
+void lru_acessar(Cache *c, int slot)
+{
+    lista_remover(&c->recentes, c->anterior, c->proximo, slot);
+    lista_inserir_cabeca(&c->recentes, c->anterior, c->proximo, slot);
+}
+
+int fifo_alocar(Cache *c, int id_novo)
+{
+    (void)id_novo;
+    int slot = cache_slot_livre(c);
+    if (slot < 0)
+    {
+        slot = c->recentes.cauda;
+        lista_remover(&c->recentes, c->anterior, c->proximo, slot);
+        cache_despejar(c, slot);
+    }
+    lista_inserir_cabeca(&c->recentes, c->anterior, c->proximo, slot);
+    return slot;
+}
+
+void fifo_liberar(Cache *c, int slot)
+{
+    lista_remover(&c->recentes, c->anterior, c->proximo, slot);
+}
+
+void clock_acessar(Cache *c, int slot)
+{
+    __atomic_store_n(&c->slots[slot].referenciado, 1, __ATOMIC_RELAXED);
+}
+
+int clock_alocar(Cache *c, int id_novo)
+{
+    (void)id_novo;
+    int slot = cache_slot_livre(c);
+    if (slot < 0)
+    {
+        while (c->slots[c->ponteiro_relogio].referenciado)
+        {
+            c->slots[c->ponteiro_relogio].referenciado = 0;
+            c->ponteiro_relogio = (c->ponteiro_relogio + 1) % c->capacidade;
+        }
+        slot = c->ponteiro_relogio;
+        c->ponteiro_relogio = (c->ponteiro_relogio + 1) % c->capacidade;
+        cache_despejar(c, slot);
+    }
+    c->slots[slot].referenciado = 0;
+    return slot;
+}
+
+void clock_liberar(Cache *c, int slot)
+{
+    c->slots[slot].referenciado = 0;
+}
+
+/* ARC: T1 (recentes) e T2 (frequentes) guardam blocos residentes; B1 e B2 guardam
+   apenas os ids removidos de cada uma. Um acerto em B1 aumenta o alvo de T1 e um
+   acerto em B2 diminui, adaptando a divisao da cache ao padrao de acesso. */
+void arc_descartar_fantasma(Cache *c, int fantasma)
+{
+    ListaCache *lista = c->fantasma_lista[fantasma] == LISTA_RECENTES ? &c->fantasmas_recentes : &c->fantasmas_frequentes;
+    lista_remover(lista, c->fantasma_anterior, c->fantasma_proximo, fantasma);
+    indice_remover(&c->indice_fantasmas, c->fantasma_id[fantasma]);
+    c->fantasmas_livres[c->num_fantasmas_livres++] = fantasma;
+}
+
+void arc_criar_fantasma(Cache *c, int id_bloco, int lista_destino)
+{
+    if (c->num_fantasmas_livres == 0)
+    {
+        ListaCache *maior = c->fantasmas_recentes.tamanho >= c->fantasmas_frequentes.tamanho ? &c->fantasmas_recentes : &c->fantasmas_frequentes;
+        arc_descartar_fantasma(c, maior->cauda);
+    }
+    int fantasma = c->fantasmas_livres[--c->num_fantasmas_livres];
+    ListaCache *lista = lista_destino == LISTA_RECENTES ? &c->fantasmas_recentes : &c->fantasmas_frequentes;
+    c->fantasma_id[fantasma] = id_bloco;
+    c->fantasma_lista[fantasma] = lista_destino;
+    lista_inserir_cabeca(lista, c->fantasma_anterior, c->fantasma_proximo, fantasma);
+    indice_inserir(&c->indice_fantasmas, id_bloco, fantasma);
+}
+
+void arc_acessar(Cache *c, int slot)
+{
+    ListaCache *origem = c->lista_do_slot[slot] == LISTA_RECENTES ? &c->recentes : &c->frequentes;
+    lista_remover(origem, c->anterior, c->proximo, slot);
+    lista_inserir_cabeca(&c->frequentes, c->anterior, c->proximo, slot);
+    c->lista_do_slot[slot] = LISTA_FREQUENTES;
+}
+
+int arc_substituir(Cache *c, int acerto_frequentes)
+{
+    int slot;
+    if (c->recentes.tamanho > 0 &&
+        (c->recentes.tamanho > c->alvo_recentes || (acerto_frequentes && c->recentes.tamanho == c->alvo_recentes) ||
+         c->frequentes.tamanho == 0))
+    {
+        slot = c->recentes.cauda;
+        lista_remover(&c->recentes, c->anterior, c->proximo, slot);
+        arc_criar_fantasma(c, c->slots[slot].id, LISTA_RECENTES);
+    }
+    else
+    {
+        slot = c->frequentes.cauda;
+        lista_remover(&c->frequentes, c->anterior, c->proximo, slot);
+        arc_criar_fantasma(c, c->slots[slot].id, LISTA_FREQUENTES);
+    }
+    cache_despejar(c, slot);
+    return slot;
+}
+
+int arc_alocar(Cache *c, int id_novo)
+{
+    int fantasma = indice_buscar(&c->indice_fantasmas, id_novo);
+    int acerto_recentes = fantasma >= 0 && c->fantasma_lista[fantasma] == LISTA_RECENTES;
+    int acerto_frequentes = fantasma >= 0 && c->fantasma_lista[fantasma] == LISTA_FREQUENTES;
+    if (acerto_recentes)
+    {
+        int delta = c->fantasmas_frequentes.tamanho / c->fantasmas_recentes.tamanho;
+        c->alvo_recentes += delta > 1 ? delta : 1;
+        if (c->alvo_recentes > c->capacidade)
+            c->alvo_recentes = c->capacidade;
+        arc_descartar_fantasma(c, fantasma);
+    }
+    else if (acerto_frequentes)
+    {
+        int delta = c->fantasmas_recentes.tamanho / c->fantasmas_frequentes.tamanho;
+        c->alvo_recentes -= delta > 1 ? delta : 1;
+        if (c->alvo_recentes < 0)
+            c->alvo_recentes = 0;
+        arc_descartar_fantasma(c, fantasma);
+    }
+    else if (c->recentes.tamanho + c->fantasmas_recentes.tamanho >= c->capacidade)
+    {
+        if (c->fantasmas_recentes.tamanho > 0)
+            arc_descartar_fantasma(c, c->fantasmas_recentes.cauda);
+    }
+    else if (c->recentes.tamanho + c->frequentes.tamanho + c->fantasmas_recentes.tamanho +
+                     c->fantasmas_frequentes.tamanho >= 2 * c->capacidade &&
+             c->fantasmas_frequentes.tamanho > 0)
+        arc_descartar_fantasma(c, c->fantasmas_frequentes.cauda);
+
+    int slot = cache_slot_livre(c);
+    if (slot < 0)
+        slot = arc_substituir(c, acerto_frequentes);
+    int lista_destino = (acerto_recentes || acerto_frequentes) ? LISTA_FREQUENTES : LISTA_RECENTES;
+    lista_inserir_cabeca(lista_destino == LISTA_RECENTES ? &c->recentes : &c->frequentes, c->anterior, c->proximo, slot);
+    c->lista_do_slot[slot] = lista_destino;
+    return slot;
+}
+
+void arc_liberar(Cache *c, int slot)
+{
+    ListaCache *origem = c->lista_do_slot[slot] == LISTA_RECENTES ? &c->recentes : &c->frequentes;
+    lista_remover(origem, c->anterior, c->proximo, slot);
+}
+
+const PoliticaCache politicas_cache[] = {
+    {"fifo", 1, fifo_acessar, fifo_alocar, fifo_liberar},
+    {"lru", 0, lru_acessar, fifo_alocar, fifo_liberar},
+    {"clock", 1, clock_acessar, clock_alocar, clock_liberar},
+    {"arc", 0, arc_acessar, arc_alocar, arc_liberar},
+};
+
+const PoliticaCache *buscar_politica_cache(const char *nome)
+{
+    for (size_t i = 0; i < sizeof(politicas_cache) / sizeof(politicas_cache[0]); i++)
+    {
+        if (strcmp(politicas_cache[i].nome, nome) == 0)
+            return &politicas_cache[i];
+    }
+    return NULL;
+}
+
+void cache_iniciar(Cache *c, int capacidade, const PoliticaCache *politica, char *arena)
+{
+    c->capacidade = capacidade;
+    c->politica = politica;
+    c->slots = malloc(sizeof(BlocoCache) * capacidade);
+    c->anterior = malloc(sizeof(int) * capacidade);
+    c->proximo = malloc(sizeof(int) * capacidade);
+    c->lista_do_slot = malloc(sizeof(int) * capacidade);
+    c->livres = malloc(sizeof(int) * capacidade);
+    for (int i = 0; i < capacidade; i++)
+    {
+        c->slots[i].id = -1;
+        c->slots[i].dados = arena + (size_t)i * stride_bloco;
+        c->slots[i].valido = 0;
+        c->slots[i].referenciado = 0;
+        c->slots[i].antecipado = 0;
+        c->livres[i] = capacidade - 1 - i;
+    }
+    c->num_livres = capacidade;
+    indice_iniciar(&c->indice, capacidade);
+    lista_iniciar(&c->recentes);
+    lista_iniciar(&c->frequentes);
+    lista_iniciar(&c->fantasmas_recentes);
+    lista_iniciar(&c->fantasmas_frequentes);
+    c->ponteiro_relogio = 0;
+    c->alvo_recentes = 0;
+    int num_fantasmas = 2 * capacidade + 1;
+    c->fantasma_id = malloc(sizeof(int) * num_fantasmas);
+    c->fantasma_anterior = malloc(sizeof(int) * num_fantasmas);
+    c->fantasma_proximo = malloc(sizeof(int) * num_fantasmas);
+    c->fantasma_lista = malloc(sizeof(int) * num_fantasmas);
+    c->fantasmas_livres = malloc(sizeof(int) * num_fantasmas);
+    for (int i = 0; i < num_fantasmas; i++)
+        c->fantasmas_livres[i] = i;
+    c->num_fantasmas_livres = num_fantasmas;
+    indice_iniciar(&c->indice_fantasmas, num_fantasmas);
+    c->acertos = c->faltas = c->remocoes = 0;
+    pthread_rwlock_init(&c->lock, NULL);
+    pthread_mutex_init(&c->lock_politica, NULL);
+}
+
+/* A cache e dividida em fragmentos independentes, cada um com sua politica e seu
+   lock, escolhidos pelo hash do id do bloco. Uma unica arena guarda os slots. */
+void caches_iniciar(int capacidade, const PoliticaCache *politica)
+{
+    num_fragmentos_cache = capacidade < MAX_FRAGMENTOS_CACHE ? capacidade : MAX_FRAGMENTOS_CACHE;
+    if (num_fragmentos_cache < 1)
+        num_fragmentos_cache = 1;
+    caches = malloc(sizeof(Cache) * num_fragmentos_cache);
+    char *arena = capacidade > 0 ? alocar_arena((size_t)capacidade * stride_bloco, 0) : NULL;
+    for (int i = 0; i < num_fragmentos_cache; i++)
+    {
+        int capacidade_fragmento = capacidade / num_fragmentos_cache + (i < capacidade % num_fragmentos_cache);
+        cache_iniciar(&caches[i], capacidade_fragmento, politica, arena);
+        if (arena)
+            arena += (size_t)capacidade_fragmento * stride_bloco;
+    }
+}
+
+Cache *cache_do_bloco(int id_bloco)
+{
+    return &caches[(((uint32_t)id_bloco * 2654435769u) >> 16) % num_fragmentos_cache];
+}
+
+void cache_totais(long *acertos, long *faltas, long *remocoes)
+{
+    *acertos = *faltas = *remocoes = 0;
+    for (int i = 0; i < num_fragmentos_cache; i++)
+    {
+        *acertos += __atomic_load_n(&caches[i].acertos, __ATOMIC_RELAXED);
+        *faltas += __atomic_load_n(&caches[i].faltas, __ATOMIC_RELAXED);
+        *remocoes += __atomic_load_n(&caches[i].remocoes, __ATOMIC_RELAXED);
+    }
+}
+
+/* Copia a fatia do bloco que cai em [pos, pos + tam) se ele estiver valido na cache.
+   Leitores compartilham o lock do fragmento; politicas que mexem em listas no acesso
+   so promovem o slot se conseguirem o lock da politica sem esperar. Retorna 2 no
+   primeiro acesso a um bloco trazido pelo prefetch. */
+int cache_copiar_fatia(int id_bloco, char *resultado, int pos, int tam)
+{
+    Cache *c = cache_do_bloco(id_bloco);
+    if (c->capacidade == 0)
+        return 0;
+    int encontrado = 0;
+    pthread_rwlock_rdlock(&c->lock);
+    int slot = indice_buscar(&c->indice, id_bloco);
+    if (slot >= 0)
+    {
+        copiar_fatia(resultado, pos, tam, id_bloco, c->slots[slot].dados);
+        if (c->politica->acesso_concorrente)
+            c->politica->acessar(c, slot);
+        else if (pthread_mutex_trylock(&c->lock_politica) == 0)
+        {
+            c->politica->acessar(c, slot);
+            pthread_mutex_unlock(&c->lock_politica);
+        }
+        __atomic_fetch_add(&c->acertos, 1, __ATOMIC_RELAXED);
+        encontrado = 1;
+        if (c->slots[slot].antecipado && __atomic_exchange_n(&c->slots[slot].antecipado, 0, __ATOMIC_RELAXED))
+        {
+            __atomic_fetch_add(&prefetch_uteis, 1, __ATOMIC_RELAXED);
+            encontrado = 2;
+        }
+    }
+    else
+        __atomic_fetch_add(&c->faltas, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&c->lock);
+    return encontrado;
+}
+
+int cache_contem(int id_bloco)
+{
+    Cache *c = cache_do_bloco(id_bloco);
+    if (c->capacidade == 0)
+        return 0;
+    pthread_rwlock_rdlock(&c->lock);
+    int slot = indice_buscar(&c->indice, id_bloco);
+    pthread_rwlock_unlock(&c->lock);
+    return slot >= 0;
+}
+
+/* A epoca de um bloco muda a cada invalidacao dele (epocas_blocos) e a cada
+   invalidacao da cache inteira (epoca_invalidacoes); como as duas so crescem, a soma
+   muda se qualquer uma mudar. */
+uint32_t epoca_bloco(int id_bloco)
+{
+    return __atomic_load_n(&epocas_blocos[id_bloco], __ATOMIC_SEQ_CST) +
+           (uint32_t)__atomic_load_n(&epoca_invalidacoes, __ATOMIC_SEQ_CST);
+}
+
+void avancar_epoca(int id_bloco)
+{
+    __atomic_fetch_add(&epocas_blocos[id_bloco], 1, __ATOMIC_SEQ_CST);
+}
+
+/* epoca e a epoca do bloco lida antes de ele ser pedido ao dono. Se alguma
+   invalidacao dele chegou desde entao, a copia recebida pode ser anterior a uma
+   escrita e nao entra na cache. Um bloco antecipado nao substitui um que ja esta la. */
+void cache_inserir(int id_bloco, const char *dados_bloco, uint32_t versao, uint32_t epoca, int antecipado)
+{
+    Cache *c = cache_do_bloco(id_bloco);
+    if (c->capacidade == 0)
+        return;
+    pthread_rwlock_wrlock(&c->lock);
+    if (epoca_bloco(id_bloco) != epoca)
+    {
+        pthread_rwlock_unlock(&c->lock);
+        return;
+    }
+    int slot = indice_buscar(&c->indice, id_bloco);
+    /* Uma busca que comecou antes de um diff pode terminar depois dele: a copia ja
+       mais nova fica. */
+    if (slot >= 0 && (antecipado || (int32_t)(c->slots[slot].versao - versao) > 0))
+    {
+        pthread_rwlock_unlock(&c->lock);
+        return;
+    }
+    if (slot < 0)
+    {
+        slot = c->politica->alocar(c, id_bloco);
+        c->slots[slot].id = id_bloco;
+        c->slots[slot].valido = 1;
+        c->slots[slot].antecipado = antecipado;
+        indice_inserir(&c->indice, id_bloco, slot);
+        if (LOG_ATIVO(LOG_DEBUG))
+        {
+            long acertos, faltas, remocoes;
+            cache_totais(&acertos, &faltas, &remocoes);
+            registrar_log("[P%d] [CACHE] Bloco %d adicionado no slot %d (acertos=%ld faltas=%ld remocoes=%ld).\n",
+                          my_rank, id_bloco, slot, acertos, faltas, remocoes);
+        }
+    }
+    memcpy(c->slots[slot].dados, dados_bloco, T_BLOCO);
+    c->slots[slot].versao = versao;
+    pthread_rwlock_unlock(&c->lock);
+}
+
+/* O slot invalidado sai do indice e da politica e volta para a pilha de livres,
+   entao a proxima insercao o reaproveita antes de despejar um bloco valido. */
+void cache_descartar_slot(Cache *c, int slot)
+{
+    c->politica->liberar(c, slot);
+    indice_remover(&c->indice, c->slots[slot].id);
+    c->slots[slot].valido = 0;
+    c->slots[slot].antecipado = 0;
+    c->livres[c->num_livres++] = slot;
+}
+
+void cache_invalidar(int id_bloco)
+{
+    if (id_bloco < 0 || id_bloco >= K_BLOCOS)
+        return;
+    Cache *c = cache_do_bloco(id_bloco);
+    if (c->capacidade == 0)
+        return;
+    pthread_rwlock_wrlock(&c->lock);
+    avancar_epoca(id_bloco);
+    int slot = indice_buscar(&c->indice, id_bloco);
+    if (slot >= 0)
+    {
+        cache_descartar_slot(c, slot);
+        LOG(LOG_DEBUG, "[P%d] Cache para o bloco %d (slot %d) INVALIDADA.\n", my_rank, id_bloco, slot);
+    }
+    pthread_rwlock_unlock(&c->lock);
+}
+
+void cache_invalidar_tudo()
+{
+    for (int f = 0; f < num_fragmentos_cache; f++)
+    {
+        Cache *c = &caches[f];
+        if (c->capacidade == 0)
+            continue;
+        pthread_rwlock_wrlock(&c->lock);
+        __atomic_fetch_add(&epoca_invalidacoes, 1, __ATOMIC_SEQ_CST);
+        for (int slot = 0; slot < c->capacidade; slot++)
+            if (c->slots[slot].valido)
+                cache_descartar_slot(c, slot);
+        pthread_rwlock_unlock(&c->lock);
+    }
+    LOG(LOG_DEBUG, "[P%d] Cache inteira INVALIDADA.\n", my_rank);
+}
+
+/* Aplica na copia um diff empurrado pelo dono. Uma copia ja mais nova ignora o diff;
+   se faltar algum diff anterior (ou o bloco ainda estiver a caminho) a copia e
+   descartada como numa invalidacao. */
+void cache_aplicar_diff(int id_bloco, uint32_t versao, int offset, int tam, const char *dados)
+{
+    if (id_bloco < 0 || id_bloco >= K_BLOCOS)
+        return;
+    Cache *c = cache_do_bloco(id_bloco);
+    if (c->capacidade == 0)
+        return;
+    pthread_rwlock_wrlock(&c->lock);
+    int slot = indice_buscar(&c->indice, id_bloco);
+    if (slot >= 0 && c->slots[slot].versao == versao - 2)
+    {
+        memcpy(c->slots[slot].dados + offset, dados, tam);
+        c->slots[slot].versao = versao;
+        __atomic_fetch_add(&diffs_aplicados, 1, __ATOMIC_RELAXED);
+        LOG(LOG_DEBUG, "[P%d] [CACHE] Diff de %d bytes aplicado no bloco %d (versao %u).\n", my_rank, tam, id_bloco, versao);
+    }
+    else if (slot < 0 || (int32_t)(c->slots[slot].versao - versao) < 0)
+    {
+        avancar_epoca(id_bloco);
+        if (slot >= 0)
+            cache_descartar_slot(c, slot);
+        __atomic_fetch_add(&diffs_descartados, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&c->lock);
+}
+
+/* Cada bloco local guarda o conjunto de ranks que o buscaram (copyset), em bits.
+   O bit e ligado antes de copiar o bloco para o pedido, entao uma atualizacao
+   posterior a copia sempre enxerga o compartilhador. */
+void registrar_compartilhador(uint64_t *copyset, int rank)
+{
+    if (rank < 0)
+        return;
+    __atomic_fetch_or(&copyset[rank / 64], (uint64_t)1 << (rank % 64), __ATOMIC_SEQ_CST);
+}
+
+uint64_t *copyset_local(int id_bloco)
+{
+    return &copysets[(size_t)(id_bloco - blocos_inicio) * palavras_copyset];
+}
+
+/* Blocos que migraram para este rank ficam numa tabela propria, com seu copyset.
+   Leitores e escritores seguram lock_hospedados para leitura; so a entrada e a
+   saida de um bloco o seguram para escrita. */
+void iniciar_hospedados()
+{
+    blocos_hospedados = calloc(limite_migracao, sizeof(BlocoMemoria));
+    copysets_hospedados = calloc((size_t)limite_migracao * palavras_copyset, sizeof(uint64_t));
+    hospedados_livres = malloc(sizeof(int) * limite_migracao);
+    char *arena = alocar_arena((size_t)limite_migracao * stride_bloco, 0);
+    for (int i = 0; i < limite_migracao; i++)
+    {
+        blocos_hospedados[i].id = -1;
+        blocos_hospedados[i].dados = arena + (size_t)i * stride_bloco;
+        hospedados_livres[i] = limite_migracao - 1 - i;
+    }
+    num_hospedados_livres = limite_migracao;
+    indice_iniciar(&indice_hospedados, limite_migracao);
+}
+
+/* Com lock_hospedados travado. */
+BlocoMemoria *buscar_hospedado(int id_bloco, uint64_t **copyset)
+{
+    int slot = indice_buscar(&indice_hospedados, id_bloco);
+    if (slot < 0)
+        return NULL;
+    *copyset = &copysets_hospedados[(size_t)slot * palavras_copyset];
+    return &blocos_hospedados[slot];
+}
+
+/* Com --replicas R, a particao de cada rank tambem fica nos R ranks seguintes. O dono
+   manda cada escrita as replicas com ATUALIZAR_REPLICA e a replica a aplica se tiver
+   a versao anterior; se faltar alguma, a copia fica invalida ate ser buscada de novo
+   no dono. Retorna a copia deste rank para o bloco, se ele for replica da particao. */
+CopiaReplica *copia_replica(int id_bloco, Replica **replica)
+{
+    int dono = calcular_dono(id_bloco);
+    if (num_replicas == 0 || dono < 0)
+        return NULL;
+    int distancia = (my_rank - dono + N_PROCESSOS) % N_PROCESSOS;
+    if (distancia < 1 || distancia > num_replicas)
+        return NULL;
+    *replica = &replicas[distancia - 1];
+    return &(*replica)->copias[id_bloco - (*replica)->inicio];
+}
+
+/* Uma copia vinda de replica so serve a este rank se tiver ao menos a versao de cada
+   escrita que ele confirmou no dono e a da ultima leitura feita no dono. Depois de um
+   ADQUIRIR ou BARREIRA, os blocos avisados sao lidos uma vez do dono. */
+int replica_suficiente(int id_bloco, uint32_t versao)
+{
+    return !__atomic_load_n(&ler_do_dono[id_bloco], __ATOMIC_SEQ_CST) &&
+           (int32_t)(versao - __atomic_load_n(&versoes_minimas[id_bloco], __ATOMIC_SEQ_CST)) >= 0;
+}
+
+void exigir_versao(int id_bloco, uint32_t versao)
+{
+    uint32_t atual = __atomic_load_n(&versoes_minimas[id_bloco], __ATOMIC_RELAXED);
+    while ((int32_t)(versao - atual) > 0 &&
+           !__atomic_compare_exchange_n(&versoes_minimas[id_bloco], &atual, versao, 1, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+/* A epoca muda para que uma resposta do dono pedida antes do aviso nao libere o
+   bloco para as replicas (ver buscar_blocos). */
+void exigir_dono(int id_bloco)
+{
+    __atomic_store_n(&ler_do_dono[id_bloco], 1, __ATOMIC_SEQ_CST);
+    avancar_epoca(id_bloco);
+}
+
+/* Le a copia deste rank se ela e valida e suficiente. O compartilhador entra no
+   copyset da replica, que o invalida quando a proxima escrita do dono chegar. */
+int ler_replica(int id_bloco, int offset, int tam, char *destino, int compartilhador, uint32_t *versao)
+{
+    Replica *replica;
+    CopiaReplica *copia = copia_replica(id_bloco, &replica);
+    if (!copia || !__atomic_load_n(&copia->valida, __ATOMIC_SEQ_CST))
+        return -1;
+    registrar_compartilhador(&replica->copysets[(size_t)(id_bloco - replica->inicio) * palavras_copyset],
+                             compartilhador);
+    while (1)
+    {
+        uint32_t inicio = __atomic_load_n(&copia->seq, __ATOMIC_ACQUIRE);
+        if (inicio & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        int valida = __atomic_load_n(&copia->valida, __ATOMIC_RELAXED);
+        *versao = __atomic_load_n(&copia->versao, __ATOMIC_RELAXED);
+        memcpy(destino, copia->dados + offset, tam);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&copia->seq, __ATOMIC_RELAXED) != inicio)
+            continue;
+        if (!valida || !replica_suficiente(id_bloco, *versao))
+            return -1;
+        __atomic_fetch_add(&leituras_replica, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+}
+
+int copia_utilizavel(int id_bloco)
+{
+    Replica *replica;
+    CopiaReplica *copia = copia_replica(id_bloco, &replica);
+    return copia && __atomic_load_n(&copia->valida, __ATOMIC_SEQ_CST) &&
+           replica_suficiente(id_bloco, __atomic_load_n(&copia->versao, __ATOMIC_SEQ_CST));
+}
+
+int bloco_residente(int id_bloco)
+{
+    BlocoMemoria *bloco = bloco_local(id_bloco);
+    if (bloco && __atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST) == calcular_dono(id_bloco))
+        return 1;
+    if (copia_utilizavel(id_bloco))
+        return 1;
+    if (__atomic_load_n(&num_hospedados, __ATOMIC_SEQ_CST) == 0)
+        return 0;
+    pthread_rwlock_rdlock(&lock_hospedados);
+    int encontrado = indice_buscar(&indice_hospedados, id_bloco) >= 0;
+    pthread_rwlock_unlock(&lock_hospedados);
+    return encontrado;
+}
+
+/* Le o bloco se ele esta neste processo: hospedado aqui, na memoria do rank de
+   origem se nao migrou ou numa replica da particao. O compartilhador (se >= 0) entra no copyset antes da
+   copia e local e relido depois dela, entao uma migracao concorrente ou invalida a
+   copia ou faz a leitura falhar. Retorna -1 se o bloco nao esta aqui, com *local
+   indicando onde procura-lo. */
+int ler_bloco_residente(int id_bloco, int offset, int tam, char *destino, int compartilhador, uint32_t *versao,
+                        int *local)
+{
+    if (__atomic_load_n(&num_hospedados, __ATOMIC_SEQ_CST) > 0)
+    {
+        uint64_t *copyset;
+        pthread_rwlock_rdlock(&lock_hospedados);
+        BlocoMemoria *bloco = buscar_hospedado(id_bloco, &copyset);
+        if (bloco)
+        {
+            registrar_compartilhador(copyset, compartilhador);
+            *versao = bloco_ler(bloco, offset, tam, destino);
+            pthread_rwlock_unlock(&lock_hospedados);
+            *local = my_rank;
+            return 0;
+        }
+        pthread_rwlock_unlock(&lock_hospedados);
+    }
+    int casa = calcular_dono(id_bloco);
+    BlocoMemoria *bloco = bloco_local(id_bloco);
+    if (!bloco)
+    {
+        if (ler_replica(id_bloco, offset, tam, destino, compartilhador, versao) == 0)
+        {
+            *local = my_rank;
+            return 0;
+        }
+        *local = casa < 0 ? -1 : local_provavel(id_bloco);
+        return -1;
+    }
+    *local = __atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST);
+    if (*local != casa)
+        return -1;
+    registrar_compartilhador(copyset_local(id_bloco), compartilhador);
+    *versao = bloco_ler(bloco, offset, tam, destino);
+    *local = __atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST);
+    return *local == casa ? 0 : -1;
+}
+
+void lote_iniciar(LoteInvalidacao *lote, int capacidade)
+{
+    lote->quantidade = 0;
+    lote->atomico = 0;
+    lote->ids = (int *)buffer_thread(BUFFER_IDS, sizeof(int) * capacidade);
+    lote->copysets = (uint64_t *)buffer_thread(BUFFER_COPYSETS, sizeof(uint64_t) * capacidade * palavras_copyset);
+    lote->diffs = (DiffBloco *)buffer_thread(BUFFER_DIFFS, sizeof(DiffBloco) * capacidade);
+}
+
+/* Escritas de ate limite_diff bytes, e todas as escritas em blocos de uma regiao de
+   atualizacao, vao para as copias como diff e mantem o copyset, ja que as copias
+   continuam validas; as demais esvaziam o copyset e invalidam as copias. Os dados do
+   diff precisam continuar validos ate lote_enviar. Com consistencia de liberacao so
+   as regioes de atualizacao e as operacoes atomicas enviam algo: as outras copias so
+   sao invalidadas por quem adquire uma trava ou passa por uma barreira. */
+void lote_registrar(LoteInvalidacao *lote, int id_bloco, uint64_t *copyset, uint32_t versao, int offset, int tam,
+                    const char *dados)
+{
+    int atualizar = blocos_atualizacao && blocos_atualizacao[id_bloco];
+    if (consistencia_liberacao && !atualizar && !lote->atomico)
+        return;
+    uint64_t *destino = &lote->copysets[(size_t)lote->quantidade * palavras_copyset];
+    DiffBloco *diff = &lote->diffs[lote->quantidade];
+    diff->dados = NULL;
+    if (atualizar || tam <= limite_diff)
+    {
+        for (int w = 0; w < palavras_copyset; w++)
+            destino[w] = __atomic_load_n(&copyset[w], __ATOMIC_SEQ_CST);
+        diff->versao = versao;
+        diff->offset = offset;
+        diff->tam = tam;
+        diff->dados = dados;
+    }
+    else
+    {
+        for (int w = 0; w < palavras_copyset; w++)
+            destino[w] = __atomic_exchange_n(&copyset[w], 0, __ATOMIC_SEQ_CST);
+    }
+    lote->ids[lote->quantidade++] = id_bloco;
+}
+
+/* Envia pela conexao de invalidacao do par e guarda o ticket da confirmacao. */
+int invalidacao_enviar(int rank, const char *msg, int len, ConfirmacaoPendente *pendentes, int *n)
+{
+    ConfirmacaoPendente *pendente = &pendentes[*n];
+    if (conexao_par_enviar(&conexoes_invalidacao[rank], msg, len, &pendente->ticket, &pendente->geracao) < 0)
+        return -1;
+    pendente->rank = rank;
+    (*n)++;
+    return 0;
+}
+
+/* Espera o SUCESSO de cada par. Um par que nao responde dentro do limite da
+   conexao e dado como caido e a escrita segue sem ele. */
+void aguardar_confirmacoes(const ConfirmacaoPendente *pendentes, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t status_net;
+        if (conexao_par_receber(&conexoes_invalidacao[pendentes[i].rank], pendentes[i].ticket, pendentes[i].geracao,
+                                (char *)&status_net, sizeof(status_net)) < 0)
+            LOG(LOG_AVISO, "[P%d] [REDE] O P%d nao confirmou a invalidacao.\n", my_rank, pendentes[i].rank);
+    }
+}
+
+void invalidar_compartilhadores(int id_bloco, const uint64_t *copyset)
+{
+    uint32_t msg[3] = {htonl(CMD_INVALIDAR_BLOCOS), htonl(1), htonl(id_bloco)};
+    ConfirmacaoPendente *pendentes =
+        (ConfirmacaoPendente *)buffer_thread(BUFFER_CONFIRMACOES, sizeof(ConfirmacaoPendente) * N_PROCESSOS);
+    int n = 0;
+    for (int p = 0; p < N_PROCESSOS; p++)
+        if (p != my_rank && (copyset[p / 64] & ((uint64_t)1 << (p % 64))))
+            invalidacao_enviar(p, (char *)msg, sizeof(msg), pendentes, &n);
+    aguardar_confirmacoes(pendentes, n);
+}
+
+/* Conta as escritas seguidas de um mesmo rank remoto; depois de
+   ESCRITAS_PARA_MIGRAR o bloco deve ir para ele. Escritas deste processo zeram a
+   contagem, que e aproximada: escritores concorrentes podem perder incrementos. */
+int contar_escritor(BlocoMemoria *bloco, int origem)
+{
+    if (limite_migracao <= 0)
+        return -1;
+    if (origem < 0 || origem == my_rank)
+    {
+        __atomic_store_n(&bloco->escritas_seguidas, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (__atomic_exchange_n(&bloco->ultimo_escritor, origem, __ATOMIC_RELAXED) != origem)
+    {
+        __atomic_store_n(&bloco->escritas_seguidas, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (__atomic_add_fetch(&bloco->escritas_seguidas, 1, __ATOMIC_RELAXED) < ESCRITAS_PARA_MIGRAR)
+        return -1;
+    __atomic_store_n(&bloco->escritas_seguidas, 0, __ATOMIC_RELAXED);
+    return origem;
+}
+
+/* Envia o bloco para destino com MIGRAR_BLOCO [id, versao, proximo, dados] e
+   invalida as copias em cache. No rank de origem, local passa a ser destino sob a
+   listra, entao as escritas seguintes sao recusadas com a dica do novo local. Um
+   bloco hospedado volta antes ao rank de origem, com proximo = destino, para que so
+   a origem altere o diretorio. Se o envio falhar, o bloco fica onde estava. */
+void migrar_bloco(int id_bloco, int destino)
+{
+    int casa = calcular_dono(id_bloco);
+    int tam_msg = 4 * sizeof(uint32_t) + T_BLOCO;
+    int inicio_copyset = (tam_msg + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+    char *msg = buffer_thread(BUFFER_MIGRACAO, inicio_copyset + palavras_copyset * sizeof(uint64_t));
+    uint64_t *compartilhadores = (uint64_t *)(msg + inicio_copyset);
+    uint64_t *copyset;
+    uint32_t versao;
+    int slot = -1;
+    if (casa == my_rank)
+    {
+        BlocoMemoria *bloco = bloco_local(id_bloco);
+        pthread_mutex_t *listra = &listras_escrita[id_bloco % NUM_LISTRAS_ESCRITA];
+        pthread_mutex_lock(listra);
+        if (destino == my_rank || __atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST) != my_rank)
+        {
+            pthread_mutex_unlock(listra);
+            return;
+        }
+        __atomic_store_n(&bloco->local, destino, __ATOMIC_SEQ_CST);
+        memcpy(msg + 4 * sizeof(uint32_t), bloco->dados, T_BLOCO);
+        versao = bloco->seq;
+        copyset = copyset_local(id_bloco);
+        for (int w = 0; w < palavras_copyset; w++)
+            compartilhadores[w] = __atomic_exchange_n(&copyset[w], 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(listra);
+    }
+    else
+    {
+        pthread_rwlock_wrlock(&lock_hospedados);
+        BlocoMemoria *bloco = buscar_hospedado(id_bloco, &copyset);
+        if (!bloco)
+        {
+            pthread_rwlock_unlock(&lock_hospedados);
+            return;
+        }
+        slot = bloco - blocos_hospedados;
+        memcpy(msg + 4 * sizeof(uint32_t), bloco->dados, T_BLOCO);
+        versao = bloco->seq;
+        memcpy(compartilhadores, copyset, palavras_copyset * sizeof(uint64_t));
+        memset(copyset, 0, palavras_copyset * sizeof(uint64_t));
+        indice_remover(&indice_hospedados, id_bloco);
+        __atomic_fetch_sub(&num_hospedados, 1, __ATOMIC_SEQ_CST);
+        pthread_rwlock_unlock(&lock_hospedados);
+    }
+    uint32_t cabecalho[4] = {htonl(CMD_MIGRAR_BLOCO), htonl(id_bloco), htonl(versao), htonl(destino)};
+    memcpy(msg, cabecalho, sizeof(cabecalho));
+    invalidar_compartilhadores(id_bloco, compartilhadores);
+    int para = slot < 0 ? destino : casa;
+    if (par_enviar(para, msg, tam_msg, NULL, NULL) < 0)
+    {
+        LOG(LOG_AVISO, "[P%d] Migracao do bloco %d para o P%d falhou; o bloco fica aqui.\n", my_rank, id_bloco, para);
+        if (slot < 0)
+        {
+            pthread_mutex_t *listra = &listras_escrita[id_bloco % NUM_LISTRAS_ESCRITA];
+            pthread_mutex_lock(listra);
+            __atomic_store_n(&bloco_local(id_bloco)->local, my_rank, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(listra);
+        }
+        else
+        {
+            pthread_rwlock_wrlock(&lock_hospedados);
+            indice_inserir(&indice_hospedados, id_bloco, slot);
+            __atomic_fetch_add(&num_hospedados, 1, __ATOMIC_SEQ_CST);
+            pthread_rwlock_unlock(&lock_hospedados);
+        }
+        return;
+    }
+    if (slot >= 0)
+    {
+        pthread_rwlock_wrlock(&lock_hospedados);
+        hospedados_livres[num_hospedados_livres++] = slot;
+        pthread_rwlock_unlock(&lock_hospedados);
+        __atomic_fetch_add(&migracoes_devolvidas, 1, __ATOMIC_RELAXED);
+        LOG(LOG_DEBUG, "[P%d] Bloco %d devolvido ao P%d (proximo: P%d).\n", my_rank, id_bloco, casa, destino);
+    }
+    else
+    {
+        __atomic_fetch_add(&migracoes_enviadas, 1, __ATOMIC_RELAXED);
+        LOG(LOG_DEBUG, "[P%d] Bloco %d migrado para o P%d.\n", my_rank, id_bloco, destino);
+    }
+}
+
+/* O rank de origem reinstala o bloco que voltou e o repassa se proximo for outro
+   rank; os demais o hospedam ou, com a tabela cheia, o devolvem. */
+void receber_migracao(int id_bloco, uint32_t versao, int proximo, const char *dados)
+{
+    __atomic_fetch_add(&migracoes_recebidas, 1, __ATOMIC_RELAXED);
+    cache_invalidar(id_bloco);
+    int casa = calcular_dono(id_bloco);
+    if (casa == my_rank)
+    {
+        BlocoMemoria *bloco = bloco_local(id_bloco);
+        pthread_mutex_t *listra = &listras_escrita[id_bloco % NUM_LISTRAS_ESCRITA];
+        pthread_mutex_lock(listra);
+        __atomic_store_n(&bloco->seq, bloco->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(bloco->dados, dados, T_BLOCO);
+        __atomic_store_n(&bloco->seq, versao, __ATOMIC_RELEASE);
+        __atomic_store_n(&bloco->ultimo_escritor, -1, __ATOMIC_RELAXED);
+        __atomic_store_n(&bloco->escritas_seguidas, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&bloco->local, my_rank, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(listra);
+        LOG(LOG_DEBUG, "[P%d] Bloco %d voltou para casa (versao %u).\n", my_rank, id_bloco, versao);
+        if (proximo != my_rank)
+            migrar_bloco(id_bloco, proximo);
+        return;
+    }
+    int slot = -1;
+    pthread_rwlock_wrlock(&lock_hospedados);
+    if (num_hospedados_livres > 0)
+    {
+        slot = hospedados_livres[--num_hospedados_livres];
+        BlocoMemoria *bloco = &blocos_hospedados[slot];
+        bloco->id = id_bloco;
+        memcpy(bloco->dados, dados, T_BLOCO);
+        bloco->seq = versao;
+        bloco->local = my_rank;
+        bloco->ultimo_escritor = -1;
+        bloco->escritas_seguidas = 0;
+        memset(&copysets_hospedados[(size_t)slot * palavras_copyset], 0, palavras_copyset * sizeof(uint64_t));
+        indice_inserir(&indice_hospedados, id_bloco, slot);
+        __atomic_fetch_add(&num_hospedados, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_rwlock_unlock(&lock_hospedados);
+    if (slot >= 0)
+    {
+        LOG(LOG_DEBUG, "[P%d] Hospedando o bloco %d (versao %u).\n", my_rank, id_bloco, versao);
+        return;
+    }
+    LOG(LOG_DEBUG, "[P%d] Sem espaco para hospedar o bloco %d; devolvendo ao P%d.\n", my_rank, id_bloco, casa);
+    char *msg = buffer_thread(BUFFER_MIGRACAO, 4 * sizeof(uint32_t) + T_BLOCO);
+    uint32_t cabecalho[4] = {htonl(CMD_MIGRAR_BLOCO), htonl(id_bloco), htonl(versao), htonl(casa)};
+    memcpy(msg, cabecalho, sizeof(cabecalho));
+    memcpy(msg + sizeof(cabecalho), dados, T_BLOCO);
+    if (par_enviar(casa, msg, sizeof(cabecalho) + T_BLOCO, NULL, NULL) < 0)
+        LOG(LOG_ERRO, "[P%d] Nao foi possivel devolver o bloco %d ao P%d.\n", my_rank, id_bloco, casa);
+}
+
+/* Envia a escrita que deixou o bloco na versao versao as replicas, com
+   ATUALIZAR_REPLICA [encarnacao, id, versao, offset, tam, dados]. Quem escreveu a
+   versao v espera, dormindo na listra, o envio da v - 2, entao as replicas recebem
+   as escritas de cada bloco em ordem sem que a listra fique travada durante o envio. */
+void replicar_escrita(BlocoMemoria *bloco, uint32_t versao, int offset, int tam, const char *dados)
+{
+    pthread_mutex_t *listra = &listras_escrita[bloco->id % NUM_LISTRAS_ESCRITA];
+    pthread_cond_t *cond = &conds_replicado[bloco->id % NUM_LISTRAS_ESCRITA];
+    pthread_mutex_lock(listra);
+    while (bloco->replicado != versao - 2)
+        pthread_cond_wait(cond, listra);
+    pthread_mutex_unlock(listra);
+    int tam_msg = 6 * sizeof(uint32_t) + tam;
+    char *msg = buffer_thread(BUFFER_REPLICACAO, tam_msg);
+    uint32_t cabecalho[6] = {htonl(CMD_ATUALIZAR_REPLICA), htonl(encarnacao), htonl(bloco->id), htonl(versao),
+                             htonl(offset), htonl(tam)};
+    memcpy(msg, cabecalho, sizeof(cabecalho));
+    memcpy(msg + sizeof(cabecalho), dados, tam);
+    for (int r = 1; r <= num_replicas; r++)
+        if (par_enviar((my_rank + r) % N_PROCESSOS, msg, tam_msg, NULL, NULL) == 0)
+            __atomic_fetch_add(&replicacoes_enviadas, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(listra);
+    bloco->replicado = versao;
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(listra);
+}
+
+/* Com replica->lock. A copia deixa de ser lida e entra na fila de ressincronizacao. */
+void replica_invalidar(Replica *replica, int i)
+{
+    CopiaReplica *copia = &replica->copias[i];
+    if (copia->valida)
+    {
+        __atomic_store_n(&copia->seq, copia->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&copia->valida, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&copia->seq, copia->seq + 1, __ATOMIC_RELEASE);
+    }
+    if (!copia->pendente)
+    {
+        copia->pendente = 1;
+        pthread_mutex_lock(&lock_replicacao);
+        replicas_pendentes++;
+        pthread_cond_signal(&cond_replicacao);
+        pthread_mutex_unlock(&lock_replicacao);
+    }
+}
+
+/* Com replica->lock. Um dono reiniciado recomeca as versoes do zero, entao nenhuma
+   copia da execucao anterior pode mais ser comparada com as escritas dele. */
+void replica_conferir_encarnacao(Replica *replica, uint32_t encarnacao_dono)
+{
+    if (replica->encarnacao == encarnacao_dono)
+        return;
+    if (replica->encarnacao != 0)
+    {
+        LOG(LOG_AVISO, "[P%d] [REPLICA] O P%d reiniciou; a particao sera copiada de novo.\n", my_rank, replica->rank);
+        for (int i = 0; i <= replica->fim - replica->inicio; i++)
+        {
+            replica->copias[i].vista = 0;
+            replica_invalidar(replica, i);
+        }
+    }
+    replica->encarnacao = encarnacao_dono;
+}
+
+/* Aplica uma escrita recebida do dono. Uma copia ja nessa versao ignora a escrita;
+   uma que perdeu alguma anterior (ou que ainda nao foi copiada) fica invalida e
+   guarda a versao anunciada. Em todo caso os ranks que leram o bloco desta replica
+   sao invalidados, como o dono faz com os que leram dele. */
+void replica_aplicar(int origem, uint32_t encarnacao_dono, int id_bloco, uint32_t versao, int offset, int tam,
+                     const char *dados)
+{
+    Replica *replica;
+    CopiaReplica *copia = copia_replica(id_bloco, &replica);
+    if (!copia || replica->rank != origem)
+        return;
+    int i = id_bloco - replica->inicio;
+    pthread_mutex_lock(&replica->lock);
+    replica_conferir_encarnacao(replica, encarnacao_dono);
+    if (copia->valida && copia->versao == versao - 2)
+    {
+        __atomic_store_n(&copia->seq, copia->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(copia->dados + offset, dados, tam);
+        __atomic_store_n(&copia->versao, versao, __ATOMIC_RELAXED);
+        __atomic_store_n(&copia->seq, copia->seq + 1, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&replicacoes_aplicadas, 1, __ATOMIC_RELAXED);
+    }
+    else if (!copia->valida || (int32_t)(versao - copia->versao) > 0)
+    {
+        if (copia->valida)
+        {
+            LOG(LOG_DEBUG, "[P%d] [REPLICA] Bloco %d perdeu escritas (versao %u, recebida %u).\n", my_rank, id_bloco,
+                copia->versao, versao);
+            __atomic_fetch_add(&replicacoes_perdidas, 1, __ATOMIC_RELAXED);
+        }
+        if ((int32_t)(versao - copia->vista) > 0)
+            copia->vista = versao;
+        replica_invalidar(replica, i);
+    }
+    pthread_mutex_unlock(&replica->lock);
+
+    uint64_t *copyset = &replica->copysets[(size_t)i * palavras_copyset];
+    uint64_t *compartilhadores = (uint64_t *)buffer_thread(BUFFER_COPYSETS, sizeof(uint64_t) * palavras_copyset);
+    int algum = 0;
+    for (int w = 0; w < palavras_copyset; w++)
+    {
+        compartilhadores[w] = __atomic_exchange_n(&copyset[w], 0, __ATOMIC_SEQ_CST);
+        algum |= compartilhadores[w] != 0;
+    }
+    if (algum)
+        invalidar_compartilhadores(id_bloco, compartilhadores);
+}
+
+/* Aplica a escrita se o bloco esta neste processo e coloca no lote o aviso para as
+   copias. origem e o rank que pediu a escrita; no rank que tem o bloco, escritas
+   seguidas de um mesmo rank remoto fazem o bloco migrar para ele, e com replicas a
+   escrita segue para elas. Com atomica, a palavra em offset recebe o resultado da
+   operacao (tam e dados sao ignorados) e, se ela nao mudar, nada e avisado. Retorna
+   -1 se o bloco nao esta aqui, com *local indicando onde procura-lo; senao *versao
+   recebe a versao do bloco depois da escrita. */
+int aplicar_atualizacao(int id_bloco, int offset, int tam, const char *dados, OperacaoAtomica *atomica, int origem,
+                        LoteInvalidacao *lote, int *local, uint32_t *versao)
+{
+    int destino_migracao = -1;
+    BlocoMemoria *bloco = NULL;
+    if (atomica)
+    {
+        tam = atomica->largura;
+        dados = atomica->novo;
+    }
+    if (__atomic_load_n(&num_hospedados, __ATOMIC_SEQ_CST) > 0)
+    {
+        uint64_t *copyset;
+        pthread_rwlock_rdlock(&lock_hospedados);
+        bloco = buscar_hospedado(id_bloco, &copyset);
+        if (bloco)
+        {
+            if (atomica)
+                bloco_atomico(bloco, offset, atomica, my_rank, versao);
+            else
+                bloco_escrever(bloco, offset, tam, dados, my_rank, versao);
+            if (!atomica || atomica->alterou)
+            {
+                lote_registrar(lote, id_bloco, copyset, *versao, offset, tam, dados);
+                destino_migracao = contar_escritor(bloco, origem);
+            }
+            *local = my_rank;
+        }
+        pthread_rwlock_unlock(&lock_hospedados);
+    }
+    if (!bloco)
+    {
+        int casa = calcular_dono(id_bloco);
+        bloco = bloco_local(id_bloco);
+        if (!bloco)
+        {
+            *local = casa < 0 ? -1 : local_provavel(id_bloco);
+            return -1;
+        }
+        if ((atomica ? bloco_atomico(bloco, offset, atomica, casa, versao)
+                     : bloco_escrever(bloco, offset, tam, dados, casa, versao)) < 0)
+        {
+            *local = __atomic_load_n(&bloco->local, __ATOMIC_SEQ_CST);
+            return -1;
+        }
+        *local = casa;
+        if (atomica && !atomica->alterou)
+            return 0;
+        if (num_replicas > 0)
+            replicar_escrita(bloco, *versao, offset, tam, dados);
+        lote_registrar(lote, id_bloco, copyset_local(id_bloco), *versao, offset, tam, dados);
+        if (casa == my_rank)
+            destino_migracao = contar_escritor(bloco, origem);
+    }
+    LOG(LOG_DEBUG, "[P%d] Bloco LOCAL %d atualizado.\n", my_rank, id_bloco);
+    if (destino_migracao >= 0)
+    {
+        migrar_bloco(id_bloco, destino_migracao);
+        *local = destino_migracao;
+    }
+    return 0;
+}
+
+/* Envia uma unica mensagem INVALIDAR_BLOCOS e uma ATUALIZAR_COPIAS (id, versao,
+   offset, tam e dados de cada diff) para cada rank que compartilha algum dos blocos
+   do lote e so retorna com as confirmacoes, entao a escrita so e respondida depois
+   que nenhuma copia antiga pode mais ser lida. */
+void lote_enviar(LoteInvalidacao *lote)
+{
+    if (lote->quantidade == 0)
+        return;
+    uint32_t *msg = (uint32_t *)buffer_thread(BUFFER_INVALIDACOES, sizeof(uint32_t) * (2 + lote->quantidade));
+    int tam_diffs = 0;
+    for (int i = 0; i < lote->quantidade; i++)
+        if (lote->diffs[i].dados)
+            tam_diffs += 4 * sizeof(uint32_t) + lote->diffs[i].tam;
+    char *msg_diffs = tam_diffs > 0 ? buffer_thread(BUFFER_MENSAGEM_DIFFS, 3 * sizeof(uint32_t) + tam_diffs) : NULL;
+    ConfirmacaoPendente *pendentes =
+        (ConfirmacaoPendente *)buffer_thread(BUFFER_CONFIRMACOES, sizeof(ConfirmacaoPendente) * 2 * N_PROCESSOS);
+    int num_pendentes = 0;
+    for (int p = 0; p < N_PROCESSOS; p++)
+    {
+        if (p == my_rank)
+            continue;
+        int n = 0, n_diffs = 0, usado = 3 * sizeof(uint32_t);
+        for (int i = 0; i < lote->quantidade; i++)
+        {
+            if (!(lote->copysets[(size_t)i * palavras_copyset + p / 64] & ((uint64_t)1 << (p % 64))))
+                continue;
+            DiffBloco *diff = &lote->diffs[i];
+            if (!diff->dados)
+            {
+                msg[2 + n++] = htonl(lote->ids[i]);
+                continue;
+            }
+            uint32_t cabecalho[4] = {htonl(lote->ids[i]), htonl(diff->versao), htonl(diff->offset), htonl(diff->tam)};
+            memcpy(msg_diffs + usado, cabecalho, sizeof(cabecalho));
+            memcpy(msg_diffs + usado + sizeof(cabecalho), diff->dados, diff->tam);
+            usado += sizeof(cabecalho) + diff->tam;
+            n_diffs++;
+        }
+        if (n > 0)
+        {
+            msg[0] = htonl(CMD_INVALIDAR_BLOCOS);
+            msg[1] = htonl(n);
+            LOG(LOG_DEBUG, "[P%d] [REDE] Invalidando %d bloco(s) na cache do P%d.\n", my_rank, n, p);
+            invalidacao_enviar(p, (char *)msg, sizeof(uint32_t) * (2 + n), pendentes, &num_pendentes);
+        }
+        if (n_diffs > 0)
+        {
+            uint32_t cabecalho[3] = {htonl(CMD_ATUALIZAR_COPIAS), htonl(n_diffs), htonl(usado - 3 * sizeof(uint32_t))};
+            memcpy(msg_diffs, cabecalho, sizeof(cabecalho));
+            LOG(LOG_DEBUG, "[P%d] [REDE] Enviando %d diff(s) para a cache do P%d.\n", my_rank, n_diffs, p);
+            if (invalidacao_enviar(p, msg_diffs, usado, pendentes, &num_pendentes) == 0)
+            {
+                __atomic_fetch_add(&diffs_enviados, n_diffs, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&bytes_diffs, usado, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    aguardar_confirmacoes(pendentes, num_pendentes);
+}
+
+/* Resposta de OBTER_BLOCOS_INTERNO: a versao de cada bloco, o rank que tem cada
+   bloco (o proprio rank pedido quando ele o enviou) e os blocos. */
+int tamanho_resposta_blocos(int quantidade)
+{
+    return quantidade * (int)(2 * sizeof(uint32_t) + T_BLOCO);
+}
+
+/* Busca no dono as copias pendentes da particao, em sequencias de ate
+   MAX_BLOCOS_RESSINCRONIZACAO blocos, com OBTER_REPLICAS: a resposta de
+   OBTER_BLOCOS_INTERNO precedida da encarnacao do dono. Uma copia so e instalada se
+   for ao menos tao nova quanto a ultima escrita anunciada enquanto estava pendente;
+   senao continua na fila. Retorna -1 se o dono nao respondeu. */
+int ressincronizar_replica(Replica *replica)
+{
+    int num_copias = replica->fim - replica->inicio + 1;
+    int primeiro = 0, falhou = 0;
+    while (primeiro < num_copias)
+    {
+        pthread_mutex_lock(&replica->lock);
+        while (primeiro < num_copias && !replica->copias[primeiro].pendente)
+            primeiro++;
+        int ultimo = primeiro;
+        while (ultimo + 1 < num_copias && ultimo + 1 - primeiro < MAX_BLOCOS_RESSINCRONIZACAO &&
+               replica->copias[ultimo + 1].pendente)
+            ultimo++;
+        for (int i = primeiro; i <= ultimo && i < num_copias; i++)
+            replica->copias[i].pendente = 0;
+        pthread_mutex_unlock(&replica->lock);
+        if (primeiro >= num_copias)
+            break;
+
+        int quantidade = ultimo - primeiro + 1;
+        int tam_resposta = sizeof(uint32_t) + tamanho_resposta_blocos(quantidade);
+        char *resposta = buffer_thread(BUFFER_BLOCO, tam_resposta);
+        uint32_t msg[3] = {htonl(CMD_OBTER_REPLICAS), htonl(replica->inicio + primeiro), htonl(quantidade)};
+        int recebido = par_requisitar(replica->rank, (char *)msg, sizeof(msg), resposta, tam_resposta) == 0;
+        pthread_mutex_lock(&replica->lock);
+        if (recebido)
+        {
+            uint32_t encarnacao_net;
+            memcpy(&encarnacao_net, resposta, sizeof(uint32_t));
+            replica_conferir_encarnacao(replica, ntohl(encarnacao_net));
+        }
+        uint32_t *versoes = (uint32_t *)(resposta + sizeof(uint32_t));
+        uint32_t *locais = versoes + quantidade;
+        char *blocos = resposta + sizeof(uint32_t) + 2 * quantidade * sizeof(uint32_t);
+        for (int b = 0; b < quantidade; b++)
+        {
+            CopiaReplica *copia = &replica->copias[primeiro + b];
+            if (copia->valida)
+                continue;
+            uint32_t versao = recebido ? ntohl(versoes[b]) : 0;
+            if (!recebido || (int)ntohl(locais[b]) != replica->rank || (int32_t)(versao - copia->vista) < 0)
+            {
+                falhou |= !recebido || (int)ntohl(locais[b]) != replica->rank;
+                replica_invalidar(replica, primeiro + b);
+                continue;
+            }
+            __atomic_store_n(&copia->seq, copia->seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            memcpy(copia->dados, blocos + (size_t)b * T_BLOCO, T_BLOCO);
+            __atomic_store_n(&copia->versao, versao, __ATOMIC_RELAXED);
+            __atomic_store_n(&copia->valida, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&copia->seq, copia->seq + 1, __ATOMIC_RELEASE);
+            copia->pendente = 0;
+            __atomic_fetch_add(&copias_ressincronizadas, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&replica->lock);
+        primeiro = ultimo + 1;
+    }
+    return falhou ? -1 : 0;
+}
+
+/* Uma escrita vazia na versao 0 leva a encarnacao deste rank as replicas da sua
+   particao: se ele reiniciou, elas descartam as copias da execucao anterior. */
+void anunciar_encarnacao()
+{
+    if (num_blocos_locais <= 0)
+        return;
+    uint32_t msg[6] = {htonl(CMD_ATUALIZAR_REPLICA), htonl(encarnacao), htonl(blocos_inicio), 0, 0, 0};
+    for (int r = 1; r <= num_replicas; r++)
+        par_enviar((my_rank + r) % N_PROCESSOS, (char *)msg, sizeof(msg), NULL, NULL);
+}
+
+/* Mantem as replicas deste rank em dia. Depois de uma falha espera um segundo antes
+   de procurar o dono de novo. */
+void *executar_replicacao(void *arg)
+{
+    anunciar_encarnacao();
+    while (1)
+    {
+        pthread_mutex_lock(&lock_replicacao);
+        while (replicas_pendentes == 0)
+            pthread_cond_wait(&cond_replicacao, &lock_replicacao);
+        replicas_pendentes = 0;
+        pthread_mutex_unlock(&lock_replicacao);
+        int falhou = 0;
+        for (int r = 0; r < num_replicas; r++)
+            falhou |= ressincronizar_replica(&replicas[r]) < 0;
+        if (falhou)
+            sleep(1);
+    }
+    return NULL;
+}
+
+/* Rank a quem pedir um bloco de outro rank. Na primeira rodada, entre o dono e as
+   replicas da particao, o que tem menos pedidos esperando resposta nesta conexao,
+   pulando quem falhou ha menos de TEMPO_SUSPEITA_US; o empate comeca numa posicao que
+   depende deste rank, para que ranks diferentes espalhem as leituras de uma faixa
+   quente. Nas rodadas seguintes a ordem e fixa, dono e depois cada replica, o que
+   contorna uma replica atrasada ou um rank que caiu. */
+int escolher_fonte(int id_bloco, int dono, int tentativa)
+{
+    if (num_replicas == 0 || dono != calcular_dono(id_bloco) || __atomic_load_n(&ler_do_dono[id_bloco], __ATOMIC_SEQ_CST))
+        return dono;
+    int candidatos = num_replicas + 1;
+    if (tentativa > 0)
+    {
+        int fonte = (dono + (tentativa - 1) % candidatos) % N_PROCESSOS;
+        return fonte == my_rank ? dono : fonte;
+    }
+    unsigned long agora = agora_us();
+    int melhor = dono;
+    long menor = -1;
+    for (int i = 0; i < candidatos; i++)
+    {
+        int fonte = (dono + (my_rank + i) % candidatos) % N_PROCESSOS;
+        ConexaoPar *c = &conexoes_pares[fonte];
+        unsigned long falha = __atomic_load_n(&c->falha_us, __ATOMIC_RELAXED);
+        if (fonte == my_rank || (falha && agora - falha < TEMPO_SUSPEITA_US))
+            continue;
+        long atendidos = __atomic_load_n(&c->tickets_atendidos, __ATOMIC_RELAXED);
+        long esperando = (long)__atomic_load_n(&c->tickets_emitidos, __ATOMIC_RELAXED) - atendidos;
+        if (esperando < 0)
+            esperando = 0;
+        if (menor < 0 || esperando < menor)
+        {
+            melhor = fonte;
+            menor = esperando;
+        }
+    }
+    return melhor;
+}
+
+/* Pede os blocos de id_primeiro a id_ultimo marcados em pendentes, com um pedido por
+   sequencia de blocos do mesmo dono; todos os pedidos sao enviados antes de qualquer
+   resposta ser lida, entao os donos atendem em paralelo. Quem nao tem mais um bloco
+   responde com o rank que deve te-lo, que vira a dica de dono, e o bloco e pedido
+   de novo na proxima rodada. Os blocos recebidos vao para a cache e, se resultado
+   nao for NULL, para o resultado. Com antecipado, falhas sao ignoradas. A epoca de
+   cada bloco e lida antes do envio do pedido, entao so uma invalidacao do proprio
+   bloco impede que a resposta entre na cache. */
+int buscar_blocos(int id_primeiro, int id_ultimo, char *pendentes, int faltantes, int antecipado, char *resultado,
+                  int pos, int tam)
+{
+    PedidoDono *pedidos = (PedidoDono *)buffer_thread(BUFFER_PEDIDOS, sizeof(PedidoDono) * (id_ultimo - id_primeiro + 1));
+    uint32_t *epocas = (uint32_t *)buffer_thread(BUFFER_EPOCAS, sizeof(uint32_t) * (id_ultimo - id_primeiro + 1));
+    for (int tentativa = 0; faltantes > 0; tentativa++)
+    {
+        if (tentativa == MAX_REDIRECIONAMENTOS)
+            return ERRO_FALHA_OBTER_BLOCO;
+        if (tentativa > 0)
+            usleep(20 << tentativa);
+        int num_pedidos = 0, maior_pedido = 0;
+        for (int id_bloco = id_primeiro; id_bloco <= id_ultimo; id_bloco++)
+        {
+            char *pendente = &pendentes[id_bloco - id_primeiro];
+            if (!*pendente)
+                continue;
+            int dono = localizar_dono(id_bloco);
+            if (dono < 0)
+                return ERRO_FALHA_OBTER_BLOCO;
+            if (dono == my_rank)
+            {
+                /* A dica aponta para este rank: o bloco chegou (ou esta chegando) aqui. */
+                int offset_bloco, tam_fatia, local;
+                uint32_t versao;
+                int destino = resultado ? calcular_fatia(pos, tam, id_bloco, &offset_bloco, &tam_fatia) : 0;
+                if (!resultado ||
+                    ler_bloco_residente(id_bloco, offset_bloco, tam_fatia, resultado + destino, -1, &versao, &local) == 0)
+                {
+                    *pendente = 0;
+                    faltantes--;
+                }
+                else
+                    definir_dica(id_bloco, local);
+                continue;
+            }
+            dono = escolher_fonte(id_bloco, dono, tentativa);
+            epocas[id_bloco - id_primeiro] = epoca_bloco(id_bloco);
+            PedidoDono *anterior = num_pedidos > 0 ? &pedidos[num_pedidos - 1] : NULL;
+            if (anterior && anterior->dono == dono)
+            {
+                anterior->ultimo = id_bloco;
+                continue;
+            }
+            pedidos[num_pedidos].dono = dono;
+            pedidos[num_pedidos].primeiro = id_bloco;
+            pedidos[num_pedidos].ultimo = id_bloco;
+            num_pedidos++;
+        }
+        for (int i = 0; i < num_pedidos; i++)
+        {
+            PedidoDono *pedido = &pedidos[i];
+            int quantidade = pedido->ultimo - pedido->primeiro + 1;
+            if (quantidade > maior_pedido)
+                maior_pedido = quantidade;
+            LOG(LOG_DEBUG, "[P%d] [%s] Pedindo ao P%d os blocos %d a %d...\n", my_rank, antecipado ? "PREFETCH" : "REDE",
+                pedido->dono, pedido->primeiro, pedido->ultimo);
+            uint32_t msg[3] = {htonl(CMD_OBTER_BLOCOS_INTERNO), htonl(pedido->primeiro), htonl(quantidade)};
+            pedido->enviado = par_enviar(pedido->dono, (char *)msg, sizeof(msg), &pedido->ticket, &pedido->geracao) == 0;
+        }
+        if (num_pedidos == 0)
+            continue;
+
+        char *resposta = buffer_thread(BUFFER_BLOCO, tamanho_resposta_blocos(maior_pedido));
+        for (int i = 0; i < num_pedidos; i++)
+        {
+            PedidoDono *pedido = &pedidos[i];
+            int quantidade = pedido->ultimo - pedido->primeiro + 1;
+            int tam_resposta = tamanho_resposta_blocos(quantidade);
+            int recebido = pedido->enviado &&
+                           par_receber(pedido->dono, pedido->ticket, pedido->geracao, resposta, tam_resposta) == 0;
+            if (!recebido && antecipado)
+                continue;
+            if (!recebido)
+            {
+                uint32_t msg[3] = {htonl(CMD_OBTER_BLOCOS_INTERNO), htonl(pedido->primeiro), htonl(quantidade)};
+                if (par_requisitar(pedido->dono, (char *)msg, sizeof(msg), resposta, tam_resposta) < 0)
+                {
+                    /* Com replicas, os blocos sao pedidos a outra fonte na proxima rodada. */
+                    if (num_replicas > 0)
+                        continue;
+                    return ERRO_FALHA_OBTER_BLOCO;
+                }
+            }
+            uint32_t *versoes = (uint32_t *)resposta;
+            uint32_t *locais = versoes + quantidade;
+            char *blocos = resposta + 2 * quantidade * sizeof(uint32_t);
+            int recebidos = 0;
+            for (int b = 0; b < quantidade; b++)
+            {
+                int id_bloco = pedido->primeiro + b;
+                if (!pendentes[id_bloco - id_primeiro])
+                    continue;
+                int local = ntohl(locais[b]);
+                if (local != pedido->dono)
+                {
+                    definir_dica(id_bloco, local);
+                    __atomic_fetch_add(&redirecionamentos, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                if (num_replicas > 0)
+                {
+                    /* A versao lida do dono passa a ser exigida das replicas; se nenhum
+                       aviso chegou desde o pedido, o bloco volta a poder ser lido delas. */
+                    if (pedido->dono == calcular_dono(id_bloco))
+                    {
+                        exigir_versao(id_bloco, ntohl(versoes[b]));
+                        if (epoca_bloco(id_bloco) == epocas[id_bloco - id_primeiro])
+                            __atomic_store_n(&ler_do_dono[id_bloco], 0, __ATOMIC_SEQ_CST);
+                    }
+                    else if (!replica_suficiente(id_bloco, ntohl(versoes[b])))
+                        continue;
+                }
+                char *dados_bloco = blocos + (size_t)b * T_BLOCO;
+                cache_inserir(id_bloco, dados_bloco, ntohl(versoes[b]), epocas[id_bloco - id_primeiro], antecipado);
+                if (resultado)
+                    copiar_fatia(resultado, pos, tam, id_bloco, dados_bloco);
+                pendentes[id_bloco - id_primeiro] = 0;
+                faltantes--;
+                recebidos++;
+            }
+            if (antecipado)
+                __atomic_fetch_add(&prefetch_blocos, recebidos, __ATOMIC_RELAXED);
+        }
+        if (antecipado)
+            break;
+    }
+    return SUCESSO;
+}
+
+/* Preenche o resultado com os blocos que estao neste processo e com os da cache e
+   busca os que faltam nos donos. acertos_prefetch recebe quantos blocos vieram de um
+   prefetch ainda nao usado. */
+int ler_intervalo(int pos, int tam, char *resultado, int *acertos_prefetch)
+{
+    *acertos_prefetch = 0;
+    int id_primeiro = pos / T_BLOCO;
+    int id_ultimo = (pos + tam - 1) / T_BLOCO;
+    char *pendentes = buffer_thread(BUFFER_IDS, id_ultimo - id_primeiro + 1);
+    int faltantes = 0;
+    for (int id_bloco = id_primeiro; id_bloco <= id_ultimo; id_bloco++)
+    {
+        int offset_bloco, tam_fatia, local;
+        uint32_t versao;
+        int destino = calcular_fatia(pos, tam, id_bloco, &offset_bloco, &tam_fatia);
+        pendentes[id_bloco - id_primeiro] = 0;
+        if (ler_bloco_residente(id_bloco, offset_bloco, tam_fatia, resultado + destino, -1, &versao, &local) == 0)
+            continue;
+        if (local < 0)
+            return ERRO_FALHA_OBTER_BLOCO;
+        definir_dica(id_bloco, local);
+        int encontrado = cache_copiar_fatia(id_bloco, resultado, pos, tam);
+        if (encontrado)
+        {
+            *acertos_prefetch += encontrado == 2;
+            continue;
+        }
+        pendentes[id_bloco - id_primeiro] = 1;
+        faltantes++;
+    }
+    if (faltantes == 0)
+        return SUCESSO;
+    return buscar_blocos(id_primeiro, id_ultimo, pendentes, faltantes, 0, resultado, pos, tam);
+}
+
+/* Traz para a cache os blocos remotos de primeiro a ultimo que ainda nao estao la.
+   Falhas e redirecionamentos sao ignorados: o bloco sera buscado quando for lido. */
+void buscar_antecipado(int primeiro, int ultimo)
+{
+    char *pendentes = buffer_thread(BUFFER_IDS, ultimo - primeiro + 1);
+    int faltantes = 0;
+    for (int id_bloco = primeiro; id_bloco <= ultimo; id_bloco++)
+    {
+        char *pendente = &pendentes[id_bloco - primeiro];
+        *pendente = !bloco_residente(id_bloco) && !cache_contem(id_bloco);
+        faltantes += *pendente;
+    }
+    if (faltantes > 0)
+        buscar_blocos(primeiro, ultimo, pendentes, faltantes, 1, NULL, 0, 0);
+}
+
+int prefetch_enfileirar(int primeiro, int ultimo)
+{
+    pthread_mutex_lock(&lock_prefetch);
+    if (fila_prefetch_tamanho == FILA_PREFETCH)
+    {
+        pthread_mutex_unlock(&lock_prefetch);
+        return -1;
+    }
+    PedidoPrefetch *pedido = &fila_prefetch[(fila_prefetch_inicio + fila_prefetch_tamanho) % FILA_PREFETCH];
+    pedido->primeiro = primeiro;
+    pedido->ultimo = ultimo;
+    fila_prefetch_tamanho++;
+    pthread_cond_signal(&cond_prefetch);
+    pthread_mutex_unlock(&lock_prefetch);
+    __atomic_fetch_add(&prefetch_pedidos, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void *executar_prefetch(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&lock_prefetch);
+        while (fila_prefetch_tamanho == 0)
+            pthread_cond_wait(&cond_prefetch, &lock_prefetch);
+        PedidoPrefetch pedido = fila_prefetch[fila_prefetch_inicio];
+        fila_prefetch_inicio = (fila_prefetch_inicio + 1) % FILA_PREFETCH;
+        fila_prefetch_tamanho--;
+        pthread_mutex_unlock(&lock_prefetch);
+        buscar_antecipado(pedido.primeiro, pedido.ultimo);
+    }
+    return NULL;
+}
+
+/* Chamada depois de cada leitura da conexao. Uma leitura que comeca no bloco em que
+   a anterior terminou (ou no seguinte) continua a varredura; depois de
+   LEITURAS_PARA_PREFETCH leituras assim, os proximos blocos sao pedidos em segundo
+   plano, e de novo sempre que sobrar menos de meia janela ja buscada a frente. A
+   janela cresce com os blocos antecipados que foram lidos e cai pela metade quando
+   algum bloco antecipado sai da cache sem ter sido usado. */
+void prefetch_apos_leitura(FluxoLeitura *fluxo, int pos, int tam, int acertos_prefetch)
+{
+    if (janela_prefetch_maxima <= 0)
+        return;
+    int primeiro = pos / T_BLOCO;
+    int ultimo = (pos + tam - 1) / T_BLOCO;
+    if (primeiro == fluxo->proximo_bloco || primeiro == fluxo->proximo_bloco - 1)
+        fluxo->sequenciais++;
+    else
+    {
+        fluxo->sequenciais = 0;
+        fluxo->janela = JANELA_PREFETCH_INICIAL;
+        fluxo->buscado_ate = ultimo;
+    }
+    fluxo->proximo_bloco = ultimo + 1;
+
+    unsigned long desperdicados = __atomic_load_n(&prefetch_desperdicados, __ATOMIC_RELAXED);
+    if (desperdicados != fluxo->desperdicados_vistos)
+    {
+        fluxo->desperdicados_vistos = desperdicados;
+        fluxo->janela = fluxo->janela > 1 ? fluxo->janela / 2 : 1;
+    }
+    else if (acertos_prefetch > 0)
+        fluxo->janela += acertos_prefetch;
+    if (fluxo->janela > janela_prefetch_maxima)
+        fluxo->janela = janela_prefetch_maxima;
+
+    if (fluxo->sequenciais < LEITURAS_PARA_PREFETCH)
+        return;
+    if (fluxo->buscado_ate < ultimo)
+        fluxo->buscado_ate = ultimo;
+    if (fluxo->buscado_ate - ultimo > fluxo->janela / 2)
+        return;
+    int fim = ultimo + fluxo->janela < K_BLOCOS ? ultimo + fluxo->janela : K_BLOCOS - 1;
+    if (fim > fluxo->buscado_ate && prefetch_enfileirar(fluxo->buscado_ate + 1, fim) == 0)
+        fluxo->buscado_ate = fim;
+}
+
+void iniciar_prefetch()
+{
+    for (int i = 0; i < THREADS_PREFETCH; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, executar_prefetch, NULL) != 0)
+            die("nao foi possivel criar a thread de prefetch");
+        pthread_detach(thread);
+    }
+}
+
+/* Aplica os trechos que caem em blocos deste processo e agrupa os demais em uma
+   mensagem ATUALIZAR_BLOCOS por dono, com um trecho (id, offset, tam, dados) por
+   bloco. A resposta traz, para cada trecho, se ele foi aplicado e onde o bloco esta;
+   os trechos recusados por blocos que migraram sao reenviados ao novo dono. As
+   copias da propria cache sao invalidadas apos as confirmacoes para que uma leitura
+   seguinte por este rank ja veja a escrita. */
+int salvar_intervalo(int pos, int tam, const char *dados)
+{
+    int num_trechos = (pos + tam - 1) / T_BLOCO - pos / T_BLOCO + 1;
+    TrechoEscrita *trechos = (TrechoEscrita *)buffer_thread(BUFFER_TRECHOS, sizeof(TrechoEscrita) * num_trechos);
+    for (int t = 0, i = 0; t < num_trechos; t++)
+    {
+        TrechoEscrita *trecho = &trechos[t];
+        mapear_posicao_global(pos + i, &trecho->id_bloco, &trecho->offset);
+        trecho->tam = T_BLOCO - trecho->offset < tam - i ? T_BLOCO - trecho->offset : tam - i;
+        trecho->origem = i;
+        trecho->aplicado = 0;
+        trecho->remoto = 0;
+        i += trecho->tam;
+    }
+
+    PedidoDono *pedidos = (PedidoDono *)buffer_thread(BUFFER_PEDIDOS, sizeof(PedidoDono) * N_PROCESSOS);
+    int pendentes = num_trechos, falhou = 0;
+    for (int tentativa = 0; pendentes > 0 && !falhou; tentativa++)
+    {
+        if (tentativa == MAX_REDIRECIONAMENTOS)
+        {
+            falhou = 1;
+            break;
+        }
+        if (tentativa > 0)
+            usleep(20 << tentativa);
+        for (int p = 0; p < N_PROCESSOS; p++)
         {
-            printf("[P%d] [ERRO] Pedido de leitura fora dos limites da memória. Enviando código %d.\n", my_rank, ERRO_MEMORIA_INEXISTENTE);
-            uint32_t codigo_erro_net = htonl(ERRO_MEMORIA_INEXISTENTE);
-            send(sock, &codigo_erro_net, sizeof(uint32_t), 0);
+            pedidos[p].trechos = 0;
+            pedidos[p].tamanho_msg = 3 * sizeof(uint32_t);
+            pedidos[p].enviado = 0;
         }
-        else
+        LoteInvalidacao lote;
+        lote_iniciar(&lote, pendentes);
+        for (int t = 0; t < num_trechos; t++)
+        {
+            TrechoEscrita *trecho = &trechos[t];
+            if (trecho->aplicado)
+                continue;
+            int local;
+            uint32_t versao;
+            if (aplicar_atualizacao(trecho->id_bloco, trecho->offset, trecho->tam, dados + trecho->origem, NULL,
+                                    my_rank, &lote, &local, &versao) == 0)
+            {
+                trecho->aplicado = 1;
+                pendentes--;
+                continue;
+            }
+            if (local < 0)
+            {
+                falhou = 1;
+                break;
+            }
+            /* Um bloco a caminho deste rank e tentado de novo na proxima rodada. */
+            trecho->dono = local == my_rank ? -1 : local;
+            if (trecho->dono < 0)
+                continue;
+            pedidos[local].trechos++;
+            pedidos[local].tamanho_msg += 3 * sizeof(uint32_t) + trecho->tam;
+        }
+        lote_enviar(&lote);
+        if (falhou)
+            break;
+
+        int total_msgs = 0, maior_pedido = 0;
+        for (int p = 0; p < N_PROCESSOS; p++)
+        {
+            pedidos[p].deslocamento = total_msgs;
+            total_msgs += pedidos[p].trechos > 0 ? pedidos[p].tamanho_msg : 0;
+            if (pedidos[p].trechos > maior_pedido)
+                maior_pedido = pedidos[p].trechos;
+        }
+        if (maior_pedido == 0)
+            continue;
+        char *msgs = buffer_thread(BUFFER_MENSAGEM, total_msgs);
+        for (int p = 0; p < N_PROCESSOS; p++)
         {
-            char *resultado = malloc(tam);
-            int bytes_coletados = 0;
-            int falha_geral = 0;
-            for (int p_atual = pos; p_atual < pos + tam;)
+            if (pedidos[p].trechos == 0)
+                continue;
+            uint32_t cabecalho[3] = {htonl(CMD_ATUALIZAR_BLOCOS), htonl(pedidos[p].trechos),
+                                     htonl(pedidos[p].tamanho_msg - (int)sizeof(cabecalho))};
+            memcpy(msgs + pedidos[p].deslocamento, cabecalho, sizeof(cabecalho));
+            pedidos[p].deslocamento += sizeof(cabecalho);
+        }
+        for (int t = 0; t < num_trechos; t++)
+        {
+            TrechoEscrita *trecho = &trechos[t];
+            if (trecho->aplicado || trecho->dono < 0)
+                continue;
+            char *destino = msgs + pedidos[trecho->dono].deslocamento;
+            uint32_t cabecalho[3] = {htonl(trecho->id_bloco), htonl(trecho->offset), htonl(trecho->tam)};
+            memcpy(destino, cabecalho, sizeof(cabecalho));
+            memcpy(destino + sizeof(cabecalho), dados + trecho->origem, trecho->tam);
+            pedidos[trecho->dono].deslocamento += sizeof(cabecalho) + trecho->tam;
+        }
+
+        char *inicio_msg = msgs;
+        for (int p = 0; p < N_PROCESSOS; p++)
+        {
+            if (pedidos[p].trechos == 0)
+                continue;
+            LOG(LOG_DEBUG, "[P%d] [REDE] Enviando %d trecho(s) de escrita ao P%d...\n", my_rank, pedidos[p].trechos, p);
+            pedidos[p].enviado = par_enviar(p, inicio_msg, pedidos[p].tamanho_msg, &pedidos[p].ticket, &pedidos[p].geracao) == 0;
+            inicio_msg += pedidos[p].tamanho_msg;
+        }
+
+        uint32_t *resposta = (uint32_t *)buffer_thread(BUFFER_BLOCO, sizeof(uint32_t) * (1 + 3 * maior_pedido));
+        inicio_msg = msgs;
+        for (int p = 0; p < N_PROCESSOS; p++)
+        {
+            if (pedidos[p].trechos == 0)
+                continue;
+            int tam_resposta = sizeof(uint32_t) * (1 + 3 * pedidos[p].trechos);
+            int confirmado = pedidos[p].enviado &&
+                             par_receber(p, pedidos[p].ticket, pedidos[p].geracao, (char *)resposta, tam_resposta) == 0;
+            if (!confirmado)
+                confirmado = par_requisitar(p, inicio_msg, pedidos[p].tamanho_msg, (char *)resposta, tam_resposta) == 0;
+            inicio_msg += pedidos[p].tamanho_msg;
+            if (!confirmado || (int)ntohl(resposta[0]) != SUCESSO)
             {
-                int id_bloco, offset;
-                mapear_posicao_global(p_atual, &id_bloco, &offset);
-                int dono = calcular_dono(id_bloco);
-                char *fonte_dados = malloc(T_BLOCO);
-                int sucesso_leitura = 0;
-                if (dono == my_rank)
+                falhou = 1;
+                continue;
+            }
+            int k = 0;
+            for (int t = 0; t < num_trechos; t++)
+            {
+                TrechoEscrita *trecho = &trechos[t];
+                if (trecho->aplicado || trecho->dono != p)
+                    continue;
+                definir_dica(trecho->id_bloco, ntohl(resposta[2 + 3 * k]));
+                if (ntohl(resposta[1 + 3 * k]))
                 {
-                    for (int i = 0; i < num_blocos_locais; i++)
-                    {
-                        if (blocos_locais[i].id == id_bloco)
-                        {
-                            memcpy(fonte_dados, blocos_locais[i].dados, T_BLOCO);
-                            sucesso_leitura = 1;
-                            break;
-                        }
-                    }
+                    /* Uma replica atrasada nao serve mais este bloco a este rank. */
+                    if (num_replicas > 0)
+                        exigir_versao(trecho->id_bloco, ntohl(resposta[3 + 3 * k]));
+                    trecho->aplicado = 1;
+                    trecho->remoto = 1;
+                    pendentes--;
                 }
                 else
-                {
-                    pthread_mutex_lock(&cache_mutex);
-                    for (int i = 0; i < tamanho_cache; i++)
-                    {
-                        if (cache[i].id == id_bloco && cache[i].valido)
-                        {
-                            memcpy(fonte_dados, cache[i].dados, T_BLOCO);
-                            sucesso_leitura = 1;
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&cache_mutex);
-                    if (!sucesso_leitura)
-                    {
-                        if (obter_bloco_remoto(id_bloco, fonte_dados) == 0)
-                            sucesso_leitura = 1;
-                    }
-                }
-                if (sucesso_leitura)
-                {
-                    int bytes_a_ler = T_BLOCO - offset;
-                    if (bytes_a_ler > (tam - bytes_coletados))
-                        bytes_a_ler = tam - bytes_coletados;
-                    memcpy(resultado + bytes_coletados, fonte_dados + offset, bytes_a_ler);
-                    bytes_coletados += bytes_a_ler;
-                    p_atual += bytes_a_ler;
-                }
+                    __atomic_fetch_add(&redirecionamentos, 1, __ATOMIC_RELAXED);
+                k++;
+            }
+        }
+    }
+    for (int t = 0; t < num_trechos; t++)
+    {
+        if (trechos[t].remoto)
+            cache_invalidar(trechos[t].id_bloco);
+    }
+    return falhou ? ERRO_FALHA_ATUALIZAR_BLOCO : SUCESSO;
+}
+
+int operacao_atomica_valida(const OperacaoAtomica *operacao)
+{
+    return operacao->operacao >= ATOMICO_COMPARAR_TROCAR && operacao->operacao <= ATOMICO_TROCAR &&
+           (operacao->largura == 4 || operacao->largura == 8);
+}
+
+/* Executa a operacao atomica no rank que tem o bloco da palavra em pos, seguindo
+   os redirecionamentos de blocos migrados como salvar_intervalo. Um pedido
+   ATOMICO_INTERNO que nao teve resposta nao e repetido, ja que pode ter sido
+   executado: a operacao falha com ERRO_FALHA_ATUALIZAR_BLOCO. */
+int executar_atomico(int pos, OperacaoAtomica *operacao)
+{
+    int id_bloco, offset;
+    mapear_posicao_global(pos, &id_bloco, &offset);
+    for (int tentativa = 0; tentativa < MAX_REDIRECIONAMENTOS; tentativa++)
+    {
+        if (tentativa > 0)
+            usleep(20 << tentativa);
+        LoteInvalidacao lote;
+        int local;
+        uint32_t versao;
+        lote_iniciar(&lote, 1);
+        lote.atomico = 1;
+        int aplicado = aplicar_atualizacao(id_bloco, offset, 0, NULL, operacao, my_rank, &lote, &local, &versao) == 0;
+        lote_enviar(&lote);
+        if (aplicado)
+            return SUCESSO;
+        if (local < 0)
+            return ERRO_FALHA_ATUALIZAR_BLOCO;
+        /* Um bloco a caminho deste rank e tentado de novo na proxima rodada. */
+        if (local == my_rank)
+            continue;
+
+        uint32_t msg[9] = {htonl(CMD_ATOMICO_INTERNO),
+                           htonl(id_bloco),
+                           htonl(offset),
+                           htonl(operacao->operacao),
+                           htonl(operacao->largura),
+                           htonl((uint32_t)(operacao->operando >> 32)),
+                           htonl((uint32_t)operacao->operando),
+                           htonl((uint32_t)(operacao->esperado >> 32)),
+                           htonl((uint32_t)operacao->esperado)};
+        /* [status, aplicado, rank que tem o bloco, versao, alterou, anterior (2 campos)] */
+        uint32_t resposta[7];
+        LOG(LOG_DEBUG, "[P%d] [REDE] Enviando operacao atomica no bloco %d ao P%d...\n", my_rank, id_bloco, local);
+        if (par_requisitar_uma_vez(local, (char *)msg, sizeof(msg), (char *)resposta, sizeof(resposta)) < 0 ||
+            (int)ntohl(resposta[0]) != SUCESSO)
+            return ERRO_FALHA_ATUALIZAR_BLOCO;
+        definir_dica(id_bloco, ntohl(resposta[2]));
+        if (!ntohl(resposta[1]))
+        {
+            __atomic_fetch_add(&redirecionamentos, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        operacao->alterou = ntohl(resposta[4]);
+        operacao->anterior = ((uint64_t)ntohl(resposta[5]) << 32) | ntohl(resposta[6]);
+        if (operacao->alterou)
+        {
+            if (num_replicas > 0)
+                exigir_versao(id_bloco, ntohl(resposta[3]));
+            cache_invalidar(id_bloco);
+        }
+        return SUCESSO;
+    }
+    return ERRO_FALHA_ATUALIZAR_BLOCO;
+}
+
+void avisos_adicionar(AvisosEscrita *avisos, int id_bloco)
+{
+    if (avisos->tudo || (avisos->quantidade > 0 && avisos->ids[avisos->quantidade - 1] == id_bloco))
+        return;
+    if (avisos->quantidade == MAX_AVISOS)
+    {
+        avisos->tudo = 1;
+        avisos->quantidade = 0;
+        return;
+    }
+    avisos->ids[avisos->quantidade++] = id_bloco;
+}
+
+void avisos_juntar(AvisosEscrita *destino, const AvisosEscrita *origem)
+{
+    if (origem->tudo)
+    {
+        destino->tudo = 1;
+        destino->quantidade = 0;
+    }
+    for (int i = 0; i < origem->quantidade; i++)
+        avisos_adicionar(destino, origem->ids[i]);
+}
+
+void avisos_aplicar(const AvisosEscrita *avisos)
+{
+    __atomic_fetch_add(&avisos_recebidos, avisos->tudo ? 1 : avisos->quantidade, __ATOMIC_RELAXED);
+    if (avisos->tudo)
+    {
+        if (num_replicas > 0)
+            for (int id_bloco = 0; id_bloco < K_BLOCOS; id_bloco++)
+                exigir_dono(id_bloco);
+        cache_invalidar_tudo();
+        return;
+    }
+    for (int i = 0; i < avisos->quantidade; i++)
+    {
+        if (num_replicas > 0 && avisos->ids[i] >= 0 && avisos->ids[i] < K_BLOCOS)
+            exigir_dono(avisos->ids[i]);
+        cache_invalidar(avisos->ids[i]);
+    }
+}
+
+/* Travas e barreiras ficam no gerente ate o fim da execucao. Com lock_sincronizacao
+   travado. */
+Trava *buscar_trava(int id)
+{
+    int slot = indice_buscar(&indice_travas, id);
+    if (slot >= 0)
+        return travas[slot];
+    if (num_travas == MAX_TRAVAS)
+        return NULL;
+    Trava *trava = calloc(1, sizeof(Trava));
+    trava->id = id;
+    trava->vistos = calloc(N_PROCESSOS, sizeof(unsigned long));
+    travas[num_travas] = trava;
+    indice_inserir(&indice_travas, id, num_travas++);
+    return trava;
+}
+
+Barreira *buscar_barreira(int id)
+{
+    int slot = indice_buscar(&indice_barreiras, id);
+    if (slot >= 0)
+        return barreiras[slot];
+    if (num_barreiras == MAX_BARREIRAS)
+        return NULL;
+    Barreira *barreira = calloc(1, sizeof(Barreira));
+    barreira->id = id;
+    barreiras[num_barreiras] = barreira;
+    indice_inserir(&indice_barreiras, id, num_barreiras++);
+    return barreira;
+}
+
+/* Executa no gerente do id uma operacao pedida pela conexao (rank, token). publicar
+   traz os blocos escritos pela conexao (em LIBERAR e CHEGAR); recebidos volta com os
+   que o rank deve invalidar antes de a conexao seguir (em ADQUIRIR e quando a
+   barreira termina). Em ADQUIRIR, ERRO_OCUPADO indica que a trava tem dono; em
+   CHEGAR e AGUARDAR, que a barreira ainda espera participantes, e *valor recebe a
+   geracao que a conclui. */
+int gerente_sincronizar(int operacao, int id, int rank, uint32_t token, int *valor, const AvisosEscrita *publicar,
+                        AvisosEscrita *recebidos)
+{
+    int status = SUCESSO;
+    recebidos->quantidade = 0;
+    recebidos->tudo = 0;
+    pthread_mutex_lock(&lock_sincronizacao);
+    if (operacao == SINC_ADQUIRIR || operacao == SINC_LIBERAR)
+    {
+        Trava *trava = buscar_trava(id);
+        if (!trava)
+            status = ERRO_SINCRONIZACAO;
+        else if (operacao == SINC_ADQUIRIR && trava->ocupada && trava->dono_rank == rank && trava->dono_token == token)
+        {
+            /* A conexao ja tem a trava: a resposta anterior se perdeu e o cliente
+               repetiu o pedido. Os avisos daquela concessao ja foram consumidos, entao
+               a cache inteira e descartada. */
+            recebidos->tudo = 1;
+        }
+        else if (operacao == SINC_ADQUIRIR && trava->ocupada)
+        {
+            status = ERRO_OCUPADO;
+            __atomic_fetch_add(&travas_ocupadas, 1, __ATOMIC_RELAXED);
+        }
+        else if (operacao == SINC_ADQUIRIR)
+        {
+            trava->ocupada = 1;
+            trava->dono_rank = rank;
+            trava->dono_token = token;
+            unsigned long pendentes = trava->num_avisos - trava->vistos[rank];
+            if (pendentes > MAX_AVISOS)
+                recebidos->tudo = 1;
+            else
+                for (unsigned long n = trava->vistos[rank]; n < trava->num_avisos; n++)
+                    avisos_adicionar(recebidos, trava->avisos[n % AVISOS_POR_TRAVA]);
+            trava->vistos[rank] = trava->num_avisos;
+            __atomic_fetch_add(&travas_concedidas, 1, __ATOMIC_RELAXED);
+        }
+        else if (!trava->ocupada || trava->dono_rank != rank || trava->dono_token != token)
+            status = ERRO_SINCRONIZACAO;
+        else
+        {
+            /* Um aviso de "tudo" ocupa o anel inteiro, entao todo rank que ainda nao
+               o viu recebe tudo no proximo ADQUIRIR. */
+            if (publicar->tudo)
+                trava->num_avisos += AVISOS_POR_TRAVA + 1;
+            for (int i = 0; i < publicar->quantidade; i++)
+                trava->avisos[trava->num_avisos++ % AVISOS_POR_TRAVA] = publicar->ids[i];
+            trava->ocupada = 0;
+        }
+    }
+    else
+    {
+        Barreira *barreira = buscar_barreira(id);
+        if (!barreira)
+            status = ERRO_SINCRONIZACAO;
+        else if (operacao == SINC_CHEGAR)
+        {
+            if (*valor <= 0 || (barreira->chegados > 0 && barreira->participantes != *valor))
+                status = ERRO_SINCRONIZACAO;
+            else
+            {
+                barreira->participantes = *valor;
+                avisos_juntar(&barreira->avisos, publicar);
+                *valor = barreira->geracao + 1;
+                if (++barreira->chegados < barreira->participantes)
+                    status = ERRO_OCUPADO;
                 else
                 {
-                    falha_geral = 1;
-                    free(fonte_dados);
-                    break;
+                    barreira->geracao++;
+                    barreira->chegados = 0;
+                    barreira->concluida = barreira->avisos;
+                    barreira->avisos.quantidade = 0;
+                    barreira->avisos.tudo = 0;
+                    *recebidos = barreira->concluida;
+                    __atomic_fetch_add(&barreiras_concluidas, 1, __ATOMIC_RELAXED);
                 }
-                free(fonte_dados);
             }
-            if (falha_geral)
+        }
+        else if (barreira->geracao < *valor)
+            status = ERRO_OCUPADO;
+        else if (barreira->geracao == *valor)
+            *recebidos = barreira->concluida;
+        else
+            recebidos->tudo = 1;
+    }
+    pthread_mutex_unlock(&lock_sincronizacao);
+    return status;
+}
+
+/* Leva a operacao ao gerente do id (o rank id % N_PROCESSOS) com SINCRONIZAR
+   [op, id, token, valor, tudo, n, ids]; a resposta tem tamanho fixo:
+   [status, valor, tudo, n, MAX_AVISOS ids]. O pedido nao e reenviado se a resposta
+   nao chegar, ja que uma chegada a barreira ou uma liberacao repetida mudaria o
+   estado do gerente; o cliente recebe ERRO_SINCRONIZACAO. */
+int sincronizar(int operacao, int id, Conexao *conexao, int *valor, const AvisosEscrita *publicar,
+                AvisosEscrita *recebidos)
+{
+    int gerente = (int)((uint32_t)id % N_PROCESSOS);
+    if (gerente == my_rank)
+        return gerente_sincronizar(operacao, id, my_rank, conexao->token, valor, publicar, recebidos);
+    int tam_msg = (8 + publicar->quantidade) * sizeof(uint32_t);
+    uint32_t *msg = (uint32_t *)buffer_thread(BUFFER_MENSAGEM, tam_msg);
+    msg[0] = htonl(CMD_SINCRONIZAR);
+    msg[1] = htonl(operacao);
+    msg[2] = htonl(id);
+    msg[3] = htonl(conexao->token);
+    msg[4] = htonl(*valor);
+    msg[5] = htonl(publicar->tudo);
+    msg[6] = htonl(publicar->quantidade);
+    for (int i = 0; i < publicar->quantidade; i++)
+        msg[7 + i] = htonl(publicar->ids[i]);
+    int tam_resposta = (4 + MAX_AVISOS) * sizeof(uint32_t);
+    uint32_t *resposta = (uint32_t *)buffer_thread(BUFFER_BLOCO, tam_resposta);
+    if (par_requisitar_uma_vez(gerente, (char *)msg, (7 + publicar->quantidade) * sizeof(uint32_t),
+                               (char *)resposta, tam_resposta) < 0)
+        return ERRO_SINCRONIZACAO;
+    *valor = ntohl(resposta[1]);
+    recebidos->tudo = ntohl(resposta[2]);
+    recebidos->quantidade = ntohl(resposta[3]);
+    if (recebidos->quantidade < 0 || recebidos->quantidade > MAX_AVISOS)
+        return ERRO_SINCRONIZACAO;
+    for (int i = 0; i < recebidos->quantidade; i++)
+        recebidos->ids[i] = ntohl(resposta[4 + i]);
+    return (int)ntohl(resposta[0]);
+}
+
+/* Os avisos da conexao vao em toda liberacao e chegada a barreira e so sao
+   esquecidos quando ela nao segura mais nenhuma trava, ja que cada trava ainda
+   segura precisa publica-los ao ser liberada. */
+void esquecer_avisos(Conexao *conexao)
+{
+    if (conexao->num_travas > 0)
+        return;
+    conexao->avisos.quantidade = 0;
+    conexao->avisos.tudo = 0;
+}
+
+int liberar_trava(Conexao *conexao, int id)
+{
+    int i = 0;
+    while (i < conexao->num_travas && conexao->travas[i] != id)
+        i++;
+    if (i == conexao->num_travas)
+        return ERRO_SINCRONIZACAO;
+    int valor = 0;
+    AvisosEscrita recebidos;
+    int status = sincronizar(SINC_LIBERAR, id, conexao, &valor, &conexao->avisos, &recebidos);
+    if (status != SUCESSO)
+        return status;
+    conexao->travas[i] = conexao->travas[--conexao->num_travas];
+    esquecer_avisos(conexao);
+    return SUCESSO;
+}
+
+int anexar_texto(char *texto, int capacidade, int usado, const char *formato, ...)
+{
+    if (usado >= capacidade)
+        return usado;
+    va_list args;
+    va_start(args, formato);
+    int n = vsnprintf(texto + usado, capacidade - usado, formato, args);
+    va_end(args);
+    if (n < 0)
+        return usado;
+    return usado + n < capacidade ? usado + n : capacidade - 1;
+}
+
+int tamanho_estatisticas()
+{
+    return 1024 + NUM_COMANDOS * (192 + FAIXAS_LATENCIA * 32) + N_PROCESSOS * 128;
+}
+
+int formatar_estatisticas(char *texto, int capacidade)
+{
+    int n = 0;
+    long acertos, faltas, remocoes;
+    cache_totais(&acertos, &faltas, &remocoes);
+    double taxa = acertos + faltas > 0 ? 100.0 * acertos / (acertos + faltas) : 0.0;
+    n = anexar_texto(texto, capacidade, n, "[P%d] Estatisticas\n", my_rank);
+    n = anexar_texto(texto, capacidade, n, "conexoes: abertas=%ld aceitas=%ld comandos_em_andamento=%ld\n",
+                     __atomic_load_n(&conexoes_abertas, __ATOMIC_RELAXED),
+                     __atomic_load_n(&conexoes_aceitas, __ATOMIC_RELAXED),
+                     __atomic_load_n(&comandos_em_andamento, __ATOMIC_RELAXED));
+    n = anexar_texto(texto, capacidade, n, "cache: acertos=%ld faltas=%ld remocoes=%ld taxa_acerto=%.1f%%\n",
+                     acertos, faltas, remocoes, taxa);
+    n = anexar_texto(texto, capacidade, n, "prefetch: pedidos=%lu blocos=%lu uteis=%lu desperdicados=%lu\n",
+                     __atomic_load_n(&prefetch_pedidos, __ATOMIC_RELAXED),
+                     __atomic_load_n(&prefetch_blocos, __ATOMIC_RELAXED),
+                     __atomic_load_n(&prefetch_uteis, __ATOMIC_RELAXED),
+                     __atomic_load_n(&prefetch_desperdicados, __ATOMIC_RELAXED));
+    if (limite_diff > 0 || num_regioes_atualizacao > 0)
+        n = anexar_texto(texto, capacidade, n, "diffs: enviados=%lu bytes=%lu aplicados=%lu descartados=%lu\n",
+                         __atomic_load_n(&diffs_enviados, __ATOMIC_RELAXED),
+                         __atomic_load_n(&bytes_diffs, __ATOMIC_RELAXED),
+                         __atomic_load_n(&diffs_aplicados, __ATOMIC_RELAXED),
+                         __atomic_load_n(&diffs_descartados, __ATOMIC_RELAXED));
+    if (limite_migracao > 0)
+        n = anexar_texto(texto, capacidade, n,
+                         "migracao: enviadas=%lu devolvidas=%lu recebidas=%lu redirecionamentos=%lu hospedados=%d/%d\n",
+                         __atomic_load_n(&migracoes_enviadas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&migracoes_devolvidas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&migracoes_recebidas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&redirecionamentos, __ATOMIC_RELAXED),
+                         __atomic_load_n(&num_hospedados, __ATOMIC_RELAXED), limite_migracao);
+    if (wal.fd >= 0)
+        n = anexar_texto(texto, capacidade, n,
+                         "persistencia: registros=%lu bytes=%lu fsyncs=%lu checkpoints=%lu reaplicados=%lu\n",
+                         __atomic_load_n(&wal_registros, __ATOMIC_RELAXED),
+                         __atomic_load_n(&wal_bytes, __ATOMIC_RELAXED),
+                         __atomic_load_n(&wal_fsyncs, __ATOMIC_RELAXED),
+                         __atomic_load_n(&checkpoints, __ATOMIC_RELAXED), registros_reaplicados);
+    if (num_replicas > 0)
+        n = anexar_texto(texto, capacidade, n,
+                         "replicacao: replicas=%d enviadas=%lu aplicadas=%lu perdidas=%lu ressincronizadas=%lu "
+                         "leituras=%lu\n",
+                         num_replicas, __atomic_load_n(&replicacoes_enviadas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&replicacoes_aplicadas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&replicacoes_perdidas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&copias_ressincronizadas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&leituras_replica, __ATOMIC_RELAXED));
+    n = anexar_texto(texto, capacidade, n, "atomicos: executados=%lu sem_efeito=%lu\n",
+                     __atomic_load_n(&atomicos_executados, __ATOMIC_RELAXED),
+                     __atomic_load_n(&atomicos_sem_efeito, __ATOMIC_RELAXED));
+    n = anexar_texto(texto, capacidade, n,
+                     "sincronizacao: consistencia=%s travas_concedidas=%lu travas_ocupadas=%lu barreiras=%lu avisos=%lu\n",
+                     consistencia_liberacao ? "liberacao" : "imediata",
+                     __atomic_load_n(&travas_concedidas, __ATOMIC_RELAXED),
+                     __atomic_load_n(&travas_ocupadas, __ATOMIC_RELAXED),
+                     __atomic_load_n(&barreiras_concluidas, __ATOMIC_RELAXED),
+                     __atomic_load_n(&avisos_recebidos, __ATOMIC_RELAXED));
+    for (int c = 1; c < NUM_COMANDOS; c++)
+    {
+        EstatisticaComando *e = &estatisticas_comandos[c];
+        unsigned long faixas[FAIXAS_LATENCIA], quantidade = 0;
+        for (int i = 0; i < FAIXAS_LATENCIA; i++)
+        {
+            faixas[i] = __atomic_load_n(&e->faixas[i], __ATOMIC_RELAXED);
+            quantidade += faixas[i];
+        }
+        if (quantidade == 0)
+            continue;
+        n = anexar_texto(texto, capacidade, n, "comando %s: n=%lu media=%luus p50<=%luus p99<=%luus max=%luus\n  latencias:",
+                         traduzir_comando(c), quantidade, __atomic_load_n(&e->soma_us, __ATOMIC_RELAXED) / quantidade,
+                         percentil_latencia(faixas, quantidade, 0.50), percentil_latencia(faixas, quantidade, 0.99),
+                         __atomic_load_n(&e->maximo_us, __ATOMIC_RELAXED));
+        for (int i = 0; i < FAIXAS_LATENCIA; i++)
+            if (faixas[i])
+                n = anexar_texto(texto, capacidade, n, " <%luus:%lu", 1UL << i, faixas[i]);
+        n = anexar_texto(texto, capacidade, n, "\n");
+    }
+    for (int p = 0; p < N_PROCESSOS; p++)
+    {
+        if (p == my_rank)
+            continue;
+        TrafegoPar *t = &trafego_pares[p];
+        n = anexar_texto(texto, capacidade, n, "par P%d: pedidos=%lu bytes_enviados=%lu bytes_recebidos=%lu\n", p,
+                         __atomic_load_n(&t->pedidos, __ATOMIC_RELAXED),
+                         __atomic_load_n(&t->bytes_enviados, __ATOMIC_RELAXED),
+                         __atomic_load_n(&t->bytes_recebidos, __ATOMIC_RELAXED));
+    }
+    return n;
+}
+
+void *despejar_estatisticas(void *arg)
+{
+    char *texto = malloc(tamanho_estatisticas());
+    while (1)
+    {
+        sleep(intervalo_estatisticas);
+        formatar_estatisticas(texto, tamanho_estatisticas());
+        escoar_log();
+        pthread_mutex_lock(&lock_escoamento_log);
+        printf("\n%s", texto);
+        fflush(stdout);
+        pthread_mutex_unlock(&lock_escoamento_log);
+    }
+    return NULL;
+}
+
+int receber_pedido(Conexao *conexao, char *destino, int tam)
+{
+    if (!conexao->em_quadro)
+        return recv_all(conexao->sock, destino, tam);
+    if (tam > conexao->tam_quadro - conexao->lido_quadro)
+        return -1;
+    memcpy(destino, conexao->quadro + conexao->lido_quadro, tam);
+    conexao->lido_quadro += tam;
+    return tam;
+}
+
+/* O buffer da resposta comeca com espaco para o cabecalho do quadro. */
+int responder(Conexao *conexao, const char *dados, int tam)
+{
+    if (tam < 0)
+        return -1;
+    if (!conexao->em_quadro)
+        return send_all(conexao->sock, dados, tam);
+    int usado = tam_resposta_quadro;
+    if (capacidades_thread[BUFFER_RESPOSTA_QUADRO] < usado + tam)
+    {
+        int capacidade = 2 * (usado + tam);
+        char *anterior = buffers_thread[BUFFER_RESPOSTA_QUADRO];
+        char *novo = NULL;
+        if (posix_memalign((void **)&novo, LINHA_CACHE, capacidade) != 0)
+            die("alocacao de buffer falhou");
+        if (anterior)
+            memcpy(novo, anterior, usado);
+        free(anterior);
+        buffers_thread[BUFFER_RESPOSTA_QUADRO] = novo;
+        capacidades_thread[BUFFER_RESPOSTA_QUADRO] = capacidade;
+    }
+    memcpy(buffers_thread[BUFFER_RESPOSTA_QUADRO] + usado, dados, tam);
+    tam_resposta_quadro += tam;
+    return tam;
+}
+
+int executar_comando(Conexao *conexao, int command)
+{
+    switch (command)
+    {
+    case CMD_OBTER_DADOS:
+    {
+        uint32_t pos_net, tam_net;
+        if (receber_pedido(conexao, (char *)&pos_net, sizeof(uint32_t)) < 0 ||
+            receber_pedido(conexao, (char *)&tam_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int pos = ntohl(pos_net);
+        int tam = ntohl(tam_net);
+        LOG(LOG_DEBUG, "[P%d] [OBTER_DADOS] Processando pedido para ler %d bytes da posição %d.\n", my_rank, tam, pos);
+
+        if (pos < 0 || tam <= 0 || pos > K_BLOCOS * T_BLOCO || tam > K_BLOCOS * T_BLOCO - pos)
+        {
+            LOG(LOG_AVISO, "[P%d] [ERRO] Pedido de leitura fora dos limites da memória. Enviando código %d.\n", my_rank, ERRO_MEMORIA_INEXISTENTE);
+            uint32_t codigo_erro_net = htonl(ERRO_MEMORIA_INEXISTENTE);
+            responder(conexao, (char *)&codigo_erro_net, sizeof(uint32_t));
+        }
+        else
+        {
+            char *resposta = buffer_thread(BUFFER_RESULTADO, sizeof(uint32_t) + tam);
+            char *resultado = resposta + sizeof(uint32_t);
+            int acertos_prefetch;
+            int status = ler_intervalo(pos, tam, resultado, &acertos_prefetch);
+            if (status != SUCESSO)
             {
-                uint32_t codigo_erro_net = htonl(ERRO_FALHA_OBTER_BLOCO);
-                send(sock, &codigo_erro_net, sizeof(uint32_t), 0);
+                uint32_t codigo_erro_net = htonl(status);
+                responder(conexao, (char *)&codigo_erro_net, sizeof(uint32_t));
             }
             else
             {
+                prefetch_apos_leitura(&conexao->fluxo, pos, tam, acertos_prefetch);
                 uint32_t status_sucesso_net = htonl(SUCESSO);
-                send(sock, &status_sucesso_net, sizeof(uint32_t), 0);
-                send(sock, resultado, tam, 0);
+                memcpy(resposta, &status_sucesso_net, sizeof(uint32_t));
+                responder(conexao, resposta, sizeof(uint32_t) + tam);
+            }
+        }
+        break;
+    }
+    case CMD_OBTER_BLOCO_INTERNO:
+    {
+        uint32_t id_bloco_net;
+        if (receber_pedido(conexao, (char *)&id_bloco_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int id_bloco = ntohl(id_bloco_net);
+        char *copia = buffer_thread(BUFFER_BLOCO, T_BLOCO);
+        uint32_t versao;
+        int local;
+        /* [status] e, com SUCESSO, o bloco; antes um bloco ausente fechava a conexao
+           sem resposta. */
+        uint32_t status_net = htonl(SUCESSO);
+        if (ler_bloco_residente(id_bloco, 0, T_BLOCO, copia, conexao->rank_par, &versao, &local) < 0)
+        {
+            status_net = htonl(ERRO_FALHA_OBTER_BLOCO);
+            return responder(conexao, (char *)&status_net, sizeof(uint32_t)) < 0 ? -1 : 0;
+        }
+        if (responder(conexao, (char *)&status_net, sizeof(uint32_t)) < 0 || responder(conexao, copia, T_BLOCO) < 0)
+            return -1;
+        break;
+    }
+    case CMD_OBTER_REPLICAS:
+    case CMD_OBTER_BLOCOS_INTERNO:
+    {
+        uint32_t id_inicio_net, quantidade_net;
+        if (receber_pedido(conexao, (char *)&id_inicio_net, sizeof(uint32_t)) < 0 ||
+            receber_pedido(conexao, (char *)&quantidade_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int id_inicio = ntohl(id_inicio_net);
+        int quantidade = ntohl(quantidade_net);
+        if (quantidade <= 0 || id_inicio < 0 || quantidade > K_BLOCOS - id_inicio)
+            return -1;
+        /* OBTER_REPLICAS vem de uma replica da particao: a resposta comeca pela
+           encarnacao deste rank e a replica nao entra no copyset, ja que recebe todas
+           as escritas. */
+        int replica = command == CMD_OBTER_REPLICAS;
+        int inicio = replica ? sizeof(uint32_t) : 0;
+        char *copia = buffer_thread(BUFFER_BLOCO, inicio + tamanho_resposta_blocos(quantidade));
+        uint32_t encarnacao_net = htonl(encarnacao);
+        memcpy(copia, &encarnacao_net, inicio);
+        uint32_t *versoes = (uint32_t *)(copia + inicio);
+        uint32_t *locais = versoes + quantidade;
+        char *blocos = copia + inicio + 2 * quantidade * sizeof(uint32_t);
+        for (int i = 0; i < quantidade; i++)
+        {
+            uint32_t versao = 0;
+            int local;
+            if (ler_bloco_residente(id_inicio + i, 0, T_BLOCO, blocos + (size_t)i * T_BLOCO,
+                                    replica ? -1 : conexao->rank_par, &versao, &local) == 0)
+                local = my_rank;
+            versoes[i] = htonl(versao);
+            locais[i] = htonl(local);
+        }
+        if (responder(conexao, copia, inicio + tamanho_resposta_blocos(quantidade)) < 0)
+            return -1;
+        break;
+    }
+    case CMD_SALVAR_DADOS:
+    {
+        uint32_t pos_net, tam_net;
+        if (receber_pedido(conexao, (char *)&pos_net, sizeof(uint32_t)) < 0 ||
+            receber_pedido(conexao, (char *)&tam_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int pos = ntohl(pos_net);
+        int tam = ntohl(tam_net);
+        if (pos < 0 || tam <= 0 || pos > K_BLOCOS * T_BLOCO || tam > K_BLOCOS * T_BLOCO - pos)
+        {
+            /* Descarta os dados do pedido invalido para manter a conexao utilizavel
+               por pedidos enviados em sequencia. */
+            if (tam < 0 || tam > K_BLOCOS * T_BLOCO)
+                return -1;
+            if (tam > 0 && receber_pedido(conexao, buffer_thread(BUFFER_RESULTADO, tam), tam) < 0)
+                return -1;
+            uint32_t codigo_erro_net = htonl(ERRO_MEMORIA_INEXISTENTE);
+            responder(conexao, (char *)&codigo_erro_net, sizeof(uint32_t));
+        }
+        else
+        {
+            char *dados_a_salvar = buffer_thread(BUFFER_RESULTADO, tam);
+            if (receber_pedido(conexao, dados_a_salvar, tam) < 0)
+                return -1;
+            int status = salvar_intervalo(pos, tam, dados_a_salvar);
+            if (status == SUCESSO && consistencia_liberacao)
+                for (int id_bloco = pos / T_BLOCO; id_bloco <= (pos + tam - 1) / T_BLOCO; id_bloco++)
+                    avisos_adicionar(&conexao->avisos, id_bloco);
+            uint32_t status_net = htonl(status);
+            responder(conexao, (char *)&status_net, sizeof(uint32_t));
+        }
+        break;
+    }
+    case CMD_ATUALIZAR_BLOCOS:
+    {
+        uint32_t trechos_net, tam_net;
+        if (receber_pedido(conexao, (char *)&trechos_net, sizeof(uint32_t)) < 0 ||
+            receber_pedido(conexao, (char *)&tam_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int trechos = ntohl(trechos_net);
+        int tam = ntohl(tam_net);
+        /* Cada trecho cai em um bloco: no maximo K_BLOCOS trechos de ate T_BLOCO bytes. */
+        if (conexao->rank_par < 0 || trechos < 0 || trechos > K_BLOCOS || tam < 0 ||
+            trechos > tam / (int)(3 * sizeof(uint32_t)) ||
+            (long)tam > (long)trechos * (long)(3 * sizeof(uint32_t) + T_BLOCO))
+            return -1;
+        char *payload = buffer_thread(BUFFER_RESULTADO, tam);
+        if (receber_pedido(conexao, payload, tam) < 0)
+            return -1;
+        /* [status] e, por trecho, [aplicado, rank que tem o bloco, versao depois da escrita]. */
+        uint32_t *resposta = (uint32_t *)buffer_thread(BUFFER_BLOCO, sizeof(uint32_t) * (1 + 3 * trechos));
+        int status = SUCESSO;
+        char *trecho = payload;
+        LoteInvalidacao lote;
+        lote_iniciar(&lote, trechos);
+        for (int t = 0; t < trechos; t++)
+        {
+            uint32_t cabecalho[3];
+            if (trecho + sizeof(cabecalho) > payload + tam)
+                return -1;
+            memcpy(cabecalho, trecho, sizeof(cabecalho));
+            int id_bloco = ntohl(cabecalho[0]);
+            int offset = ntohl(cabecalho[1]);
+            int tam_trecho = ntohl(cabecalho[2]);
+            trecho += sizeof(cabecalho);
+            if (offset < 0 || tam_trecho < 0 || offset + tam_trecho > T_BLOCO || trecho + tam_trecho > payload + tam)
+                return -1;
+            int local;
+            uint32_t versao = 0;
+            int aplicado = aplicar_atualizacao(id_bloco, offset, tam_trecho, trecho, NULL, conexao->rank_par, &lote,
+                                               &local, &versao) == 0;
+            if (!aplicado && local < 0)
+                status = ERRO_FALHA_ATUALIZAR_BLOCO;
+            resposta[1 + 3 * t] = htonl(aplicado);
+            resposta[2 + 3 * t] = htonl(local);
+            resposta[3 + 3 * t] = htonl(versao);
+            trecho += tam_trecho;
+        }
+        lote_enviar(&lote);
+        resposta[0] = htonl(status);
+        responder(conexao, (char *)resposta, sizeof(uint32_t) * (1 + 3 * trechos));
+        break;
+    }
+    case CMD_MIGRAR_BLOCO:
+    {
+        uint32_t cabecalho[3];
+        if (receber_pedido(conexao, (char *)cabecalho, sizeof(cabecalho)) < 0)
+            return -1;
+        int id_bloco = ntohl(cabecalho[0]);
+        int proximo = ntohl(cabecalho[2]);
+        char *dados_bloco = buffer_thread(BUFFER_BLOCO, T_BLOCO);
+        if (receber_pedido(conexao, dados_bloco, T_BLOCO) < 0)
+            return -1;
+        if (conexao->rank_par < 0 || calcular_dono(id_bloco) < 0 || proximo < 0 || proximo >= N_PROCESSOS)
+            return -1;
+        receber_migracao(id_bloco, ntohl(cabecalho[1]), proximo, dados_bloco);
+        break;
+    }
+    case CMD_ADQUIRIR:
+    {
+        uint32_t id_net;
+        if (receber_pedido(conexao, (char *)&id_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int id = ntohl(id_net);
+        int status = ERRO_SINCRONIZACAO;
+        if (conexao->num_travas < MAX_TRAVAS_CONEXAO)
+        {
+            int valor = 0;
+            AvisosEscrita *recebidos = (AvisosEscrita *)buffer_thread(BUFFER_INVALIDACOES, sizeof(AvisosEscrita));
+            status = sincronizar(SINC_ADQUIRIR, id, conexao, &valor, &conexao->avisos, recebidos);
+            if (status == SUCESSO)
+            {
+                avisos_aplicar(recebidos);
+                int registrada = 0;
+                for (int i = 0; i < conexao->num_travas; i++)
+                    registrada |= conexao->travas[i] == id;
+                if (!registrada)
+                    conexao->travas[conexao->num_travas++] = id;
             }
-            free(resultado);
         }
+        uint32_t status_net = htonl(status);
+        if (responder(conexao, (char *)&status_net, sizeof(uint32_t)) < 0)
+            return -1;
+        break;
+    }
+    case CMD_LIBERAR:
+    {
+        uint32_t id_net;
+        if (receber_pedido(conexao, (char *)&id_net, sizeof(uint32_t)) < 0)
+            return -1;
+        uint32_t status_net = htonl(liberar_trava(conexao, ntohl(id_net)));
+        if (responder(conexao, (char *)&status_net, sizeof(uint32_t)) < 0)
+            return -1;
+        break;
+    }
+    case CMD_BARREIRA:
+    {
+        /* geracao 0 registra a chegada; depois o cliente repete com a geracao
+           devolvida ate receber SUCESSO. A resposta e sempre [status, geracao]. */
+        uint32_t campos[3];
+        if (receber_pedido(conexao, (char *)campos, sizeof(campos)) < 0)
+            return -1;
+        int id = ntohl(campos[0]);
+        int geracao = ntohl(campos[2]);
+        int valor = geracao == 0 ? (int)ntohl(campos[1]) : geracao;
+        AvisosEscrita *recebidos = (AvisosEscrita *)buffer_thread(BUFFER_INVALIDACOES, sizeof(AvisosEscrita));
+        int status = sincronizar(geracao == 0 ? SINC_CHEGAR : SINC_AGUARDAR, id, conexao, &valor, &conexao->avisos,
+                                 recebidos);
+        if (geracao == 0 && (status == SUCESSO || status == ERRO_OCUPADO))
+            esquecer_avisos(conexao);
+        if (status == SUCESSO)
+            avisos_aplicar(recebidos);
+        uint32_t resposta[2] = {htonl(status), htonl(valor)};
+        if (responder(conexao, (char *)resposta, sizeof(resposta)) < 0)
+            return -1;
+        break;
+    }
+    case CMD_SINCRONIZAR:
+    {
+        uint32_t campos[6];
+        if (receber_pedido(conexao, (char *)campos, sizeof(campos)) < 0)
+            return -1;
+        int operacao = ntohl(campos[0]);
+        int id = ntohl(campos[1]);
+        int valor = ntohl(campos[3]);
+        AvisosEscrita *publicar = (AvisosEscrita *)buffer_thread(BUFFER_IDS, sizeof(AvisosEscrita));
+        publicar->tudo = ntohl(campos[4]);
+        publicar->quantidade = ntohl(campos[5]);
+        if (conexao->rank_par < 0 || operacao < SINC_ADQUIRIR || operacao > SINC_AGUARDAR || publicar->quantidade < 0 ||
+            publicar->quantidade > MAX_AVISOS)
+            return -1;
+        for (int i = 0; i < publicar->quantidade; i++)
+        {
+            uint32_t id_net;
+            if (receber_pedido(conexao, (char *)&id_net, sizeof(uint32_t)) < 0)
+                return -1;
+            publicar->ids[i] = ntohl(id_net);
+        }
+        AvisosEscrita *recebidos = (AvisosEscrita *)buffer_thread(BUFFER_INVALIDACOES, sizeof(AvisosEscrita));
+        int status = gerente_sincronizar(operacao, id, conexao->rank_par, ntohl(campos[2]), &valor, publicar, recebidos);
+        int tam_resposta = (4 + MAX_AVISOS) * sizeof(uint32_t);
+        uint32_t *resposta = (uint32_t *)buffer_thread(BUFFER_RESULTADO, tam_resposta);
+        memset(resposta, 0, tam_resposta);
+        resposta[0] = htonl(status);
+        resposta[1] = htonl(valor);
+        resposta[2] = htonl(recebidos->tudo);
+        resposta[3] = htonl(recebidos->quantidade);
+        for (int i = 0; i < recebidos->quantidade; i++)
+            resposta[4 + i] = htonl(recebidos->ids[i]);
+        if (responder(conexao, (char *)resposta, tam_resposta) < 0)
+            return -1;
+        break;
+    }
+    case CMD_INVALIDAR_BLOCOS:
+    {
+        uint32_t quantidade_net;
+        if (receber_pedido(conexao, (char *)&quantidade_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int quantidade = ntohl(quantidade_net);
+        if (conexao->rank_par < 0 || quantidade < 0 || quantidade > K_BLOCOS)
+            return -1;
+        uint32_t *ids = (uint32_t *)buffer_thread(BUFFER_IDS, sizeof(uint32_t) * quantidade);
+        if (receber_pedido(conexao, (char *)ids, sizeof(uint32_t) * quantidade) < 0)
+            return -1;
+        for (int i = 0; i < quantidade; i++)
+            cache_invalidar(ntohl(ids[i]));
+        uint32_t status = htonl(SUCESSO);
+        responder(conexao, (char *)&status, sizeof(status));
+        break;
+    }
+    case CMD_ATUALIZAR_COPIAS:
+    {
+        uint32_t diffs_net, tam_net;
+        if (receber_pedido(conexao, (char *)&diffs_net, sizeof(uint32_t)) < 0 ||
+            receber_pedido(conexao, (char *)&tam_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int diffs = ntohl(diffs_net);
+        int tam = ntohl(tam_net);
+        /* Um diff por bloco do lote, cada um com no maximo T_BLOCO bytes. */
+        if (conexao->rank_par < 0 || diffs < 0 || diffs > K_BLOCOS || tam < 0 ||
+            (long)tam > (long)diffs * (long)(4 * sizeof(uint32_t) + T_BLOCO))
+            return -1;
+        char *payload = buffer_thread(BUFFER_RESULTADO, tam);
+        if (receber_pedido(conexao, payload, tam) < 0)
+            return -1;
+        char *trecho = payload;
+        for (int d = 0; d < diffs; d++)
+        {
+            uint32_t cabecalho[4];
+            if (trecho + sizeof(cabecalho) > payload + tam)
+                return -1;
+            memcpy(cabecalho, trecho, sizeof(cabecalho));
+            int offset = ntohl(cabecalho[2]);
+            int tam_diff = ntohl(cabecalho[3]);
+            trecho += sizeof(cabecalho);
+            if (offset < 0 || tam_diff < 0 || offset + tam_diff > T_BLOCO || trecho + tam_diff > payload + tam)
+                return -1;
+            cache_aplicar_diff(ntohl(cabecalho[0]), ntohl(cabecalho[1]), offset, tam_diff, trecho);
+            trecho += tam_diff;
+        }
+        uint32_t status = htonl(SUCESSO);
+        responder(conexao, (char *)&status, sizeof(status));
         break;
     }
-    case CMD_OBTER_BLOCO_INTERNO:
+    case CMD_ATUALIZAR_REPLICA:
     {
-        uint32_t id_bloco_net;
-        recv_all(sock, (char *)&id_bloco_net, sizeof(uint32_t));
-        int id_bloco = ntohl(id_bloco_net);
-        for (int i = 0; i < num_blocos_locais; i++)
+        uint32_t cabecalho[5];
+        if (receber_pedido(conexao, (char *)cabecalho, sizeof(cabecalho)) < 0)
+            return -1;
+        int offset = ntohl(cabecalho[3]);
+        int tam = ntohl(cabecalho[4]);
+        if (conexao->rank_par < 0 || offset < 0 || tam < 0 || offset + tam > T_BLOCO)
+            return -1;
+        char *dados_recebidos = buffer_thread(BUFFER_BLOCO, tam);
+        if (receber_pedido(conexao, dados_recebidos, tam) < 0)
+            return -1;
+        replica_aplicar(conexao->rank_par, ntohl(cabecalho[0]), ntohl(cabecalho[1]), ntohl(cabecalho[2]), offset, tam,
+                        dados_recebidos);
+        break;
+    }
+    case CMD_ATOMICO:
+    {
+        /* [posicao, operacao, largura, operando (2 campos), esperado (2 campos)] */
+        uint32_t campos[7];
+        if (receber_pedido(conexao, (char *)campos, sizeof(campos)) < 0)
+            return -1;
+        int pos = ntohl(campos[0]);
+        OperacaoAtomica operacao = {0};
+        operacao.operacao = ntohl(campos[1]);
+        operacao.largura = ntohl(campos[2]);
+        operacao.operando = ((uint64_t)ntohl(campos[3]) << 32) | ntohl(campos[4]);
+        operacao.esperado = ((uint64_t)ntohl(campos[5]) << 32) | ntohl(campos[6]);
+        int status;
+        if (!operacao_atomica_valida(&operacao) || pos % operacao.largura != 0 ||
+            pos % T_BLOCO + operacao.largura > T_BLOCO)
+            status = ERRO_OPERACAO_INVALIDA;
+        else if (pos < 0 || pos > K_BLOCOS * T_BLOCO - operacao.largura)
+            status = ERRO_MEMORIA_INEXISTENTE;
+        else
+            status = executar_atomico(pos, &operacao);
+        if (status == SUCESSO && operacao.alterou && consistencia_liberacao)
+            avisos_adicionar(&conexao->avisos, pos / T_BLOCO);
+        /* [status] e, com sucesso, o valor anterior da palavra (2 campos). */
+        uint32_t resposta[3] = {htonl(status), htonl((uint32_t)(operacao.anterior >> 32)),
+                                htonl((uint32_t)operacao.anterior)};
+        if (responder(conexao, (char *)resposta, status == SUCESSO ? sizeof(resposta) : sizeof(uint32_t)) < 0)
+            return -1;
+        break;
+    }
+    case CMD_ATOMICO_INTERNO:
+    {
+        /* [id, offset, operacao, largura, operando (2 campos), esperado (2 campos)] */
+        uint32_t campos[8];
+        if (receber_pedido(conexao, (char *)campos, sizeof(campos)) < 0)
+            return -1;
+        int id_bloco = ntohl(campos[0]);
+        int offset = ntohl(campos[1]);
+        OperacaoAtomica operacao = {0};
+        operacao.operacao = ntohl(campos[2]);
+        operacao.largura = ntohl(campos[3]);
+        operacao.operando = ((uint64_t)ntohl(campos[4]) << 32) | ntohl(campos[5]);
+        operacao.esperado = ((uint64_t)ntohl(campos[6]) << 32) | ntohl(campos[7]);
+        if (conexao->rank_par < 0 || !operacao_atomica_valida(&operacao) || offset < 0 ||
+            offset + operacao.largura > T_BLOCO)
+            return -1;
+        LoteInvalidacao lote;
+        int local;
+        uint32_t versao = 0;
+        lote_iniciar(&lote, 1);
+        lote.atomico = 1;
+        int aplicado =
+            aplicar_atualizacao(id_bloco, offset, 0, NULL, &operacao, conexao->rank_par, &lote, &local, &versao) == 0;
+        lote_enviar(&lote);
+        uint32_t resposta[7] = {htonl(!aplicado && local < 0 ? ERRO_FALHA_ATUALIZAR_BLOCO : SUCESSO),
+                                htonl(aplicado),
+                                htonl(local),
+                                htonl(versao),
+                                htonl(aplicado && operacao.alterou),
+                                htonl((uint32_t)(operacao.anterior >> 32)),
+                                htonl((uint32_t)operacao.anterior)};
+        if (responder(conexao, (char *)resposta, sizeof(resposta)) < 0)
+            return -1;
+        break;
+    }
+    case CMD_APRESENTACAO:
+    {
+        uint32_t rank_net;
+        if (receber_pedido(conexao, (char *)&rank_net, sizeof(uint32_t)) < 0)
+            return -1;
+        int rank_par = ntohl(rank_net);
+        if (rank_par < 0 || rank_par >= N_PROCESSOS)
+            return -1;
+        conexao->interna = 1;
+        conexao->rank_par = rank_par;
+        break;
+    }
+    case CMD_ESTATISTICAS:
+    {
+        int capacidade = tamanho_estatisticas();
+        char *resposta = buffer_thread(BUFFER_RESULTADO, 2 * sizeof(uint32_t) + capacidade);
+        int tam_texto = formatar_estatisticas(resposta + 2 * sizeof(uint32_t), capacidade);
+        uint32_t cabecalho[2] = {htonl(SUCESSO), htonl(tam_texto)};
+        memcpy(resposta, cabecalho, sizeof(cabecalho));
+        if (responder(conexao, resposta, sizeof(cabecalho) + tam_texto) < 0)
+            return -1;
+        break;
+    }
+    case CMD_OBTER_LAYOUT:
+    {
+        /* O cliente repete calcular_dono com estes valores e usa a tabela de pares
+           (endereco IPv4 e porta de cada rank) para falar direto com o dono. */
+        int campos = 5 + 2 * N_PROCESSOS;
+        uint32_t *layout = (uint32_t *)buffer_thread(BUFFER_RESULTADO, campos * sizeof(uint32_t));
+        layout[0] = htonl(SUCESSO);
+        layout[1] = htonl(N_PROCESSOS);
+        layout[2] = htonl(K_BLOCOS);
+        layout[3] = htonl(T_BLOCO);
+        layout[4] = htonl(my_rank);
+        for (int r = 0; r < N_PROCESSOS; r++)
         {
-            if (blocos_locais[i].id == id_bloco)
-            {
-                send(sock, blocos_locais[i].dados, T_BLOCO, 0);
-                break;
-            }
+            layout[5 + 2 * r] = enderecos_pares[r].endereco.sin_addr.s_addr;
+            layout[6 + 2 * r] = htonl(enderecos_pares[r].porta);
         }
+        if (responder(conexao, (char *)layout, campos * sizeof(uint32_t)) < 0)
+            return -1;
         break;
     }
+    default:
+    {
+        uint32_t codigo_erro_net = htonl(ERRO_COMANDO_DESCONHECIDO);
+        responder(conexao, (char *)&codigo_erro_net, sizeof(uint32_t));
+        return -1;
+    }
+    }
+    return 0;
+}
+
+int enviar_quadro(Conexao *conexao, const CabecalhoQuadro *pedido, int status, const char *corpo, int tam_corpo)
+{
+    CabecalhoQuadro resposta = {PROTOCOLO_MAGICO, PROTOCOLO_VERSAO, pedido->opcode, pedido->id_pedido,
+                                QUADRO_RESPOSTA | (status < 0 ? QUADRO_ERRO : 0), tam_corpo, status};
+    char *quadro = buffer_thread(BUFFER_BLOCO, TAM_CABECALHO_QUADRO + tam_corpo);
+    quadro_codificar(&resposta, quadro);
+    if (tam_corpo > 0)
+        memcpy(quadro + TAM_CABECALHO_QUADRO, corpo, tam_corpo);
+    return send_all(conexao->sock, quadro, TAM_CABECALHO_QUADRO + tam_corpo);
+}
+
+/* Le o resto do cabecalho (o magico ja foi lido no lugar do comando) e o payload.
+   Um quadro de outra versao ou grande demais recebe um quadro de erro e a conexao e
+   fechada, ja que nao da para saber onde comeca o proximo. */
+int receber_quadro(Conexao *conexao, CabecalhoQuadro *pedido)
+{
+    char bruto[TAM_CABECALHO_QUADRO];
+    uint32_t magico_net = htonl(PROTOCOLO_MAGICO);
+    memcpy(bruto, &magico_net, sizeof(uint32_t));
+    if (recv_all(conexao->sock, bruto + sizeof(uint32_t), TAM_CABECALHO_QUADRO - sizeof(uint32_t)) < 0)
+        return -1;
+    quadro_decodificar(bruto, pedido);
+    if (pedido->versao != PROTOCOLO_VERSAO || pedido->tam_payload > (uint32_t)K_BLOCOS * T_BLOCO + 64)
+    {
+        LOG(LOG_AVISO, "[P%d] [REDE] Quadro invalido (versao %d, %u bytes).\n", my_rank, pedido->versao,
+            pedido->tam_payload);
+        enviar_quadro(conexao, pedido, ERRO_PROTOCOLO, NULL, 0);
+        return -1;
+    }
+    char *payload = buffer_thread(BUFFER_QUADRO, pedido->tam_payload);
+    if (recv_all(conexao->sock, payload, pedido->tam_payload) < 0)
+        return -1;
+    conexao->em_quadro = 1;
+    conexao->quadro = payload;
+    conexao->tam_quadro = pedido->tam_payload;
+    conexao->lido_quadro = 0;
+    tam_resposta_quadro = TAM_CABECALHO_QUADRO;
+    return 0;
+}
+
+/* A resposta v1 acumulada vira o quadro: o primeiro campo vai para o status do
+   cabecalho e o resto e o payload. Comandos sem resposta nao geram quadro; um
+   comando que falhou sem responder (campos invalidos ou faltando) gera um quadro de
+   erro antes de a conexao ser fechada. */
+/* Comandos aceitos em quadro v2: os da libdsm, cuja resposta comeca pelo status que
+   vai para o cabecalho. Os internos respondem sem status e so andam no formato antigo,
+   entre os processos. */
+int comando_de_cliente(int comando)
+{
+    switch (comando)
+    {
+    case CMD_OBTER_DADOS:
     case CMD_SALVAR_DADOS:
+    case CMD_ESTATISTICAS:
+    case CMD_OBTER_LAYOUT:
+    case CMD_ADQUIRIR:
+    case CMD_LIBERAR:
+    case CMD_BARREIRA:
+    case CMD_ATOMICO:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int responder_quadro(Conexao *conexao, const CabecalhoQuadro *pedido, int resultado)
+{
+    conexao->em_quadro = 0;
+    int tam = tam_resposta_quadro - TAM_CABECALHO_QUADRO;
+    if (tam >= (int)sizeof(uint32_t))
     {
-        uint32_t pos_net, tam_net;
-        recv_all(sock, (char *)&pos_net, sizeof(uint32_t));
-        recv_all(sock, (char *)&tam_net, sizeof(uint32_t));
-        int pos = ntohl(pos_net);
-        int tam = ntohl(tam_net);
-        if (pos < 0 || (pos + tam) > (K_BLOCOS * T_BLOCO) || tam <= 0)
+        char *resposta = buffers_thread[BUFFER_RESPOSTA_QUADRO] + TAM_CABECALHO_QUADRO;
+        uint32_t status_net;
+        memcpy(&status_net, resposta, sizeof(uint32_t));
+        /* O cabecalho ocupa o espaco reservado mais o do status, logo antes do corpo. */
+        CabecalhoQuadro cabecalho = {PROTOCOLO_MAGICO, PROTOCOLO_VERSAO, pedido->opcode, pedido->id_pedido,
+                                     QUADRO_RESPOSTA, tam - sizeof(uint32_t), (int32_t)ntohl(status_net)};
+        if (cabecalho.status < 0)
+            cabecalho.flags |= QUADRO_ERRO;
+        quadro_codificar(&cabecalho, resposta + sizeof(uint32_t) - TAM_CABECALHO_QUADRO);
+        if (send_all(conexao->sock, resposta + sizeof(uint32_t) - TAM_CABECALHO_QUADRO,
+                     TAM_CABECALHO_QUADRO + tam - sizeof(uint32_t)) < 0)
+            return -1;
+    }
+    else if (resultado < 0)
+        enviar_quadro(conexao, pedido, ERRO_PROTOCOLO, NULL, 0);
+    return resultado;
+}
+
+int processar_comando(Conexao *conexao)
+{
+    int sock = conexao->sock;
+    int command = conexao->comando_pendente;
+    conexao->comando_pendente = -1;
+    if (command < 0)
+    {
+        uint32_t comando_net;
+        if (recv_all(sock, (char *)&comando_net, sizeof(uint32_t)) < 0)
+            return -1;
+        command = ntohl(comando_net);
+    }
+    /* Conexoes novas chegam pelo pool interno: assim a apresentacao de um par nunca
+       espera atras de clientes bloqueados. Se nao for um par, o comando ja lido segue
+       para o pool de clientes. */
+    if (!conexao->classificada)
+    {
+        conexao->classificada = 1;
+        if (command != CMD_APRESENTACAO)
         {
-            uint32_t codigo_erro_net = htonl(ERRO_MEMORIA_INEXISTENTE);
-            send(sock, &codigo_erro_net, sizeof(uint32_t), 0);
+            conexao->comando_pendente = command;
+            return 1;
         }
-        else
+    }
+    CabecalhoQuadro pedido;
+    int em_quadro = (uint32_t)command == PROTOCOLO_MAGICO;
+    if (em_quadro)
+    {
+        if (receber_quadro(conexao, &pedido) < 0)
+            return -1;
+        command = pedido.opcode;
+        /* Com o payload ja lido, o fluxo continua alinhado e a conexao pode seguir. */
+        if (!comando_de_cliente(command))
         {
-            char *dados_a_salvar = malloc(tam);
-            recv_all(sock, dados_a_salvar, tam);
-            for (int i = 0; i < tam;)
-            {
-                int p_atual = pos + i;
-                int id_bloco, offset;
-                mapear_posicao_global(p_atual, &id_bloco, &offset);
-                int dono = calcular_dono(id_bloco);
-                int bytes_a_escrever = T_BLOCO - offset;
-                if (bytes_a_escrever > (tam - i))
-                    bytes_a_escrever = tam - i;
-                enviar_msg_assincrona(dono, CMD_ATUALIZAR_BLOCO, id_bloco, offset, bytes_a_escrever, dados_a_salvar + i);
-                i += bytes_a_escrever;
-            }
-            free(dados_a_salvar);
-            uint32_t status_sucesso_net = htonl(SUCESSO);
-            send(sock, &status_sucesso_net, sizeof(uint32_t), 0);
+            conexao->em_quadro = 0;
+            return enviar_quadro(conexao, &pedido, ERRO_COMANDO_DESCONHECIDO, NULL, 0) < 0 ? -1 : 0;
         }
-        break;
     }
-    case CMD_ATUALIZAR_BLOCO:
+    LOG(LOG_TRACE, "\n[P%d] [REDE] Comando recebido: %s (%d)%s\n", my_rank, traduzir_comando(command), command,
+        em_quadro ? " em quadro v2" : "");
+    unsigned long inicio = agora_us();
+    __atomic_fetch_add(&comandos_em_andamento, 1, __ATOMIC_RELAXED);
+    int resultado = executar_comando(conexao, command);
+    __atomic_fetch_sub(&comandos_em_andamento, 1, __ATOMIC_RELAXED);
+    if (em_quadro)
+        resultado = responder_quadro(conexao, &pedido, resultado);
+    registrar_latencia(command, agora_us() - inicio);
+    return resultado;
+}
+
+void reator_criar()
+{
+#ifdef __linux__
+    reator_fd = epoll_create1(0);
+#else
+    reator_fd = kqueue();
+#endif
+    if (reator_fd < 0)
+        die("criacao do reator falhou");
+}
+
+/* Registra o socket em modo one-shot: cada evento entrega a conexao a um unico
+   trabalhador, que rearma o socket depois de atender os comandos disponiveis. */
+int reator_armar(int sock, void *dados, int novo)
+{
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = dados;
+    return epoll_ctl(reator_fd, novo ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, sock, &ev);
+#else
+    (void)novo;
+    struct kevent ev;
+    EV_SET(&ev, sock, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, dados);
+    return kevent(reator_fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+int reator_esperar(void **prontos, int max)
+{
+#ifdef __linux__
+    struct epoll_event eventos[MAX_EVENTOS];
+    int n = epoll_wait(reator_fd, eventos, max < MAX_EVENTOS ? max : MAX_EVENTOS, -1);
+    for (int i = 0; i < n; i++)
+        prontos[i] = eventos[i].data.ptr;
+#else
+    struct kevent eventos[MAX_EVENTOS];
+    int n = kevent(reator_fd, NULL, 0, eventos, max < MAX_EVENTOS ? max : MAX_EVENTOS, NULL);
+    for (int i = 0; i < n; i++)
+        prontos[i] = eventos[i].udata;
+#endif
+    return n;
+}
+
+void pool_inserir(PoolTrabalho *pool, Conexao *conexao)
+{
+    conexao->proxima = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->ultima)
+        pool->ultima->proxima = conexao;
+    else
+        pool->primeira = conexao;
+    pool->ultima = conexao;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+Conexao *pool_retirar(PoolTrabalho *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->primeira == NULL)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    Conexao *conexao = pool->primeira;
+    pool->primeira = conexao->proxima;
+    if (pool->primeira == NULL)
+        pool->ultima = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return conexao;
+}
+
+void fechar_conexao(Conexao *conexao)
+{
+    while (conexao->num_travas > 0)
+    {
+        int id = conexao->travas[conexao->num_travas - 1];
+        LOG(LOG_AVISO, "[P%d] [SINC] Conexao fechada segurando a trava %d; liberando.\n", my_rank, id);
+        if (liberar_trava(conexao, id) != SUCESSO)
+            conexao->num_travas--;
+    }
+    __atomic_fetch_sub(&conexoes_abertas, 1, __ATOMIC_RELAXED);
+    close(conexao->sock);
+    free(conexao);
+}
+
+int ha_dados_pendentes(int sock)
+{
+    char byte;
+    return recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+void *trabalhador(void *arg)
+{
+    PoolTrabalho *pool = arg;
+    while (1)
+    {
+        Conexao *conexao = pool_retirar(pool);
+        int resultado, atendidos = 0;
+        do
+        {
+            resultado = processar_comando(conexao);
+            atendidos++;
+        } while (resultado == 0 && atendidos < MAX_COMANDOS_POR_VEZ && ha_dados_pendentes(conexao->sock));
+        if (resultado > 0)
+            pool_inserir(&pool_clientes, conexao);
+        else if (resultado < 0 || reator_armar(conexao->sock, conexao, 0) < 0)
+            fechar_conexao(conexao);
+    }
+    return NULL;
+}
+
+void iniciar_pool(PoolTrabalho *pool, const char *nome, int num_trabalhadores)
+{
+    pool->nome = nome;
+    pool->primeira = NULL;
+    pool->ultima = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i = 0; i < num_trabalhadores; i++)
     {
-        uint32_t id_bloco_net, offset_net, tam_net;
-        recv_all(sock, (char *)&id_bloco_net, sizeof(uint32_t));
-        recv_all(sock, (char *)&offset_net, sizeof(uint32_t));
-        recv_all(sock, (char *)&tam_net, sizeof(uint32_t));
-        int id_bloco = ntohl(id_bloco_net);
-        int offset = ntohl(offset_net);
-        int tam = ntohl(tam_net);
-        char *dados_recebidos = malloc(tam);
-        recv_all(sock, dados_recebidos, tam);
-        for (int i = 0; i < num_blocos_locais; i++)
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, trabalhador, pool) != 0)
+            die("nao foi possivel criar a thread");
+        pthread_detach(thread);
+    }
+    LOG(LOG_INFO, "[P%d] Pool %s com %d trabalhadores.\n", my_rank, nome, num_trabalhadores);
+}
+
+void aceitar_conexoes(int listening_socket)
+{
+    while (1)
+    {
+        int client_sock = accept(listening_socket, NULL, NULL);
+        if (client_sock < 0)
+            return;
+        int flags = fcntl(client_sock, F_GETFL, 0);
+        fcntl(client_sock, F_SETFL, flags & ~O_NONBLOCK);
+        /* O trabalhador so le depois que o reator viu dados, mas le o pedido inteiro
+           bloqueando: um cliente que para no meio do pedido (ou nao le a resposta) tem
+           a conexao fechada em vez de prender o trabalhador. */
+        struct timeval limite = {.tv_sec = TEMPO_LIMITE_PEDIDO_S, .tv_usec = 0};
+        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &limite, sizeof(limite));
+        setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &limite, sizeof(limite));
+        int opt_nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &opt_nodelay, sizeof(opt_nodelay));
+        Conexao *conexao = malloc(sizeof(Conexao));
+        conexao->sock = client_sock;
+        conexao->interna = 0;
+        conexao->classificada = 0;
+        conexao->comando_pendente = -1;
+        conexao->rank_par = -1;
+        memset(&conexao->fluxo, 0, sizeof(conexao->fluxo));
+        conexao->fluxo.proximo_bloco = -2;
+        conexao->proxima = NULL;
+        conexao->token = (uint32_t)__atomic_add_fetch(&conexoes_aceitas, 1, __ATOMIC_RELAXED);
+        conexao->avisos.quantidade = 0;
+        conexao->avisos.tudo = 0;
+        conexao->num_travas = 0;
+        conexao->em_quadro = 0;
+        __atomic_fetch_add(&conexoes_abertas, 1, __ATOMIC_RELAXED);
+        if (reator_armar(client_sock, conexao, 1) < 0)
+            fechar_conexao(conexao);
+    }
+}
+
+void executar_reator(int listening_socket)
+{
+    void *prontos[MAX_EVENTOS];
+    while (1)
+    {
+        int n = reator_esperar(prontos, MAX_EVENTOS);
+        for (int i = 0; i < n; i++)
         {
-            if (blocos_locais[i].id == id_bloco)
+            Conexao *conexao = prontos[i];
+            if (conexao == &conexao_escuta)
             {
-                memcpy(blocos_locais[i].dados + offset, dados_recebidos, tam);
-                printf("[P%d] Bloco LOCAL %d atualizado.\n", my_rank, id_bloco);
-                for (int p = 0; p < N_PROCESSOS; p++)
-                {
-                    if (p != my_rank)
-                        enviar_msg_assincrona(p, CMD_INVALIDAR_BLOCO, id_bloco, 0, 0, NULL);
-                }
-                break;
+                aceitar_conexoes(listening_socket);
+                reator_armar(listening_socket, &conexao_escuta, 0);
             }
+            else
+                pool_inserir(conexao->interna || !conexao->classificada ? &pool_interno : &pool_clientes, conexao);
         }
-        free(dados_recebidos);
-        break;
     }
-    case CMD_INVALIDAR_BLOCO:
+}
+
+/* Mesma particao de calcular_dono. Com menos blocos que processos, o rank r fica so
+   com o bloco r e os ranks a partir de K_BLOCOS ficam com uma faixa vazia. */
+void faixa_do_rank(int rank, int *inicio, int *fim)
+{
+    int blocos_por_processo = K_BLOCOS / N_PROCESSOS;
+    if (blocos_por_processo == 0)
+    {
+        *inicio = rank < K_BLOCOS ? rank : K_BLOCOS;
+        *fim = rank < K_BLOCOS ? rank : K_BLOCOS - 1;
+        return;
+    }
+    *inicio = rank * blocos_por_processo;
+    *fim = (rank == N_PROCESSOS - 1) ? (K_BLOCOS - 1) : (*inicio + blocos_por_processo - 1);
+}
+
+/* Aloca os blocos dos ranks de rank_inicio a rank_fim. Com memoria compartilhada,
+   blocos, seqlocks, copysets e listras de escrita ficam numa regiao MAP_SHARED criada
+   antes do fork: um rank le e escreve blocos de outro rank da mesma maquina direto
+   na memoria dele, sem mensagens. */
+void iniciar_blocos(int rank_inicio, int rank_fim, int compartilhada)
+{
+    int blocos_fim;
+    faixa_do_rank(rank_inicio, &blocos_inicio, &blocos_fim);
+    faixa_do_rank(rank_fim, &blocos_fim, &blocos_fim);
+    num_blocos_locais = blocos_fim - blocos_inicio + 1;
+    size_t tam_copysets = (size_t)(num_blocos_locais > 0 ? num_blocos_locais : 0) * palavras_copyset * sizeof(uint64_t);
+    size_t tam_listras = sizeof(pthread_mutex_t) * NUM_LISTRAS_ESCRITA;
+    size_t tam_blocos = sizeof(BlocoMemoria) * (num_blocos_locais > 0 ? num_blocos_locais : 0);
+    tam_listras = (tam_listras + LINHA_CACHE - 1) / LINHA_CACHE * LINHA_CACHE;
+    tam_blocos = (tam_blocos + LINHA_CACHE - 1) / LINHA_CACHE * LINHA_CACHE;
+    tam_copysets = (tam_copysets + LINHA_CACHE - 1) / LINHA_CACHE * LINHA_CACHE;
+    size_t tam_arena = dados_dir ? 0 : (size_t)(num_blocos_locais > 0 ? num_blocos_locais : 0) * stride_bloco;
+    char *regiao = alocar_arena(tam_listras + tam_blocos + tam_copysets + tam_arena, compartilhada);
+    listras_escrita = (pthread_mutex_t *)regiao;
+    blocos_locais = (BlocoMemoria *)(regiao + tam_listras);
+    copysets = (uint64_t *)(regiao + tam_listras + tam_blocos);
+    arena_local = dados_dir && num_blocos_locais > 0 ? abrir_dados() : regiao + tam_listras + tam_blocos + tam_copysets;
+
+    pthread_mutexattr_t atributos;
+    pthread_mutexattr_init(&atributos);
+    if (compartilhada)
+        pthread_mutexattr_setpshared(&atributos, PTHREAD_PROCESS_SHARED);
+    for (int i = 0; i < NUM_LISTRAS_ESCRITA; i++)
+    {
+        pthread_mutex_init(&listras_escrita[i], &atributos);
+        pthread_cond_init(&conds_replicado[i], NULL);
+    }
+    pthread_mutexattr_destroy(&atributos);
+    for (int i = 0; i < num_blocos_locais; i++)
     {
-        uint32_t id_bloco_net;
-        recv_all(sock, (char *)&id_bloco_net, sizeof(uint32_t));
-        int id_bloco = ntohl(id_bloco_net);
-        pthread_mutex_lock(&cache_mutex);
-        for (int i = 0; i < tamanho_cache; i++)
+        blocos_locais[i].id = blocos_inicio + i;
+        blocos_locais[i].dados = arena_local + (size_t)i * stride_bloco;
+        blocos_locais[i].seq = 0;
+        blocos_locais[i].local = calcular_dono(blocos_inicio + i);
+        blocos_locais[i].ultimo_escritor = -1;
+        blocos_locais[i].escritas_seguidas = 0;
+        blocos_locais[i].replicado = 0;
+        if (!dados_dir)
+            memset(blocos_locais[i].dados, '-', T_BLOCO);
+    }
+}
+
+/* Este rank guarda as particoes dos R ranks anteriores; todas as copias comecam
+   pendentes e sao trazidas do dono em segundo plano. */
+void iniciar_replicas()
+{
+    encarnacao = ((uint32_t)agora_us() ^ ((uint32_t)getpid() << 16)) | 1;
+    versoes_minimas = calloc(K_BLOCOS, sizeof(uint32_t));
+    ler_do_dono = calloc(K_BLOCOS, 1);
+    replicas = calloc(num_replicas, sizeof(Replica));
+    for (int r = 0; r < num_replicas; r++)
+    {
+        Replica *replica = &replicas[r];
+        replica->rank = (my_rank - 1 - r + N_PROCESSOS) % N_PROCESSOS;
+        faixa_do_rank(replica->rank, &replica->inicio, &replica->fim);
+        int num_copias = replica->fim - replica->inicio + 1;
+        pthread_mutex_init(&replica->lock, NULL);
+        replica->copias = calloc(num_copias > 0 ? num_copias : 1, sizeof(CopiaReplica));
+        replica->copysets = calloc((size_t)(num_copias > 0 ? num_copias : 1) * palavras_copyset, sizeof(uint64_t));
+        char *arena = num_copias > 0 ? alocar_arena((size_t)num_copias * stride_bloco, 0) : NULL;
+        for (int i = 0; i < num_copias; i++)
         {
-            if (cache[i].id == id_bloco && cache[i].valido)
-            {
-                cache[i].valido = 0;
-                printf("[P%d] Cache para o bloco %d (slot %d) INVALIDADA.\n", my_rank, id_bloco, i);
-                break;
-            }
+            replica->copias[i].dados = arena + (size_t)i * stride_bloco;
+            replica->copias[i].pendente = 1;
         }
-        pthread_mutex_unlock(&cache_mutex);
-        break;
+        if (num_copias > 0)
+            LOG(LOG_INFO, "[P%d] Replica da particao do P%d (blocos %d a %d).\n", my_rank, replica->rank,
+                replica->inicio, replica->fim);
     }
-    default:
+    replicas_pendentes = 1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, executar_replicacao, NULL) != 0)
+        die("nao foi possivel criar a thread de replicacao");
+    pthread_detach(thread);
+}
+
+void uso(const char *programa)
+{
+    fprintf(stderr, "Uso: %s <num_processos> <num_blocos> <tamanho_bloco> [opcoes]\n", programa);
+    fprintf(stderr, "Opcoes:\n");
+    fprintf(stderr, "  --paginas-grandes        aloca as arenas de blocos em paginas grandes\n");
+    fprintf(stderr, "  --memoria-compartilhada  ranks da maquina acessam os blocos uns dos outros direto\n");
+    fprintf(stderr, "  --cache-politica <nome>  fifo (padrao), lru, clock ou arc\n");
+    fprintf(stderr, "  --cache-blocos <n>       capacidade da cache em blocos\n");
+    fprintf(stderr, "  --cache-bytes <n>        capacidade da cache em bytes\n");
+    fprintf(stderr, "  --estatisticas <s>       imprime as estatisticas a cada s segundos\n");
+    fprintf(stderr, "  --log-nivel <nivel>      erro, aviso, info (padrao), debug ou trace\n");
+    fprintf(stderr, "  --prefetch <n>           janela maxima de leitura antecipada em blocos (0 desliga)\n");
+    fprintf(stderr, "  --diffs <n>              escritas de ate n bytes atualizam as copias em vez de invalida-las\n");
+    fprintf(stderr, "  --atualizacao <a>-<b>    escritas nos blocos dos bytes [a, b) sempre atualizam as copias;\n");
+    fprintf(stderr, "                           pode ser repetida (ate %d regioes)\n", MAX_REGIOES_ATUALIZACAO);
+    fprintf(stderr, "  --migracao <n>           blocos escritos seguidamente por outro rank migram para ele;\n");
+    fprintf(stderr, "                           cada rank hospeda ate n blocos (0 desliga)\n");
+    fprintf(stderr, "  --consistencia <modo>    imediata (padrao) ou liberacao: escritas so chegam as copias\n");
+    fprintf(stderr, "                           de outros ranks no proximo ADQUIRIR ou BARREIRA\n");
+    fprintf(stderr, "  --dados-dir <dir>        blocos de cada rank num arquivo mapeado em dir, com log de escritas\n");
+    fprintf(stderr, "  --checkpoint <s>         intervalo maximo entre checkpoints do log (padrao 30)\n");
+    fprintf(stderr, "  --replicas <r>           particao de cada rank tambem nos r ranks seguintes, que\n");
+    fprintf(stderr, "                           recebem as escritas e atendem leituras (0 desliga)\n");
+    fprintf(stderr, "  --pares <arquivo>        tabela host:porta de cada rank, uma linha por rank\n");
+    fprintf(stderr, "  --rank <r>               executa so o rank r, sem criar os outros\n");
+    fprintf(stderr, "  --ranks <a>-<b>          executa os ranks de a a b nesta maquina\n");
+    exit(1);
+}
+
+const char *valor_opcao(int argc, char *argv[], int *i)
+{
+    if (*i + 1 >= argc)
+        uso(argv[0]);
+    return argv[++*i];
+}
+
+void ler_argumentos(int argc, char *argv[])
+{
+    int posicionais = 0;
+    for (int i = 1; i < argc; i++)
     {
-        uint32_t codigo_erro_net = htonl(ERRO_COMANDO_DESCONHECIDO);
-        send(sock, &codigo_erro_net, sizeof(uint32_t), 0);
+        if (strncmp(argv[i], "--", 2) != 0)
+        {
+            if (posicionais == 0)
+                N_PROCESSOS = atoi(argv[i]);
+            else if (posicionais == 1)
+                K_BLOCOS = atoi(argv[i]);
+            else if (posicionais == 2)
+                T_BLOCO = atoi(argv[i]);
+            else
+                uso(argv[0]);
+            posicionais++;
+        }
+        else if (strcmp(argv[i], "--paginas-grandes") == 0)
+            usar_paginas_grandes = 1;
+        else if (strcmp(argv[i], "--memoria-compartilhada") == 0)
+            usar_memoria_compartilhada = 1;
+        else if (strcmp(argv[i], "--cache-politica") == 0)
+        {
+            politica_cache = buscar_politica_cache(valor_opcao(argc, argv, &i));
+            if (!politica_cache)
+                uso(argv[0]);
+        }
+        else if (strcmp(argv[i], "--cache-blocos") == 0)
+            cache_blocos = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--cache-bytes") == 0)
+            cache_bytes = atol(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--estatisticas") == 0)
+            intervalo_estatisticas = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--log-nivel") == 0)
+        {
+            nivel_log = buscar_nivel_log(valor_opcao(argc, argv, &i));
+            if (nivel_log < 0)
+                uso(argv[0]);
+        }
+        else if (strcmp(argv[i], "--prefetch") == 0)
+            janela_prefetch_maxima = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--diffs") == 0)
+            limite_diff = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--atualizacao") == 0)
+        {
+            RegiaoAtualizacao *regiao = &regioes_atualizacao[num_regioes_atualizacao];
+            if (num_regioes_atualizacao == MAX_REGIOES_ATUALIZACAO ||
+                sscanf(valor_opcao(argc, argv, &i), "%d-%d", &regiao->inicio, &regiao->fim) != 2 ||
+                regiao->inicio < 0 || regiao->fim <= regiao->inicio)
+                uso(argv[0]);
+            num_regioes_atualizacao++;
+        }
+        else if (strcmp(argv[i], "--migracao") == 0)
+            limite_migracao = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--consistencia") == 0)
+        {
+            const char *modo = valor_opcao(argc, argv, &i);
+            if (strcmp(modo, "liberacao") == 0)
+                consistencia_liberacao = 1;
+            else if (strcmp(modo, "imediata") != 0)
+                uso(argv[0]);
+        }
+        else if (strcmp(argv[i], "--dados-dir") == 0)
+            dados_dir = valor_opcao(argc, argv, &i);
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+            intervalo_checkpoint = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--replicas") == 0)
+            num_replicas = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--pares") == 0)
+            arquivo_pares = valor_opcao(argc, argv, &i);
+        else if (strcmp(argv[i], "--rank") == 0)
+            rank_primeiro = rank_ultimo = atoi(valor_opcao(argc, argv, &i));
+        else if (strcmp(argv[i], "--ranks") == 0)
+        {
+            if (sscanf(valor_opcao(argc, argv, &i), "%d-%d", &rank_primeiro, &rank_ultimo) != 2)
+                uso(argv[0]);
+        }
+        else
+            uso(argv[0]);
+    }
+    if (posicionais != 3 || intervalo_checkpoint <= 0 || num_replicas < 0)
+        uso(argv[0]);
+    /* Com memoria compartilhada os blocos de todos os ranks ficam numa regiao so, e
+       blocos migrados vivem fora do arquivo do rank de origem. */
+    if (dados_dir && (usar_memoria_compartilhada || limite_migracao > 0))
+    {
+        fprintf(stderr, "--dados-dir nao pode ser usado com --memoria-compartilhada nem com --migracao.\n");
+        exit(1);
     }
+    /* As replicas seguem calcular_dono: um bloco migrado ou escrito direto na memoria
+       de outro rank nao passaria pelo dono. */
+    if (num_replicas > 0 && (num_replicas >= N_PROCESSOS || usar_memoria_compartilhada || limite_migracao > 0))
+    {
+        fprintf(stderr, "--replicas deve ser menor que o numero de processos e nao pode ser usado com "
+                        "--memoria-compartilhada nem com --migracao.\n");
+        exit(1);
     }
-    close(sock);
-    return NULL;
+    if (!politica_cache)
+        politica_cache = buscar_politica_cache("fifo");
 }
 
-int main(int argc, char *argv[])
+void resolver_par(EnderecoPar *par)
+{
+    struct addrinfo dicas, *resultado;
+    memset(&dicas, 0, sizeof(dicas));
+    dicas.ai_family = AF_INET;
+    dicas.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(par->host, NULL, &dicas, &resultado) != 0)
+    {
+        fprintf(stderr, "Nao foi possivel resolver o host %s.\n", par->host);
+        exit(1);
+    }
+    memcpy(&par->endereco, resultado->ai_addr, sizeof(par->endereco));
+    par->endereco.sin_port = htons(par->porta);
+    freeaddrinfo(resultado);
+}
+
+/* Sem --pares, todos os ranks ficam nesta maquina, em BASE_PORT + rank. O arquivo
+   tem uma linha host:porta por rank, na ordem dos ranks; linhas vazias e as que
+   comecam com # sao ignoradas. */
+void carregar_pares()
 {
-    if (argc != 4)
+    enderecos_pares = calloc(N_PROCESSOS, sizeof(EnderecoPar));
+    if (!arquivo_pares)
+    {
+        for (int r = 0; r < N_PROCESSOS; r++)
+        {
+            strcpy(enderecos_pares[r].host, "127.0.0.1");
+            enderecos_pares[r].porta = BASE_PORT + r;
+            resolver_par(&enderecos_pares[r]);
+        }
+        return;
+    }
+    FILE *arquivo = fopen(arquivo_pares, "r");
+    if (!arquivo)
+    {
+        fprintf(stderr, "Nao foi possivel abrir a tabela de pares %s.\n", arquivo_pares);
+        exit(1);
+    }
+    char linha[TAM_HOST + 32];
+    int lidos = 0, numero_linha = 0;
+    while (fgets(linha, sizeof(linha), arquivo))
+    {
+        numero_linha++;
+        char *inicio = linha + strspn(linha, " \t");
+        inicio[strcspn(inicio, " \t\r\n")] = '\0';
+        if (*inicio == '\0' || *inicio == '#')
+            continue;
+        char *separador = strrchr(inicio, ':');
+        int porta = separador ? atoi(separador + 1) : 0;
+        if (!separador || separador == inicio || separador - inicio >= TAM_HOST || porta <= 0 || porta > 65535 ||
+            lidos >= N_PROCESSOS)
+        {
+            fprintf(stderr, "%s:%d: esperado host:porta (%d ranks).\n", arquivo_pares, numero_linha, N_PROCESSOS);
+            exit(1);
+        }
+        *separador = '\0';
+        strcpy(enderecos_pares[lidos].host, inicio);
+        enderecos_pares[lidos].porta = porta;
+        resolver_par(&enderecos_pares[lidos]);
+        lidos++;
+    }
+    fclose(arquivo);
+    if (lidos != N_PROCESSOS)
     {
-        fprintf(stderr, "Uso: %s <num_processos> <num_blocos> <tamanho_bloco>\n", argv[0]);
+        fprintf(stderr, "%s tem %d pares, esperados %d.\n", arquivo_pares, lidos, N_PROCESSOS);
         exit(1);
     }
-    N_PROCESSOS = atoi(argv[1]);
-    K_BLOCOS = atoi(argv[2]);
-    T_BLOCO = atoi(argv[3]);
+}
+
+/* Marca os blocos que tocam alguma regiao de --atualizacao. */
+void marcar_regioes_atualizacao()
+{
+    if (num_regioes_atualizacao == 0)
+        return;
+    blocos_atualizacao = calloc(K_BLOCOS, 1);
+    for (int r = 0; r < num_regioes_atualizacao; r++)
+    {
+        RegiaoAtualizacao *regiao = &regioes_atualizacao[r];
+        int fim = regiao->fim < K_BLOCOS * T_BLOCO ? regiao->fim : K_BLOCOS * T_BLOCO;
+        for (int id = regiao->inicio / T_BLOCO; id < K_BLOCOS && id * T_BLOCO < fim; id++)
+            blocos_atualizacao[id] = 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    ler_argumentos(argc, argv);
     if (N_PROCESSOS <= 0 || K_BLOCOS <= 0 || T_BLOCO <= 0)
     {
         fprintf(stderr, "Argumentos devem ser numeros positivos.\n");
         exit(1);
     }
-    pid_t pids[N_PROCESSOS];
-    for (int i = 0; i < N_PROCESSOS - 1; i++)
+    /* As posicoes do protocolo sao int de 32 bits. */
+    if ((long)K_BLOCOS * T_BLOCO > INT_MAX)
+    {
+        fprintf(stderr, "num_blocos * tamanho_bloco deve caber em 32 bits.\n");
+        exit(1);
+    }
+    stride_bloco = (T_BLOCO + LINHA_CACHE - 1) / LINHA_CACHE * LINHA_CACHE;
+    palavras_copyset = (N_PROCESSOS + 63) / 64;
+    marcar_regioes_atualizacao();
+    carregar_pares();
+    /* Sem --rank/--ranks, esta maquina executa todos os ranks. Os ranks de uma mesma
+       execucao sao os que podem dividir a memoria com --memoria-compartilhada. */
+    if (rank_primeiro < 0 && rank_ultimo < 0)
+    {
+        rank_primeiro = 0;
+        rank_ultimo = N_PROCESSOS - 1;
+    }
+    if (rank_primeiro < 0 || rank_primeiro > rank_ultimo || rank_ultimo >= N_PROCESSOS)
+    {
+        fprintf(stderr, "Ranks devem estar entre 0 e %d.\n", N_PROCESSOS - 1);
+        exit(1);
+    }
+    if (usar_memoria_compartilhada)
+        iniciar_blocos(rank_primeiro, rank_ultimo, 1);
+    my_rank = rank_primeiro;
+    for (int r = rank_primeiro + 1; r <= rank_ultimo; r++)
     {
-        pids[i] = fork();
-        if (pids[i] < 0)
+        pid_t pid = fork();
+        if (pid < 0)
             die("fork falhou");
-        if (pids[i] == 0)
+        if (pid == 0)
         {
-            my_rank = i + 1;
+            my_rank = r;
+            descartar_log_herdado();
             break;
         }
     }
-    printf("[P%d] Iniciado. PID: %d\n", my_rank, getpid());
-    int blocos_por_processo = K_BLOCOS / N_PROCESSOS;
-    int blocos_inicio = my_rank * blocos_por_processo;
-    int blocos_fim = (my_rank == N_PROCESSOS - 1) ? (K_BLOCOS - 1) : (blocos_inicio + blocos_por_processo - 1);
-    num_blocos_locais = blocos_fim - blocos_inicio + 1;
-    if (num_blocos_locais > 0)
+    if (!usar_memoria_compartilhada)
+        iniciar_blocos(my_rank, my_rank, 0);
+    pthread_t thread_log;
+    if (pthread_create(&thread_log, NULL, executar_log, NULL) != 0)
+        die("nao foi possivel criar a thread de log");
+    pthread_detach(thread_log);
+    LOG(LOG_INFO, "[P%d] Iniciado. PID: %d\n", my_rank, getpid());
+    int meu_inicio, meu_fim;
+    faixa_do_rank(my_rank, &meu_inicio, &meu_fim);
+    if (meu_fim >= meu_inicio)
+        LOG(LOG_INFO, "[P%d] Responsavel pelos blocos de %d a %d.\n", my_rank, meu_inicio, meu_fim);
+    else
+        LOG(LOG_INFO, "[P%d] Sem blocos proprios (ha menos blocos que processos).\n", my_rank);
+    if (usar_memoria_compartilhada)
+        LOG(LOG_INFO, "[P%d] Blocos %d a %d acessados pela memoria compartilhada.\n", my_rank, blocos_inicio,
+            blocos_inicio + num_blocos_locais - 1);
+    int tamanho_cache;
+    if (cache_blocos >= 0)
+        tamanho_cache = cache_blocos;
+    else if (cache_bytes >= 0)
+        tamanho_cache = (int)(cache_bytes / T_BLOCO);
+    else
     {
-        blocos_locais = malloc(sizeof(BlocoMemoria) * num_blocos_locais);
-        for (int i = 0; i < num_blocos_locais; i++)
-        {
-            blocos_locais[i].id = blocos_inicio + i;
-            blocos_locais[i].dados = malloc(T_BLOCO);
-            memset(blocos_locais[i].dados, '-', T_BLOCO);
-        }
+        tamanho_cache = (int)(K_BLOCOS * 0.20);
+        if (tamanho_cache == 0 && K_BLOCOS > 0)
+            tamanho_cache = 1;
     }
-    printf("[P%d] Responsavel pelos blocos de %d a %d.\n", my_rank, blocos_inicio, blocos_fim);
-    tamanho_cache = (int)(K_BLOCOS * 0.20);
-    if (tamanho_cache == 0 && K_BLOCOS > 0)
-        tamanho_cache = 1;
-    if (tamanho_cache > 0)
+    caches_iniciar(tamanho_cache, politica_cache);
+    LOG(LOG_INFO, "[P%d] Tamanho da cache: %d blocos (politica %s).\n", my_rank, tamanho_cache, politica_cache->nome);
+    inicializar_conexoes_pares();
+    trafego_pares = calloc(N_PROCESSOS, sizeof(TrafegoPar));
+    dicas_dono = malloc(sizeof(int) * K_BLOCOS);
+    epocas_blocos = calloc(K_BLOCOS, sizeof(uint32_t));
+    for (int i = 0; i < K_BLOCOS; i++)
+        dicas_dono[i] = -1;
+    if (limite_migracao > 0)
     {
-        printf("[P%d] Tamanho da cache: %d blocos.\n", my_rank, tamanho_cache);
-        cache = malloc(sizeof(BlocoCache) * tamanho_cache);
-        for (int i = 0; i < tamanho_cache; i++)
-        {
-            cache[i].id = -1;
-            cache[i].dados = malloc(T_BLOCO);
-            cache[i].valido = 0;
-        }
+        iniciar_hospedados();
+        LOG(LOG_INFO, "[P%d] Migracao de blocos ativa (ate %d blocos hospedados).\n", my_rank, limite_migracao);
+    }
+    if (num_replicas > 0)
+        iniciar_replicas();
+    if (wal.fd >= 0)
+    {
+        pthread_t thread_checkpoint;
+        if (pthread_create(&thread_checkpoint, NULL, executar_checkpoints, NULL) != 0)
+            die("nao foi possivel criar a thread de checkpoint");
+        pthread_detach(thread_checkpoint);
     }
-    pthread_mutex_init(&cache_mutex, NULL);
+    for (int r = 0; r < num_regioes_atualizacao; r++)
+        LOG(LOG_INFO, "[P%d] Regiao de atualizacao: bytes %d a %d (escritas atualizam as copias).\n", my_rank,
+            regioes_atualizacao[r].inicio, regioes_atualizacao[r].fim - 1);
+    indice_iniciar(&indice_travas, MAX_TRAVAS);
+    indice_iniciar(&indice_barreiras, MAX_BARREIRAS);
+    if (consistencia_liberacao)
+        LOG(LOG_INFO, "[P%d] Consistencia de liberacao: copias so sao invalidadas em ADQUIRIR e BARREIRA.\n",
+            my_rank);
+    /* Blocos antecipados ocupam no maximo metade da cache, para nao expulsar os que
+       a propria varredura ainda vai ler. */
+    if (janela_prefetch_maxima > tamanho_cache / 2)
+        janela_prefetch_maxima = tamanho_cache / 2;
+    if (janela_prefetch_maxima > 0)
+    {
+        iniciar_prefetch();
+        LOG(LOG_INFO, "[P%d] Prefetch sequencial com janela de ate %d blocos.\n", my_rank, janela_prefetch_maxima);
+    }
+    signal(SIGPIPE, SIG_IGN);
 
     int listening_socket;
     struct sockaddr_in server;
@@ -461,24 +4984,32 @@ int main(int argc, char *argv[])
         die("setsockopt falhou");
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(BASE_PORT + my_rank);
+    server.sin_port = htons(enderecos_pares[my_rank].porta);
     if (bind(listening_socket, (struct sockaddr *)&server, sizeof(server)) < 0)
         die("bind falhou");
     listen(listening_socket, MAX_CONEXOES);
-    printf("[P%d] Escutando na porta %d...\n", my_rank, BASE_PORT + my_rank);
+    fcntl(listening_socket, F_SETFL, fcntl(listening_socket, F_GETFL, 0) | O_NONBLOCK);
+    LOG(LOG_INFO, "[P%d] Escutando na porta %d...\n", my_rank, enderecos_pares[my_rank].porta);
 
-    while (1)
+    int num_trabalhadores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_trabalhadores < MIN_TRABALHADORES)
+        num_trabalhadores = MIN_TRABALHADORES;
+    iniciar_pool(&pool_clientes, "de clientes", num_trabalhadores);
+    /* Cada par tem uma conexao que pode ficar parada num trabalhador interno,
+       esperando confirmacoes de invalidacao; sobram sempre trabalhadores para as
+       conexoes de invalidacao, que confirmam sem esperar. */
+    iniciar_pool(&pool_interno, "interno",
+                 num_trabalhadores > N_PROCESSOS + 1 ? num_trabalhadores : N_PROCESSOS + 1);
+    if (intervalo_estatisticas > 0)
     {
-        int client_sock = accept(listening_socket, NULL, NULL);
-        if (client_sock < 0)
-            continue;
-        pthread_t connection_thread;
-        int *new_sock = malloc(sizeof(int));
-        *new_sock = client_sock;
-        if (pthread_create(&connection_thread, NULL, handle_connection, (void *)new_sock) < 0)
-        {
-            perror("nao foi possivel criar a thread");
-        }
+        pthread_t thread_estatisticas;
+        if (pthread_create(&thread_estatisticas, NULL, despejar_estatisticas, NULL) != 0)
+            die("nao foi possivel criar a thread de estatisticas");
+        pthread_detach(thread_estatisticas);
     }
+    reator_criar();
+    if (reator_armar(listening_socket, &conexao_escuta, 1) < 0)
+        die("registro no reator falhou");
+    executar_reator(listening_socket);
     return 0;
 }
\ No newline at end of file